@@ -17,9 +17,11 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include "asyncresult.h"
 #include "database.h"
 #include "document.h"
 #include "index.h"
+#include "lazydocument.h"
 #include "query.h"
 #include "synchronizer.h"
 #include "plugin.h"
@@ -34,5 +36,7 @@ void U1DBPlugin::registerTypes(const char *uri)
     qmlRegisterType<Index>(uri, 1, 0, "Index");
     qmlRegisterType<Query>(uri, 1, 0, "Query");
     qmlRegisterType<Synchronizer>(uri, 1, 0, "Synchronizer");
+    qmlRegisterUncreatableType<AsyncResult>(uri, 1, 0, "AsyncResult", "AsyncResult is returned by Database");
+    qmlRegisterUncreatableType<LazyDocument>(uri, 1, 0, "LazyDocument", "LazyDocument is returned by Database");
 }
 
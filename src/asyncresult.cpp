@@ -0,0 +1,171 @@
+/*
+ * Copyright (C) 2013 Canonical, Ltd.
+ *
+ * Authors:
+ *  Christian Dywan <christian.dywan@canonical.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "asyncresult.h"
+#include "private.h"
+
+QT_BEGIN_NAMESPACE_U1DB
+
+/*!
+    \class AsyncResult
+    \inmodule U1db
+    \ingroup cpp
+
+    \brief The AsyncResult class tracks an operation that runs in the background.
+
+    It is returned by the asynchronous functions of Database such as
+    Database::putDocAsync(). The finished() signal is emitted on the thread
+    that owns the Database, in the order the operations were requested.
+    The AsyncResult is deleted after finished() was emitted, use future()
+    to keep hold of the result from C++.
+ */
+
+/*!
+    \qmltype AsyncResult
+    \instantiates AsyncResult
+    \inqmlmodule U1db 1.0
+    \ingroup modules
+
+    \brief AsyncResult tracks an operation that runs in the background.
+
+    It's returned by functions such as Database::putDocAsync() and is deleted
+    after the finished signal was emitted.
+
+    \code
+    database.getDocAsync("hello").finished.connect(function(contents) {
+        console.log(contents.hello)
+    })
+    \endcode
+ */
+
+/*!
+    Instantiate a new AsyncResult for \a operation with an optional \a parent.
+ */
+AsyncResult::AsyncResult(Operation operation, QObject *parent) :
+    QObject(parent), m_operation(operation), m_storageFormat(0), m_cacheSize(0), m_mmapSize(-1),
+    m_pageSize(0), m_documentCacheSize(0), m_compactionThreshold(0), m_finished(false)
+{
+    m_future.reportStarted();
+}
+
+AsyncResult::~AsyncResult()
+{
+    // Don't leave anyone waiting for an operation that will never finish
+    if (!m_future.isFinished())
+    {
+        m_future.reportCanceled();
+        m_future.reportFinished();
+    }
+}
+
+/*!
+    \qmlproperty bool AsyncResult::pending
+    Whether the operation is still running.
+ */
+/*!
+    Returns whether the operation is still running.
+ */
+bool
+AsyncResult::isPending()
+{
+    return !m_finished;
+}
+
+/*!
+    \qmlproperty Variant AsyncResult::result
+    The return value of the operation once it finished.
+ */
+/*!
+    Returns the return value of the operation once it finished.
+ */
+QVariant
+AsyncResult::getResult()
+{
+    return m_finished ? m_result : QVariant();
+}
+
+/*!
+    \qmlproperty string AsyncResult::docId
+    The docId of the document that was written or loaded, which is the newly
+    generated docId if putDocAsync() was called without one.
+ */
+/*!
+    Returns the docId of the document that was written or loaded.
+ */
+QString
+AsyncResult::getDocId()
+{
+    return m_finished ? m_docId : QString();
+}
+
+/*!
+    \qmlproperty string AsyncResult::error
+    The error as a string if the operation failed.
+ */
+/*!
+    Returns the error as a string if the operation failed.
+ */
+QString
+AsyncResult::lastError()
+{
+    return m_finished ? m_error : QString();
+}
+
+/*!
+    Returns a future that receives the result as soon as the operation was
+    carried out. Unlike the finished() signal it doesn't depend on the event
+    loop of the thread owning the Database.
+ */
+QFuture<QVariant>
+AsyncResult::future()
+{
+    return m_future.future();
+}
+
+/*!
+    \internal
+    Stores the \a result, \a docId and \a error of the operation. This may be
+    called from the worker thread, the owner thread is notified via completed().
+ */
+void
+AsyncResult::complete(const QVariant& result, const QString& docId, const QString& error)
+{
+    m_result = result;
+    m_docId = docId;
+    m_error = error;
+    m_future.reportResult(result);
+    m_future.reportFinished();
+    Q_EMIT completed(this);
+}
+
+/*!
+    \internal
+    Announces the result on the owner thread and schedules deletion.
+ */
+void
+AsyncResult::finish()
+{
+    m_finished = true;
+    Q_EMIT finished(m_result);
+    deleteLater();
+}
+
+QT_END_NAMESPACE_U1DB
+
+#include "moc_asyncresult.cpp"
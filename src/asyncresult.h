@@ -0,0 +1,97 @@
+/*
+ * Copyright (C) 2013 Canonical, Ltd.
+ *
+ * Authors:
+ *  Christian Dywan <christian.dywan@canonical.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef U1DB_ASYNCRESULT_H
+#define U1DB_ASYNCRESULT_H
+
+#include <QtCore/QObject>
+#include <QVariant>
+#include <QFuture>
+#include <QFutureInterface>
+
+#include "global.h"
+
+QT_BEGIN_NAMESPACE_U1DB
+
+class Q_DECL_EXPORT AsyncResult : public QObject {
+    Q_OBJECT
+    /*! pending */
+    Q_PROPERTY(bool pending READ isPending NOTIFY finished)
+    /*! result */
+    Q_PROPERTY(QVariant result READ getResult NOTIFY finished)
+    /*! docId */
+    Q_PROPERTY(QString docId READ getDocId NOTIFY finished)
+    /*! error */
+    Q_PROPERTY(QString error READ lastError NOTIFY finished)
+public:
+    enum Operation {
+        GetDoc,
+        PutDoc,
+        ListDocs,
+        Backup
+    };
+
+    AsyncResult(Operation operation, QObject* parent = 0);
+    ~AsyncResult();
+
+    bool isPending();
+    QVariant getResult();
+    QString getDocId();
+    QString lastError();
+    QFuture<QVariant> future();
+Q_SIGNALS:
+    /*!
+        The operation finished, \a result is its return value.
+     */
+    void finished(const QVariant& result);
+    /*!
+        \internal
+        The operation was carried out, possibly on another thread.
+     */
+    void completed(AsyncResult* result);
+private:
+    Q_DISABLE_COPY(AsyncResult)
+    friend class Database;
+    friend class DatabaseWorker;
+    friend class BackupJob;
+
+    Operation m_operation;
+    QString m_path;
+    int m_storageFormat;
+    QString m_journalMode;
+    QString m_synchronous;
+    int m_cacheSize;
+    qint64 m_mmapSize;
+    int m_pageSize;
+    int m_documentCacheSize;
+    int m_compactionThreshold;
+    QVariant m_contents;
+    QString m_docId;
+    QVariant m_result;
+    QString m_error;
+    bool m_finished;
+    QFutureInterface<QVariant> m_future;
+
+    void complete(const QVariant& result, const QString& docId, const QString& error);
+    void finish();
+};
+
+QT_END_NAMESPACE_U1DB
+
+#endif // U1DB_ASYNCRESULT_H
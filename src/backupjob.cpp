@@ -0,0 +1,172 @@
+/*
+ * Copyright (C) 2013 Canonical, Ltd.
+ *
+ * Authors:
+ *  Christian Dywan <christian.dywan@canonical.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QDir>
+#include <QFileInfo>
+#include <sqlite3.h>
+
+#include "backupjob.h"
+#include "asyncresult.h"
+#include "private.h"
+
+QT_BEGIN_NAMESPACE_U1DB
+
+const int BackupJob::BUSY_INTERVAL = 75;
+
+BackupJob::BackupJob(AsyncResult* result, QObject *parent) :
+    QObject(parent), m_result(result), m_destination(0), m_backup(0), m_pagesPerStep(-1)
+{
+}
+
+BackupJob::~BackupJob()
+{
+    // A backup that didn't finish is rolled back, leaving the file as it was
+    if (m_backup)
+        sqlite3_backup_finish(m_backup);
+    if (m_destination)
+        sqlite3_close(m_destination);
+    if (m_result && m_result->isPending())
+        m_result->complete(false, QString(), "Backup was aborted");
+}
+
+/*
+    Opens the database file at \a path, creating it unless \a readOnly.
+ */
+sqlite3*
+BackupJob::open(const QString& path, bool readOnly, QString& error)
+{
+    if (!readOnly)
+    {
+        QDir parent(QFileInfo(path).dir());
+        parent.mkpath(parent.path());
+    }
+
+    sqlite3* db = 0;
+    int flags = readOnly ? SQLITE_OPEN_READONLY : SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
+    if (sqlite3_open_v2(path.toUtf8().constData(), &db, flags, 0) != SQLITE_OK)
+    {
+        error = QString("Failed to open '%1': %2").arg(path).arg(db ? sqlite3_errmsg(db) : "out of memory");
+        sqlite3_close(db);
+        return 0;
+    }
+    return db;
+}
+
+/*
+    Closes \a db as returned by open(), which may be 0.
+ */
+void
+BackupJob::close(sqlite3* db)
+{
+    if (db)
+        sqlite3_close(db);
+}
+
+/*
+    Copies all of \a source to \a destination in one go.
+ */
+bool
+BackupJob::copy(sqlite3* source, sqlite3* destination, QString& error)
+{
+    sqlite3_backup* backup = sqlite3_backup_init(destination, "main", source, "main");
+    if (!backup)
+    {
+        error = QString("Failed to copy database: %1").arg(sqlite3_errmsg(destination));
+        return false;
+    }
+    sqlite3_backup_step(backup, -1);
+    if (sqlite3_backup_finish(backup) != SQLITE_OK)
+    {
+        error = QString("Failed to copy database: %1").arg(sqlite3_errmsg(destination));
+        return false;
+    }
+    return true;
+}
+
+/*
+    Starts copying \a source to the file at \a path, \a pagesPerStep pages
+    at a time or all at once if it's negative.
+ */
+bool
+BackupJob::start(sqlite3* source, const QString& path, int pagesPerStep)
+{
+    QString error;
+    m_destination = open(path, false, error);
+    if (!m_destination)
+    {
+        finish(false, error);
+        return false;
+    }
+
+    m_backup = sqlite3_backup_init(m_destination, "main", source, "main");
+    if (!m_backup)
+    {
+        finish(false, QString("Failed to start backup to '%1': %2").arg(path).arg(sqlite3_errmsg(m_destination)));
+        return false;
+    }
+
+    m_pagesPerStep = pagesPerStep == 0 ? -1 : pagesPerStep;
+    QObject::connect(&m_timer, &QTimer::timeout, this, &BackupJob::step);
+    m_timer.start(0);
+    return true;
+}
+
+void
+BackupJob::step()
+{
+    // Pages changed by other connections make the backup start over
+    int status = sqlite3_backup_step(m_backup, m_pagesPerStep);
+    if (status == SQLITE_OK)
+    {
+        m_timer.setInterval(0);
+        return;
+    }
+    // Give the writer holding the lock time to finish instead of spinning
+    if (status == SQLITE_BUSY || status == SQLITE_LOCKED)
+    {
+        m_timer.setInterval(BUSY_INTERVAL);
+        return;
+    }
+
+    m_timer.stop();
+    status = sqlite3_backup_finish(m_backup);
+    m_backup = 0;
+    if (status == SQLITE_OK)
+        finish(true, QString());
+    else
+        finish(false, QString("Failed to back up database: %1").arg(sqlite3_errmsg(m_destination)));
+}
+
+void
+BackupJob::finish(bool success, const QString& error)
+{
+    if (m_destination)
+    {
+        sqlite3_close(m_destination);
+        m_destination = 0;
+    }
+    if (m_result)
+        m_result->complete(success, QString(), error);
+    m_result = 0;
+    deleteLater();
+}
+
+QT_END_NAMESPACE_U1DB
+
+#include "moc_backupjob.cpp"
@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2013 Canonical, Ltd.
+ *
+ * Authors:
+ *  Christian Dywan <christian.dywan@canonical.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef U1DB_BACKUPJOB_H
+#define U1DB_BACKUPJOB_H
+
+#include <QtCore/QObject>
+#include <QPointer>
+#include <QTimer>
+
+#include "global.h"
+
+struct sqlite3;
+struct sqlite3_backup;
+
+QT_BEGIN_NAMESPACE_U1DB
+
+class AsyncResult;
+
+/*
+    Copies a database to a file with the online backup API of SQLite, a few
+    pages at a time from the event loop so that writers aren't blocked.
+ */
+class BackupJob : public QObject {
+    Q_OBJECT
+public:
+    BackupJob(AsyncResult* result, QObject* parent = 0);
+    ~BackupJob();
+
+    bool start(sqlite3* source, const QString& path, int pagesPerStep);
+    static bool copy(sqlite3* source, sqlite3* destination, QString& error);
+    static sqlite3* open(const QString& path, bool readOnly, QString& error);
+    static void close(sqlite3* db);
+
+private Q_SLOTS:
+    void step();
+
+private:
+    Q_DISABLE_COPY(BackupJob)
+    static const int BUSY_INTERVAL;
+    QPointer<AsyncResult> m_result;
+    sqlite3* m_destination;
+    sqlite3_backup* m_backup;
+    int m_pagesPerStep;
+    QTimer m_timer;
+
+    void finish(bool success, const QString& error);
+};
+
+QT_END_NAMESPACE_U1DB
+
+#endif // U1DB_BACKUPJOB_H
@@ -23,18 +23,38 @@
 #include <QStandardPaths>
 #include <QDir>
 #include <QSqlError>
+#include <QSqlDriver>
+#include <QTimer>
 #include <QUrl>
 #include <QUuid>
+#include <QDateTime>
 #include <QStringList>
 #include <QJsonDocument>
 #include <QJsonObject>
+#include <QThread>
+#include <QThreadStorage>
+#include <QMutexLocker>
+#include <limits>
+#include <QElapsedTimer>
+#include <sqlite3.h>
+#if QT_VERSION >= QT_VERSION_CHECK(5, 12, 0)
+#include <QCborValue>
+#include <QCborMap>
+#endif
 
 #include "database.h"
+#include "databaseworker.h"
+#include "backupjob.h"
+#include "revision.h"
 #include "private.h"
 
 QT_BEGIN_NAMESPACE_U1DB
 
 const QString Database::MEMORY_PATH = ":memory:";
+const int Database::PAGE_SIZE = 100;
+const int Database::DOCUMENT_CACHE_SIZE = 4 * 1024 * 1024;
+const int Database::MODEL_WINDOW = 5 * Database::PAGE_SIZE;
+const int Database::SCHEMA_VERSION = 5;
 
 namespace
 {
@@ -49,10 +69,25 @@ public:
     }
 
     ~ScopedTransaction()
+    {
+        commit();
+    }
+
+    void commit()
     {
         if (m_transaction)
         {
             m_db.commit();
+            m_transaction = false;
+        }
+    }
+
+    void rollback()
+    {
+        if (m_transaction)
+        {
+            m_db.rollback();
+            m_transaction = false;
         }
     }
 
@@ -60,836 +95,3823 @@ public:
 
     bool m_transaction;
 };
+
+/*
+    Binary JSON starts with its "qbjs" tag and CBOR with a map header, text
+    JSON never starts with either of them.
+ */
+bool
+isBinaryContent(const QByteArray& content)
+{
+    if (content.startsWith("qbjs"))
+        return true;
+#if QT_VERSION >= QT_VERSION_CHECK(5, 12, 0)
+    if (!content.isEmpty() && (static_cast<uchar>(content.at(0)) & 0xE0) == 0xA0)
+        return true;
+#endif
+    return false;
 }
 
-/*!
-    \class Database
-    \inmodule U1Db
-    \ingroup cpp
+/*
+    Returns the JSON path understood by SQLite for the dotted \a field. Keys
+    are quoted so that they may contain any character but double quotes.
+ */
+QString
+jsonPath(const QString& field)
+{
+    QString path("$");
+    Q_FOREACH (const QString& key, field.split('.'))
+        path += QString(".\"%1\"").arg(key);
+    return path;
+}
 
-    \brief The Database class implements on-disk storage for documents and indexes.
+/*
+    Converts a \a value returned by json_extract() according to the JSON
+    \a type of SQLite, which tells booleans and nested values apart.
+ */
+QVariant
+fromJsonType(const QVariant& value, const QString& type)
+{
+    if (type == "true" || type == "false")
+        return type == "true";
+    if (type == "null")
+        return QVariant();
+    if (type == "object" || type == "array")
+        return QJsonDocument::fromJson(value.toString().toUtf8()).toVariant();
+    return value;
+}
 
-    Database can be used as a QAbstractListModel, delegates will then have access to \a docId and \a contents
-    analogous to the properties of Document.
-*/
+/*
+    Looks up the dotted \a field in \a contents, returns false if it's missing.
+ */
+bool
+lookupField(const QVariantMap& contents, const QString& field, QVariant& value)
+{
+    QVariant section(contents);
+    Q_FOREACH (const QString& key, field.split('.'))
+    {
+        QVariantMap map(section.toMap());
+        if (!map.contains(key))
+            return false;
+        section = map.value(key);
+    }
+    value = section;
+    return true;
+}
 
-/*!
-    \qmltype Database
-    \instantiates Database
-    \inqmlmodule U1Db 1.0
-    \ingroup modules
+/*
+    Stores \a value under the dotted \a field of \a contents, adding the
+    objects along the way.
+ */
+void
+insertField(QVariantMap& contents, const QString& field, const QVariant& value)
+{
+    int dot = field.indexOf('.');
+    if (dot < 0)
+    {
+        contents.insert(field, value);
+        return;
+    }
+    QString key(field.left(dot));
+    QVariantMap section(contents.value(key).toMap());
+    insertField(section, field.mid(dot + 1), value);
+    contents.insert(key, section);
+}
 
-    \brief Database implements on-disk storage for documents and indexes.
+/*
+    Reads the internal schema from the resources.
+ */
+QByteArray
+readSchemaScript()
+{
+    QFile file(":/dbschema.sql");
+    if (!file.open(QIODevice::ReadOnly))
+        return QByteArray();
+    return file.readAll();
+}
 
-    In a ListView the Database can be used as a model which includes all documents
-    in the database. For listing only a subset of documents Query can be used.
+/*
+    Returns the SQLite connection behind \a db for use with the C API, or 0
+    if the driver doesn't use the same SQLite that u1db is linked against.
+    Qt may be built with its own copy of SQLite, whose connections must not
+    be passed to another build of the library.
+ */
+sqlite3*
+sqliteHandle(const QSqlDatabase& db)
+{
+    QVariant handle(db.driver()->handle());
+    if (!handle.isValid() || qstrcmp(handle.typeName(), "sqlite3*") != 0)
+        return 0;
 
-    \qml
-    ListView {
-        model: Database {
-            id: myDatabase
+    QSqlQuery query(db);
+    if (!(query.exec("SELECT sqlite_source_id()") && query.next())
+        || query.value(0).toString() != QLatin1String(sqlite3_sourceid()))
+        return 0;
+    return *static_cast<sqlite3**>(handle.data());
+}
+
+/*
+    The number of prepared statements kept per connection. Statements are
+    generated for each number of patterns or fields, the least recently
+    used ones are finalized first.
+ */
+const int STATEMENT_CACHE_SIZE = 64;
+
+/*
+    A read-only connection that a thread uses to read from a Database owned
+    by another thread, along with its own prepared statements.
+ */
+struct ReadConnection
+{
+    QSqlDatabase db;
+    QCache<QString, QSqlQuery> statements;
+    quint64 generation;
+
+    ReadConnection() :
+            statements(STATEMENT_CACHE_SIZE), generation(0)
+    {
+    }
+
+    ~ReadConnection()
+    {
+        statements.clear();
+        QString name(db.connectionName());
+        db.close();
+        db = QSqlDatabase();
+        QSqlDatabase::removeDatabase(name);
+    }
+};
+
+/*
+    The read connections of one thread by the Database they read from.
+    They are closed by the thread itself when it finishes.
+ */
+class ReadConnections : public QHash<const Database*, ReadConnection*>
+{
+public:
+    ~ReadConnections()
+    {
+        qDeleteAll(*this);
+    }
+};
+
+QThreadStorage<ReadConnections*> readConnections;
+
+/*
+    The generation of the connection of every Database that is open. A new
+    generation starts whenever a Database opens a file and it is removed
+    when the Database closes it, so that other threads know which of their
+    read connections are stale. Connections can only be closed by the thread
+    that opened them.
+ */
+QMutex readGenerationsMutex;
+QHash<const Database*, quint64> readGenerations;
+quint64 nextReadGeneration = 1;
+
+/*
+    Starts a new generation for the connection of \a writer, or ends it if
+    \a open is false.
+ */
+void
+updateReadGeneration(const Database* writer, bool open)
+{
+    QMutexLocker locker(&readGenerationsMutex);
+    if (open)
+        readGenerations.insert(writer, nextReadGeneration++);
+    else
+        readGenerations.remove(writer);
+}
+
+/*
+    Returns the read connection of the current thread for the file at \a path
+    that \a writer is connected to, opening it first if needed. Connections
+    of a previous generation are closed first.
+ */
+ReadConnection*
+readConnection(const Database* writer, const QString& path, int cacheSize, qint64 mmapSize)
+{
+    if (!readConnections.hasLocalData())
+        readConnections.setLocalData(new ReadConnections);
+    ReadConnections* connections(readConnections.localData());
+
+    QMutexLocker locker(&readGenerationsMutex);
+    quint64 generation(readGenerations.value(writer));
+    // Drop connections of Database objects that were closed or destroyed
+    QMutableHashIterator<const Database*, ReadConnection*> it(*connections);
+    while (it.hasNext())
+    {
+        it.next();
+        if (readGenerations.value(it.key()) != it.value()->generation)
+        {
+            delete it.value();
+            it.remove();
         }
-        delegate: ListItem.Subtitled {
-            text: docId
-            subText: contents.color
+    }
+    locker.unlock();
+
+    ReadConnection* connection(connections->value(writer));
+    if (!connection)
+    {
+        connection = new ReadConnection;
+        connection->generation = generation;
+        connection->db = QSqlDatabase::addDatabase("QSQLITE", QUuid::createUuid().toString());
+        connection->db.setDatabaseName(path);
+        connection->db.setConnectOptions("QSQLITE_OPEN_READONLY");
+        if (connection->db.open())
+        {
+            connection->db.exec("PRAGMA case_sensitive_like=ON");
+            if (cacheSize != 0)
+                connection->db.exec(QString("PRAGMA cache_size=%1").arg(cacheSize));
+            if (mmapSize >= 0)
+                connection->db.exec(QString("PRAGMA mmap_size=%1").arg(mmapSize));
         }
+        connections->insert(writer, connection);
     }
-    \endqml
+    return connection;
+}
 
-    \sa Query
-*/
+/*
+    A connection shared by all Database objects of one thread that point to
+    the same file, so that they share one page cache and don't compete for
+    locks.
+ */
+struct SharedConnection
+{
+    QSqlDatabase db;
+    QList<Database*> users;
+    // The pragmas the first user applied when opening it
+    QStringList pragmas;
 
-/*!
-    A unique identifier for the state of synchronization
+    ~SharedConnection()
+    {
+        QString name(db.connectionName());
+        db.close();
+        db = QSqlDatabase();
+        QSqlDatabase::removeDatabase(name);
+    }
+};
+
+/*
+    The shared connections of one thread by canonical path.
+    They are closed when their last user releases them.
+ */
+class SharedConnections : public QHash<QString, SharedConnection*>
+{
+public:
+    ~SharedConnections()
+    {
+        qDeleteAll(*this);
+    }
+};
+
+QThreadStorage<SharedConnections*> sharedConnections;
+
+/*
+    Returns the connection of the current thread for \a key, adding it first
+    if \a user is the first to ask for it.
+ */
+QSqlDatabase
+acquireConnection(const QString& key, Database* user)
+{
+    if (!sharedConnections.hasLocalData())
+        sharedConnections.setLocalData(new SharedConnections);
+    SharedConnections* connections(sharedConnections.localData());
+
+    SharedConnection* connection(connections->value(key));
+    if (!connection)
+    {
+        connection = new SharedConnection;
+        /* A unique ID is used for the connection name to ensure that we aren't
+           re-using or replacing other opend databases. */
+        connection->db = QSqlDatabase::addDatabase("QSQLITE", QUuid::createUuid().toString());
+        connections->insert(key, connection);
+    }
+    connection->users.append(user);
+    return connection->db;
+}
+
+/*
+    Returns the key that connections to the file at \a path are shared by.
  */
 QString
-Database::getReplicaUid()
+sharedConnectionKey(const QString& path)
 {
-    QSqlQuery query (m_db.exec("SELECT value FROM u1db_config WHERE name = 'replica_uid'"));
-    if (!query.lastError().isValid() && query.next())
-        return query.value(0).toString();
-    return setError(QString("Failed to get replica UID: %1\n%2").arg(query.lastError().text()).arg(query.lastQuery())) ? QString() : QString();
+    QFileInfo info(path);
+    return QDir(info.dir().canonicalPath()).filePath(info.fileName());
 }
 
-/*!
-    Sanitize path
+/*
+    Returns the connection of the current thread for \a key if some Database
+    uses it, or an invalid connection.
  */
-QString Database::sanitizePath(const QString& path)
+QSqlDatabase
+sharedConnection(const QString& key)
 {
-    if (path == Database::MEMORY_PATH)
-        return path;
+    if (!sharedConnections.hasLocalData())
+        return QSqlDatabase();
+    SharedConnection* connection(sharedConnections.localData()->value(key));
+    return connection ? connection->db : QSqlDatabase();
+}
 
-    if (!path.count())
-        return Database::MEMORY_PATH;
+/*
+    Drops the reference of \a user to \a db, closing the connection if no
+    other Database uses it anymore.
+ */
+void
+releaseConnection(QSqlDatabase& db, Database* user)
+{
+    QString name(db.connectionName());
+    db = QSqlDatabase();
+    if (name.isEmpty() || !sharedConnections.hasLocalData())
+        return;
 
-    QUrl url(path);
+    SharedConnections* connections(sharedConnections.localData());
+    QMutableHashIterator<QString, SharedConnection*> it(*connections);
+    while (it.hasNext())
+    {
+        SharedConnection* connection(it.next().value());
+        if (connection->db.connectionName() != name)
+            continue;
+        connection->users.removeOne(user);
+        if (connection->users.isEmpty())
+        {
+            delete connection;
+            it.remove();
+        }
+        return;
+    }
+}
 
-    if (url.isValid() && url.isLocalFile())
+/*
+    Returns the other Database objects of the current thread that share the
+    connection \a db with \a user.
+ */
+QList<Database*>
+connectionPeers(const QSqlDatabase& db, const Database* user)
+{
+    QList<Database*> peers;
+    if (!sharedConnections.hasLocalData())
+        return peers;
+    Q_FOREACH (SharedConnection* connection, *sharedConnections.localData())
     {
-        return url.path();
+        if (connection->db.connectionName() == db.connectionName())
+        {
+            peers = connection->users;
+            peers.removeAll(const_cast<Database*>(user));
+            break;
+        }
     }
-    else if (QDir::isRelativePath(path))
+    return peers;
+}
+
+/*
+    Returns the shared connection that \a db belongs to, if any.
+ */
+SharedConnection*
+findSharedConnection(const QSqlDatabase& db)
+{
+    if (!sharedConnections.hasLocalData())
+        return 0;
+    Q_FOREACH (SharedConnection* connection, *sharedConnections.localData())
     {
-        QString dataPath(QStandardPaths::writableLocation(QStandardPaths::DataLocation));
-        return QDir(dataPath).absoluteFilePath(path);
+        if (connection->db.connectionName() == db.connectionName())
+            return connection;
+    }
+    return 0;
+}
+
+/*
+    Returns the pragmas that set up a connection with the given settings.
+    Settings left at their default are omitted.
+ */
+QStringList
+pragmaStatements(int pageSize, const QString& journalMode, const QString& synchronous,
+    int cacheSize, qint64 mmapSize)
+{
+    QStringList pragmas;
+    // The page size only affects new databases, so it must come first
+    if (pageSize > 0)
+        pragmas << QString("PRAGMA page_size=%1").arg(pageSize);
+    if (!journalMode.isEmpty())
+        pragmas << QString("PRAGMA journal_mode=%1").arg(journalMode);
+    if (!synchronous.isEmpty())
+        pragmas << QString("PRAGMA synchronous=%1").arg(synchronous);
+    if (cacheSize != 0)
+        pragmas << QString("PRAGMA cache_size=%1").arg(cacheSize);
+    if (mmapSize >= 0)
+        pragmas << QString("PRAGMA mmap_size=%1").arg(mmapSize);
+    return pragmas;
+}
+
+void collectFieldValues(const QVariantMap& section, const QString& path,
+    const QStringList& fields, QList<QPair<QString, QVariant> >& values);
+
+void
+collectFieldValuesFromList(const QVariantList& section, const QString& path,
+    const QStringList& fields, QList<QPair<QString, QVariant> >& values)
+{
+    Q_FOREACH (const QVariant& value, section)
+    {
+        if (value.userType() == QMetaType::QVariantMap)
+            collectFieldValues(value.toMap(), path, fields, values);
+        else if (value.userType() == QMetaType::QVariantList)
+            collectFieldValuesFromList(value.toList(), path, fields, values);
     }
+}
 
-    return path;
+/*
+    Walks a document the same way Index::appendResultsFromMap() does, so that
+    every value an Index can return has a row in document_fields.
+ */
+void
+collectFieldValues(const QVariantMap& section, const QString& path,
+    const QStringList& fields, QList<QPair<QString, QVariant> >& values)
+{
+    QMapIterator<QString, QVariant> i(section);
+    while (i.hasNext())
+    {
+        i.next();
+        QString field(path.isEmpty() ? i.key() : path + "." + i.key());
+        const QVariant& value(i.value());
+        if (value.userType() == QMetaType::QVariantMap)
+            collectFieldValues(value.toMap(), field, fields, values);
+        else if (value.userType() == QMetaType::QVariantList)
+            collectFieldValuesFromList(value.toList(), field, fields, values);
+
+        if (fields.contains(field))
+            values.append(qMakePair(field, value));
+    }
 }
 
-/*!
-    Checks if the underlying SQLite database is ready to be used
-    Only to be used as a utility function by initializeIfNeeded()
+/*
+    Indexes on a field of the stored JSON are named after the field, string
+    and numeric values of a field have separate indexes.
+ */
+const QString FIELD_INDEX_PREFIX("document_field:");
+const QString NUMBER_INDEX_PREFIX("document_number:");
+
+/*
+    Fields made up of letters, digits, '_' and '-' separated by dots can be
+    looked up with an expression index, other fields only in document_fields.
  */
 bool
-Database::isInitialized()
+isPlainField(const QString& field)
 {
-    m_db.exec("PRAGMA case_sensitive_like=ON");
-    QSqlQuery query(m_db.exec(
-        "SELECT value FROM u1db_config WHERE name = 'sql_schema'"));
-    return query.next();
+    Q_FOREACH (const QString& key, field.split('.'))
+    {
+        if (key.isEmpty())
+            return false;
+        Q_FOREACH (QChar c, key)
+            if (!(c.isLetterOrNumber() && c.unicode() < 128) && c != '_' && c != '-')
+                return false;
+    }
+    return true;
+}
+
+/*
+    The SQL expression for string values of \a field in the stored JSON, or
+    for integer and real values if \a numeric is true. Binary documents and
+    any other type of value yield NULL, those are kept in document_fields.
+    The expression index and the lookups must use the very same expression
+    for SQLite to pick the index.
+ */
+QString
+fieldExpression(const QString& field, bool numeric=false)
+{
+    QString json("CASE WHEN json_valid(CAST(content AS TEXT)) THEN CAST(content AS TEXT) END");
+    if (numeric)
+        return QString("CASE WHEN json_type(%1, '%2') IN ('integer', 'real') THEN json_extract(%1, '%2') END").arg(json, jsonPath(field));
+    return QString("CASE json_type(%1, '%2') WHEN 'text' THEN json_extract(%1, '%2') END").arg(json, jsonPath(field));
+}
+
+/*
+    Numbers are parsed from JSON as doubles, this is the string they're
+    compared as by Query and stored as in document_fields.
+ */
+QString
+numberText(const QVariant& value)
+{
+    return QVariant(value.toDouble()).toString();
+}
+
+/*
+    Returns the SQL conditions on \a column for matching \a patterns as
+    described by Database::getIndexedDocIds(), adding their values to
+    \a bindings. Placeholders start with \a tag so that several sets of
+    conditions can be used in one query.
+ */
+QString
+patternConditions(const QString& column, const QStringList& patterns, const QString& tag,
+    QMap<QString, QVariant>& bindings)
+{
+    QString where;
+    for (int i = 0; i < patterns.count(); ++i)
+    {
+        QString pattern(patterns.at(i));
+        int wildcard = pattern.indexOf("*");
+        if (wildcard == -1)
+        {
+            where += QString(" AND %1 = :%2value%3").arg(column, tag).arg(i);
+            bindings.insert(QString(":%1value%2").arg(tag).arg(i), pattern);
+            continue;
+        }
+
+        // A prefix is looked up as a range so the index can be used
+        QString prefix(pattern.left(wildcard));
+        if (prefix.isEmpty())
+            continue;
+        where += QString(" AND %1 >= :%2lower%3").arg(column, tag).arg(i);
+        bindings.insert(QString(":%1lower%2").arg(tag).arg(i), prefix);
+        ushort last = prefix.at(prefix.size() - 1).unicode();
+        if (last < 0xD800)
+        {
+            QString upper(prefix);
+            upper[upper.size() - 1] = QChar(ushort(last + 1));
+            where += QString(" AND %1 < :%2upper%3").arg(column, tag).arg(i);
+            bindings.insert(QString(":%1upper%2").arg(tag).arg(i), upper);
+        }
+    }
+    return where;
+}
+
+/*
+    Returns the SQL conditions on \a column for values between \a lower and
+    \a upper, adding them to \a bindings like patternConditions() does. An
+    invalid bound leaves the range open, \a upper is excluded if
+    \a exclusiveUpper is true.
+ */
+QString
+rangeConditions(const QString& column, const QVariant& lower, const QVariant& upper,
+    bool exclusiveUpper, const QString& tag, QMap<QString, QVariant>& bindings)
+{
+    QString where;
+    if (lower.isValid())
+    {
+        where += QString(" AND %1 >= :%2lower").arg(column, tag);
+        bindings.insert(QString(":%1lower").arg(tag), lower);
+    }
+    if (upper.isValid())
+    {
+        where += QString(" AND %1 %2 :%3upper").arg(column, exclusiveUpper ? "<" : "<=", tag);
+        bindings.insert(QString(":%1upper").arg(tag), upper);
+    }
+    return where;
+}
+
+/*
+    Returns the SQL condition for rows after \a lastDocId in the order of
+    docIds, none for an empty \a lastDocId, adding its value to \a bindings.
+ */
+QString
+pageConditions(const QString& lastDocId, const QString& tag, QMap<QString, QVariant>& bindings)
+{
+    if (lastDocId.isEmpty())
+        return QString();
+    bindings.insert(QString(":%1lastDocId").arg(tag), lastDocId);
+    return QString(" AND doc_id > :%1lastDocId").arg(tag);
+}
+
+/*
+    Returns the SQL condition for rows after the row of \a lastDocId with
+    \a lastKey in the order of the sort key in \a column and then docId,
+    none for an empty \a lastDocId, adding its values to \a bindings.
+ */
+QString
+keysetConditions(const QString& column, bool descending, const QString& lastDocId,
+    const QVariant& lastKey, const QString& tag, QMap<QString, QVariant>& bindings)
+{
+    if (lastDocId.isEmpty())
+        return QString();
+    bindings.insert(QString(":%1lastKey").arg(tag), lastKey);
+    bindings.insert(QString(":%1tieKey").arg(tag), lastKey);
+    bindings.insert(QString(":%1lastDocId").arg(tag), lastDocId);
+    return QString(" AND (%1 %2 :%3lastKey OR (%1 = :%3tieKey AND doc_id > :%3lastDocId))").arg(
+        column, descending ? "<" : ">", tag);
+}
+}
+
+/*!
+    \class Database
+    \inmodule U1Db
+    \ingroup cpp
+
+    \brief The Database class implements on-disk storage for documents and indexes.
+
+    Database can be used as a QAbstractListModel, delegates will then have access to \a docId and \a contents
+    analogous to the properties of Document.
+
+    Documents are written through a single connection owned by the thread
+    of the Database. Other threads may call getDoc(), getDocUnchecked(),
+    listDocs(), getIndexExpressions() and getIndexedDocIds() on a database
+    stored in a file; each thread reads through a read-only connection of its
+    own, which is closed when the thread finishes. With journalMode set to
+    \c wal those readers don't block the writer. An in-memory database
+    can't be read from other threads, those reads fail with an error.
+*/
+
+/*!
+    \qmltype Database
+    \instantiates Database
+    \inqmlmodule U1Db 1.0
+    \ingroup modules
+
+    \brief Database implements on-disk storage for documents and indexes.
+
+    In a ListView the Database can be used as a model which includes all documents
+    in the database. For listing only a subset of documents Query can be used.
+
+    \qml
+    ListView {
+        model: Database {
+            id: myDatabase
+        }
+        delegate: ListItem.Subtitled {
+            text: docId
+            subText: contents.color
+        }
+    }
+    \endqml
+
+    \sa Query
+*/
+
+/*!
+    A unique identifier for the state of synchronization
+ */
+QString
+Database::getReplicaUid()
+{
+    // The uid never changes once the database was created
+    if (!m_replicaUid.isEmpty())
+        return m_replicaUid;
+
+    QSqlQuery query(cachedQuery("SELECT value FROM u1db_config WHERE name = 'replica_uid'"));
+    if (query.exec() && query.next())
+    {
+        m_replicaUid = query.value(0).toString();
+        query.finish();
+        return m_replicaUid;
+    }
+    return setError(QString("Failed to get replica UID: %1\n%2").arg(query.lastError().text()).arg(query.lastQuery())) ? QString() : QString();
+}
+
+/*!
+    \internal
+    Reads the replica uid of the database file at \a path without opening a
+    Database on it, so that the file is never created, initialized or
+    upgraded. The connection of a Database of this thread using the file is
+    shared if there is one, otherwise a read-only connection is opened.
+    Returns an empty string and sets \a error if the uid can't be read.
+ */
+QString
+Database::readReplicaUid(const QString& path, QString& error)
+{
+    QSqlDatabase db(sharedConnection(sharedConnectionKey(path)));
+    QString name;
+    if (!db.isOpen())
+    {
+        name = QUuid::createUuid().toString();
+        db = QSqlDatabase::addDatabase("QSQLITE", name);
+        db.setDatabaseName(path);
+        db.setConnectOptions("QSQLITE_OPEN_READONLY");
+        if (!db.open())
+            error = QString("Failed to open '%1`: %2").arg(path).arg(db.lastError().text());
+    }
+
+    QString uid;
+    if (db.isOpen())
+    {
+        QSqlQuery query(db);
+        if (query.exec("SELECT value FROM u1db_config WHERE name = 'replica_uid'") && query.next())
+            uid = query.value(0).toString();
+        else
+            error = QString("Failed to get replica UID: %1").arg(query.lastError().text());
+    }
+    if (!name.isEmpty())
+    {
+        db.close();
+        db = QSqlDatabase();
+        QSqlDatabase::removeDatabase(name);
+    }
+    return uid;
+}
+
+/*!
+    Sanitize path
+ */
+QString Database::sanitizePath(const QString& path)
+{
+    if (path == Database::MEMORY_PATH)
+        return path;
+
+    if (!path.count())
+        return Database::MEMORY_PATH;
+
+    QUrl url(path);
+
+    if (url.isValid() && url.isLocalFile())
+    {
+        return url.path();
+    }
+    else if (QDir::isRelativePath(path))
+    {
+        QString dataPath(QStandardPaths::writableLocation(QStandardPaths::DataLocation));
+        return QDir(dataPath).absoluteFilePath(path);
+    }
+
+    return path;
+}
+
+/*!
+    Checks if the underlying SQLite database is ready to be used
+    Only to be used as a utility function by initializeIfNeeded()
+ */
+bool
+Database::isInitialized()
+{
+    m_db.exec("PRAGMA case_sensitive_like=ON");
+    QSqlQuery query(m_db.exec(
+        "SELECT value FROM u1db_config WHERE name = 'sql_schema'"));
+    return query.next();
+}
+
+/*!
+    Applies the tuning properties that were set to the open database.
+    Properties that were never set keep the defaults of SQLite. A connection
+    shared with other Database objects keeps the settings it was opened
+    with, an error is reported if this Database asks for different ones.
+ */
+bool
+Database::applyPragmas()
+{
+    if (!m_db.isOpen())
+        return true;
+
+    QStringList pragmas(pragmaStatements(m_pageSize, m_journalMode, m_synchronous, m_cacheSize, m_mmapSize));
+    // The settings of a connection in use by other Database objects are left
+    // as the first one applied them, differing ones can't take effect
+    SharedConnection* shared(findSharedConnection(m_db));
+    if (shared && !connectionPeers(m_db, this).isEmpty())
+    {
+        Q_FOREACH (QString pragma, pragmas)
+        {
+            if (!shared->pragmas.contains(pragma))
+                return setError(QString("Failed to apply %1: another Database uses the same file with different settings").arg(pragma));
+        }
+        return true;
+    }
+
+    Q_FOREACH (QString pragma, pragmas)
+    {
+        QSqlQuery query(m_db.exec(pragma));
+        if (query.lastError().isValid())
+            return setError(QString("Failed to apply %1: %2").arg(pragma).arg(query.lastError().text()));
+    }
+
+    // SQLite keeps the previous mode if it can't switch, for instance an
+    // in-memory database can't use wal
+    QString requested(m_journalMode);
+    if (!m_journalMode.isEmpty())
+    {
+        QSqlQuery query(m_db.exec("PRAGMA journal_mode"));
+        QString mode(query.next() ? query.value(0).toString().toLower() : QString());
+        if (!mode.isEmpty() && mode != m_journalMode)
+        {
+            m_journalMode = mode;
+            Q_EMIT journalModeChanged(m_journalMode);
+        }
+    }
+    if (shared)
+        shared->pragmas = pragmaStatements(m_pageSize, m_journalMode, m_synchronous, m_cacheSize, m_mmapSize);
+    if (requested != m_journalMode)
+        return setError(QString("Journal mode %1 isn't supported by this database, using %2").arg(requested).arg(m_journalMode));
+    return true;
+}
+
+/*!
+    Describes the error as a string if the last operation failed.
+ */
+bool
+Database::setError(const QString& error)
+{
+    qWarning("u1db: %s", qPrintable(error));
+    QMutexLocker locker(&m_mutex);
+    m_error = error;
+    locker.unlock();
+    Q_EMIT errorChanged(error);
+    return false;
+}
+
+/*!
+    \qmlproperty string Database::error
+    The last error as a string if the last operation failed.
+ */
+/*!
+    The last error as a string if the last operation failed.
+ */
+QString
+Database::lastError()
+{
+    QMutexLocker locker(&m_mutex);
+    return m_error;
+}
+
+/*!
+    Ensures that the underlying database works, or tries to set it up:
+
+    The SQlite backend is loaded - it's an optional Qt5 module and can fail
+    If @path is an existing database, it'll be opened
+    For a new database, the default schema will be applied
+ */
+bool
+Database::initializeIfNeeded(const QString& path)
+{
+    // Other threads read through connections of their own to the same file,
+    // only the thread owning the Database may open its connection
+    if (QThread::currentThread() != thread())
+    {
+        QMutexLocker locker(&m_mutex);
+        QString readPath(m_readPath);
+        locker.unlock();
+        if (readPath == Database::MEMORY_PATH)
+            return setError("Reads from other threads need a file database");
+        return !readPath.isEmpty();
+    }
+    if (m_db.isOpen())
+        return true;
+
+    // Every in-memory database is distinct, files are shared by path
+    QString key(QUuid::createUuid().toString());
+    if (path != Database::MEMORY_PATH)
+    {
+        QFileInfo info(path);
+        QDir parent(info.dir());
+        if (!parent.mkpath(parent.path()))
+            setError(QString("Failed to make parent folder %1").arg(parent.path()));
+        key = sharedConnectionKey(path);
+    }
+
+    if (!m_db.isValid())
+        m_db = acquireConnection(key, this);
+
+    if (!m_db.isValid())
+        return setError("QSqlDatabase error");
+
+    QElapsedTimer timer;
+    timer.start();
+    if (!m_db.isOpen())
+    {
+        m_db.setDatabaseName(path);
+        if (!m_db.open())
+            return setError(QString("Failed to open '%1`: %2").arg(path).arg(m_db.lastError().text()));
+    }
+    {
+        QMutexLocker locker(&m_mutex);
+        m_readPath = path;
+    }
+    updateReadGeneration(this, true);
+    applyPragmas();
+    if (!isInitialized())
+    {
+        // The schema is applied as a single script, a failed read is retried
+        // by the next initialization
+        QByteArray schema(readSchemaScript());
+        if (schema.isEmpty())
+            return setError("Failed to read internal schema");
+
+        ScopedTransaction t(m_db);
+        sqlite3* handle(sqliteHandle(m_db));
+        char* message = 0;
+        if (handle && sqlite3_exec(handle, schema.constData(), 0, 0, &message) != SQLITE_OK)
+        {
+            QString error(QString::fromUtf8(message));
+            sqlite3_free(message);
+            t.rollback();
+            return setError(QString("Failed to apply internal schema: %1").arg(error));
+        }
+        // Otherwise the statements are run one by one, each ends a line
+        for (int start = 0; !handle && start < schema.size(); )
+        {
+            int end = schema.indexOf(";\n", start);
+            end = end < 0 ? schema.size() : end + 1;
+            QString statement(QString::fromUtf8(schema.mid(start, end - start)).trimmed());
+            start = end + 1;
+            if (!statement.isEmpty() && m_db.exec(statement).lastError().isValid())
+            {
+                t.rollback();
+                return setError(QString("Failed to apply internal schema: %1\n%2").arg(m_db.lastError().text()).arg(statement));
+            }
+        }
+
+        QSqlQuery query(m_db.exec());
+        query.prepare("INSERT OR REPLACE INTO u1db_config VALUES ('replica_uid', :uuid)");
+        query.bindValue(":uuid", QUuid::createUuid().toString());
+        if (!query.exec())
+        {
+            t.rollback();
+            return setError(QString("Failed to apply internal schema: %1\n%2").arg(m_db.lastError().text()).arg(query.lastQuery()));
+        }
+        // Double-check
+        if (query.boundValue(0).toString() != getReplicaUid())
+        {
+            t.rollback();
+            m_replicaUid.clear();
+            return setError(QString("Invalid replica uid: %1").arg(query.boundValue(0).toString()));
+        }
+    }
+    bool upgraded(upgradeSchema() && !getReplicaUid().isEmpty());
+    m_initializeTime = timer.nsecsElapsed() / 1000;
+    return upgraded;
+}
+
+/*!
+    Brings the schema of a database that was created by an older version
+    up to date, in a single transaction.
+ */
+bool
+Database::upgradeSchema()
+{
+    QSqlQuery query(m_db.exec("SELECT value FROM u1db_config WHERE name = 'sql_schema'"));
+    if (!query.next())
+        return setError(QString("Failed to read schema version: %1").arg(query.lastError().text()));
+    int version = query.value("value").toInt();
+    query.finish();
+    if (version >= Database::SCHEMA_VERSION)
+        return true;
+
+    QStringList statements;
+    if (version < 1)
+    {
+        // Conflicts are tracked per document instead of being counted on every read
+        statements << "ALTER TABLE document ADD COLUMN conflicted INTEGER NOT NULL DEFAULT 0"
+            << "CREATE TRIGGER conflicts_insert AFTER INSERT ON conflicts BEGIN "
+               "UPDATE document SET conflicted = 1 WHERE doc_id = NEW.doc_id; END"
+            << "CREATE TRIGGER conflicts_delete AFTER DELETE ON conflicts BEGIN "
+               "UPDATE document SET conflicted = EXISTS (SELECT 1 FROM conflicts "
+               "WHERE doc_id = OLD.doc_id) WHERE doc_id = OLD.doc_id; END"
+            << "UPDATE document SET conflicted = 1 WHERE doc_id IN (SELECT doc_id FROM conflicts)";
+    }
+    if (version < 2)
+    {
+        // Compaction looks for later transactions of the same document
+        statements << "CREATE INDEX transaction_log_doc_id_generation_idx "
+            "ON transaction_log(doc_id, generation)";
+    }
+    if (version < 3)
+    {
+        // Deleted documents are NULL and left out of listings by a partial index
+        statements << "UPDATE document SET content = NULL WHERE content = ''"
+            << "CREATE INDEX document_live_idx ON document(doc_id) WHERE content IS NOT NULL";
+    }
+    if (version < 5)
+    {
+        // Values are ordered by a typed key so that SQLite sorts like Query
+        statements << "ALTER TABLE document_fields ADD COLUMN sort_key"
+            << "CREATE INDEX document_fields_field_sort_key_doc_idx "
+               "ON document_fields(field_name, sort_key, doc_id)";
+    }
+    statements << QString("UPDATE u1db_config SET value = '%1' WHERE name = 'sql_schema'").arg(Database::SCHEMA_VERSION);
+
+    ScopedTransaction t(m_db);
+    Q_FOREACH (QString statement, statements)
+    {
+        QSqlQuery upgrade(m_db.exec(statement));
+        if (upgrade.lastError().isValid())
+        {
+            t.rollback();
+            return setError(QString("Failed to upgrade schema from version %1: %2\n%3").arg(version).arg(upgrade.lastError().text()).arg(statement));
+        }
+    }
+    // Indexes used to be looked up by parsing documents, so existing
+    // documents have no rows in document_fields yet, or no sort_key
+    if (version < 5 && !getIndexedFields().isEmpty() && !(updateFieldIndexes() && reindexDocuments()))
+    {
+        t.rollback();
+        return setError(QString("Failed to upgrade schema from version %1: %2").arg(version).arg(lastError()));
+    }
+    return true;
+}
+
+/*!
+    Instantiate a new Database with an optional \a parent,
+    usually by declaring it as a QML item.
+ */
+Database::Database(QObject *parent) :
+    QAbstractListModel(parent), m_path(""), m_cacheSize(0), m_mmapSize(-1), m_pageSize(0),
+    m_storageFormat(CompactJson), m_compactionThreshold(0), m_writesSinceCompaction(0),
+    m_transactionsReclaimed(0), m_initializeTime(0), m_statementCacheHits(0), m_statementCacheMisses(0),
+    m_documentCacheHits(0), m_documentCacheMisses(0), m_firstLoadedRow(0), m_lastLoadedRow(0),
+    m_modelComplete(false),
+    m_workerThread(0), m_worker(0), m_snapshotInterval(10000), m_writesSinceSnapshot(0),
+    m_snapshotTimer(0)
+{
+    m_statements.setMaxCost(STATEMENT_CACHE_SIZE);
+    m_documentCache.setMaxCost(Database::DOCUMENT_CACHE_SIZE);
+    // The connection is opened on first use, usually after path was set
+}
+
+Database::~Database()
+{
+    // Requests that haven't been started yet are dropped
+    if (m_workerThread)
+    {
+        m_workerThread->quit();
+        m_workerThread->wait();
+    }
+
+    abortBackups();
+    // Changes since the last snapshot would be lost otherwise
+    if (m_path.isEmpty() && !m_snapshotPath.isEmpty() && m_writesSinceSnapshot > 0)
+    {
+        QString error;
+        sqlite3* handle(sqliteHandle(m_db));
+        if (!handle)
+        {
+            if (!exportTo(sanitizePath(m_snapshotPath), error))
+                qWarning("u1db: %s", qPrintable(error));
+        }
+        else
+        {
+            sqlite3* snapshot(BackupJob::open(sanitizePath(m_snapshotPath), false, error));
+            if (!(snapshot && BackupJob::copy(handle, snapshot, error)))
+                qWarning("u1db: %s", qPrintable(error));
+            BackupJob::close(snapshot);
+        }
+    }
+    m_statements.clear();
+    updateReadGeneration(this, false);
+    releaseConnection(m_db, this);
+}
+
+/*!
+    \internal
+    Returns a prepared query for \a sql, which is only parsed by SQLite the
+    first time it is used on the current connection. Further calls return the
+    same query, reset so that values can be bound and it can be run again.
+    Callers must not prepare() the returned query and should finish() it if
+    they don't read all rows. Only the most recently used statements are
+    kept, since some are generated for each number of patterns or fields.
+ */
+QSqlQuery
+Database::cachedQuery(const QString& sql) const
+{
+    QSqlDatabase db;
+    QCache<QString, QSqlQuery>* statements(&m_statements);
+    // Other threads read through read-only connections of their own and
+    // never touch the connection of the owner, an in-memory database
+    // can't be read from them at all
+    if (QThread::currentThread() != thread())
+    {
+        QMutexLocker locker(&m_mutex);
+        QString path(m_readPath);
+        int cacheSize(m_cacheSize);
+        qint64 mmapSize(m_mmapSize);
+        locker.unlock();
+        if (path.isEmpty() || path == Database::MEMORY_PATH)
+            return QSqlQuery();
+        ReadConnection* connection(readConnection(this, path, cacheSize, mmapSize));
+        db = connection->db;
+        statements = &connection->statements;
+    }
+    else
+        db = m_db;
+
+    QSqlQuery* cached(statements->object(sql));
+    if (cached)
+    {
+        cached->finish();
+        QMutexLocker locker(&m_mutex);
+        m_statementCacheHits++;
+        return *cached;
+    }
+
+    {
+        QMutexLocker locker(&m_mutex);
+        m_statementCacheMisses++;
+    }
+    QSqlQuery query(db);
+    query.setForwardOnly(true);
+    if (query.prepare(sql))
+        statements->insert(sql, new QSqlQuery(query));
+    return query;
+}
+
+/*!
+    \qmlmethod Variant Database::getStatistics()
+    Returns counters describing the internal caches of the database, for
+    instance \e statementCacheHits and \e statementCacheMisses or
+    \e documentCacheHits, \e documentCacheMisses and \e documentCacheHitRate.
+    \e initializeTime is the time in microseconds it took to open the database.
+ */
+/*!
+    Returns counters describing the internal caches of the database, for
+    instance \e statementCacheHits and \e statementCacheMisses.
+ */
+QVariantMap
+Database::getStatistics()
+{
+    QVariantMap statistics;
+    QMutexLocker locker(&m_mutex);
+    statistics.insert("statementCacheHits", m_statementCacheHits);
+    statistics.insert("statementCacheMisses", m_statementCacheMisses);
+    statistics.insert("statementCacheSize", m_statements.count());
+    statistics.insert("documentCacheHits", m_documentCacheHits);
+    statistics.insert("documentCacheMisses", m_documentCacheMisses);
+    int lookups = m_documentCacheHits + m_documentCacheMisses;
+    statistics.insert("documentCacheHitRate", lookups > 0 ? qreal(m_documentCacheHits) / lookups : 0.0);
+    statistics.insert("documentCacheCount", m_documentCache.count());
+    statistics.insert("documentCacheCost", m_documentCache.totalCost());
+    statistics.insert("transactionsReclaimed", m_transactionsReclaimed);
+    statistics.insert("initializeTime", m_initializeTime);
+    return statistics;
+}
+
+/*!
+    Used to implement QAbstractListModel
+    Returns docId matching the given row index
+    assuming all documents are ordered consistently
+ */
+QString
+Database::getDocIdByRow(int row) const
+{
+    if (row < 0 || row >= m_modelRows.count())
+        return QString();
+    return m_modelRows.at(row).docId;
+}
+
+/*!
+    \internal
+    Used to implement QAbstractListModel
+    Implements the variables exposed to the Delegate in a model
+    QVariant contents
+    QString docId
+    int index (built-in)
+ */
+QVariant
+Database::data(const QModelIndex & index, int role) const
+{
+    if (index.row() < 0 || index.row() >= m_modelRows.count())
+        return QVariant();
+
+    ModelRow& row = m_modelRows[index.row()];
+    if (role == 0) // contents
+    {
+        // The contents were fetched with the row, they're parsed only once
+        if (!row.loaded)
+        {
+            // Rows far from the view were unloaded, read them again
+            if (row.content.isNull())
+            {
+                QSqlQuery query(cachedQuery("SELECT content FROM document WHERE doc_id = :docId"));
+                query.bindValue(":docId", row.docId);
+                if (query.exec() && query.next())
+                    row.content = query.value("content").toByteArray();
+                query.finish();
+                moveModelWindow(index.row(), index.row() + 1);
+            }
+            row.contents = parseContents(row.content);
+            row.content.clear();
+            row.loaded = true;
+            Q_EMIT docLoaded(row.docId, row.contents);
+        }
+        return row.contents;
+    }
+    if (role == 1) // docId
+        return row.docId;
+    return QVariant();
+}
+
+/*!
+    \internal
+    Used to implement QAbstractListModel
+    Defines \b{contents} and \b{docId} as variables exposed to the Delegate in a model
+    \b{index} is supported out of the box.
+ */
+QHash<int, QByteArray>
+Database::roleNames() const
+{
+    QHash<int, QByteArray> roles;
+    roles.insert(0, "contents");
+    roles.insert(1, "docId");
+    return roles;
+}
+
+/*!
+    \internal
+    Used to implement QAbstractListModel
+    The number of rows: the number of documents fetched so far, more are
+    fetched on demand with fetchMore().
+ */
+int
+Database::rowCount(const QModelIndex & parent) const
+{
+    if (parent.isValid())
+        return 0;
+    return m_modelRows.count();
+}
+
+/*!
+    \internal
+    Used to implement QAbstractListModel
+    Whether there are documents left that weren't fetched yet.
+ */
+bool
+Database::canFetchMore(const QModelIndex & parent) const
+{
+    if (parent.isValid())
+        return false;
+    return !m_modelComplete;
+}
+
+/*!
+    \internal
+    Used to implement QAbstractListModel
+    Fetches the next page of documents ordered by docId. Pages are looked up
+    by the last docId that was fetched so no rows need to be skipped.
+ */
+void
+Database::fetchMore(const QModelIndex & parent)
+{
+    if (!canFetchMore(parent) || !initializeIfNeeded())
+        return;
+
+    QSqlQuery query(cachedQuery("SELECT doc_id, content FROM document WHERE doc_id > :lastDocId "
+        "AND content IS NOT NULL ORDER BY doc_id LIMIT :limit"));
+    query.bindValue(":lastDocId", m_modelRows.isEmpty() ? QString("") : m_modelRows.last().docId);
+    query.bindValue(":limit", Database::PAGE_SIZE);
+    if (!query.exec())
+    {
+        setError(QString("Failed to fetch documents: %1\n%2").arg(query.lastError().text()).arg(query.lastQuery()));
+        return;
+    }
+
+    QList<ModelRow> rows;
+    while (query.next())
+    {
+        ModelRow row;
+        row.docId = query.value("doc_id").toString();
+        row.content = query.value("content").toByteArray();
+        row.loaded = false;
+        rows.append(row);
+    }
+    m_modelComplete = rows.count() < Database::PAGE_SIZE;
+    if (rows.isEmpty())
+        return;
+
+    beginInsertRows(QModelIndex(), m_modelRows.count(), m_modelRows.count() + rows.count() - 1);
+    m_modelRows.append(rows);
+    endInsertRows();
+    moveModelWindow(m_modelRows.count() - rows.count(), m_modelRows.count());
+}
+
+/*!
+    \internal
+    Extends the window of rows whose contents are kept to the rows from
+    \a first up to \a last, which were just loaded. Only rows within
+    [m_firstLoadedRow, m_lastLoadedRow) have contents, so scrolling through
+    a big database doesn't keep every document in memory. When the window
+    grows past MODEL_WINDOW the rows at the end furthest from the loaded
+    ones are dropped, only their docId is kept and data() reads the
+    contents again when they come back into view.
+ */
+void
+Database::moveModelWindow(int first, int last) const
+{
+    int oldFirst = m_firstLoadedRow;
+    int oldLast = qMin(m_lastLoadedRow, m_modelRows.count());
+    if (oldFirst >= oldLast)
+    {
+        m_firstLoadedRow = first;
+        m_lastLoadedRow = last;
+        return;
+    }
+
+    m_firstLoadedRow = qMin(oldFirst, first);
+    m_lastLoadedRow = qMax(oldLast, last);
+    if (m_lastLoadedRow - m_firstLoadedRow > Database::MODEL_WINDOW)
+    {
+        if (first - m_firstLoadedRow >= m_lastLoadedRow - last)
+            m_firstLoadedRow = m_lastLoadedRow - Database::MODEL_WINDOW;
+        else
+            m_lastLoadedRow = m_firstLoadedRow + Database::MODEL_WINDOW;
+    }
+
+    // Only rows of the old window can have contents
+    for (int row = oldFirst; row < qMin(oldLast, m_firstLoadedRow); row++)
+    {
+        m_modelRows[row].content = QByteArray();
+        m_modelRows[row].contents = QVariant();
+        m_modelRows[row].loaded = false;
+    }
+    for (int row = qMax(oldFirst, m_lastLoadedRow); row < oldLast; row++)
+    {
+        m_modelRows[row].content = QByteArray();
+        m_modelRows[row].contents = QVariant();
+        m_modelRows[row].loaded = false;
+    }
+}
+
+/*!
+    Same functionality as Database::getDoc() except it won't set Database::lastError() and it
+    doesn't implicitly try to initialize the underlying database.
+    \a docId must be a valid unique ID string
+    Use cases: model implementations, Document::getContents()
+ */
+QVariant
+Database::getDocUnchecked(const QString& docId) const
+{
+    if (QThread::currentThread() == thread() && !m_db.isOpen())
+        return QVariant();
+
+    QSqlQuery query(cachedQuery("SELECT doc_rev FROM document WHERE doc_id = :docId"));
+    query.bindValue(":docId", docId);
+    if (query.exec() && query.next())
+    {
+        QString revision(query.value("doc_rev").toString());
+        query.finish();
+        QVariant contents(getCachedContents(docId, revision));
+        // Receivers expect the signal in the thread owning the Database
+        if (QThread::currentThread() == thread())
+            Q_EMIT docLoaded(docId, contents);
+        return contents;
+    }
+    return QVariant();
+}
+
+/*!
+    \internal
+    Returns the parsed contents of \a docId at \a revision from the document
+    cache, or parses the stored JSON and adds it to the cache. Entries are
+    only used if their revision matches, so documents written by other
+    connections are never returned stale.
+ */
+QVariant
+Database::getCachedContents(const QString& docId, const QString& revision) const
+{
+    QMutexLocker locker(&m_mutex);
+    CachedDocument* cached = m_documentCache.object(docId);
+    if (cached && cached->revision == revision)
+    {
+        m_documentCacheHits++;
+        return cached->contents;
+    }
+    m_documentCacheMisses++;
+    locker.unlock();
+
+    QSqlQuery query(cachedQuery("SELECT content FROM document WHERE doc_id = :docId"));
+    query.bindValue(":docId", docId);
+    if (!(query.exec() && query.next()))
+        return QVariant();
+    // Deleted documents are stored as NULL and have no contents
+    if (query.value("content").isNull())
+    {
+        query.finish();
+        return QVariant();
+    }
+    QByteArray content(query.value("content").toByteArray());
+    query.finish();
+
+    // Convert JSON string to the Variant that QML expects
+    QVariant contents(parseContents(content));
+    cached = new CachedDocument;
+    cached->revision = revision;
+    cached->contents = contents;
+    locker.relock();
+    m_documentCache.insert(docId, cached, qMax(content.size(), 1));
+    return contents;
+}
+
+/*!
+    Parses the stored \a content of a document, as passed to the callback of
+    forEachDoc(), in any of the storage formats.
+ */
+QVariantMap
+Database::parseContents(const QByteArray& content)
+{
+    if (!isBinaryContent(content))
+        return QJsonDocument::fromJson(content).object().toVariantMap();
+#if QT_VERSION >= QT_VERSION_CHECK(5, 12, 0)
+    if (!content.startsWith("qbjs"))
+        return QCborValue::fromCbor(content).toMap().toVariantMap();
+#endif
+QT_WARNING_PUSH
+QT_WARNING_DISABLE_DEPRECATED
+    return QJsonDocument::fromBinaryData(content).object().toVariantMap();
+QT_WARNING_POP
+}
+
+/*!
+ * \internal
+ * \brief Database::getDocumentContents
+ *
+ * Returns the string representation of a document that has
+ * been selected from the database using a document id.
+ *
+ */
+
+QString
+Database::getDocumentContents(const QString& docId)
+{
+    if (!initializeIfNeeded())
+        return QString();
+
+    QSqlQuery query(cachedQuery("SELECT doc_rev, content, conflicted FROM document "
+        "WHERE doc_id = :docId"));
+    query.bindValue(":docId", docId);
+    if (query.exec())
+    {
+        if (query.next())
+        {
+            bool conflicts = query.value("conflicted").toBool();
+            QByteArray content(query.value("content").toByteArray());
+            query.finish();
+            // Binary formats are handed out as JSON text
+            if (isBinaryContent(content))
+                content = QJsonDocument::fromVariant(parseContents(content)).toJson(QJsonDocument::Compact);
+            if (conflicts)
+                setError(QString("Conflicts in %1").arg(docId));
+            return QString::fromUtf8(content);
+        }
+        return setError(QString("Failed to get document %1: No document").arg(docId)) ? QString() : QString();
+    }
+    return setError(QString("Failed to get document %1: %2\n%3").arg(docId).arg(query.lastError().text()).arg(query.lastQuery())) ? QString() : QString();
+}
+
+
+/*!
+    \qmlmethod Variant Database::getDoc(string)
+    Returns the contents of a document by \a docId in a form that QML recognizes
+    as a Variant object, it's identical to Document::getContents() with the
+    same \a docId.
+ */
+/*!
+ *  Returns the contents of a document by \a docId in a form that QML recognizes
+ *  as a Variant object, it's identical to Document::getContents() with the
+ *  same \a docId.
+ */
+QVariant
+Database::getDoc(const QString& docId)
+{
+    if (!initializeIfNeeded())
+        return QVariant();
+
+    QSqlQuery query(cachedQuery("SELECT doc_rev, conflicted, content IS NULL AS deleted "
+        "FROM document WHERE doc_id = :docId"));
+    query.bindValue(":docId", docId);
+    if (query.exec())
+    {
+        // Deleted documents are stored as NULL
+        if (query.next() && !query.value("deleted").toBool())
+        {
+            bool conflicts = query.value("conflicted").toBool();
+            QString revision(query.value("doc_rev").toString());
+            query.finish();
+            if (conflicts)
+                setError(QString("Conflicts in %1").arg(docId));
+            QVariant contents(getCachedContents(docId, revision));
+            // Receivers expect the signal in the thread owning the Database
+            if (QThread::currentThread() == thread())
+                Q_EMIT docLoaded(docId, contents);
+            return contents;
+        }
+        query.finish();
+        return setError(QString("Failed to get document %1: No document").arg(docId)) ? QVariant() : QVariant();
+    }
+    return setError(QString("Failed to get document %1: %2\n%3").arg(docId).arg(query.lastError().text()).arg(query.lastQuery())) ? QVariant() : QVariant();
+}
+
+/*!
+    \qmlmethod LazyDocument Database::getLazyDoc(string)
+    Returns a LazyDocument for \a docId, which only parses the document and
+    converts its fields when they are accessed, or null if there is no such
+    document.
+ */
+/*!
+    Returns a LazyDocument for \a docId, which only parses the document and
+    converts its fields when they are accessed, or 0 if there is no such
+    document. The caller takes ownership of it, in QML it's garbage collected.
+ */
+LazyDocument*
+Database::getLazyDoc(const QString& docId)
+{
+    if (!initializeIfNeeded())
+        return 0;
+
+    QSqlQuery query(cachedQuery("SELECT content, conflicted FROM document "
+        "WHERE doc_id = :docId"));
+    query.bindValue(":docId", docId);
+    if (query.exec())
+    {
+        // Deleted documents are stored as NULL
+        if (query.next() && !query.value("content").isNull())
+        {
+            bool conflicts = query.value("conflicted").toBool();
+            QByteArray content(query.value("content").toByteArray());
+            query.finish();
+            if (conflicts)
+                setError(QString("Conflicts in %1").arg(docId));
+            return new LazyDocument(docId, content);
+        }
+        query.finish();
+        setError(QString("Failed to get document %1: No document").arg(docId));
+        return 0;
+    }
+    setError(QString("Failed to get document %1: %2\n%3").arg(docId).arg(query.lastError().text()).arg(query.lastQuery()));
+    return 0;
+}
+
+/*!
+    \qmlmethod Variant Database::getDoc(string, list<string>)
+    Returns only the \a fields of the document \a docId, such as "color" or
+    "author.name", with the same nesting as in the document. Missing fields
+    are left out. The fields are extracted by SQLite, so large documents
+    aren't parsed as a whole, for instance to show one field in a list row.
+ */
+/*!
+    Returns only the \a fields of the document \a docId. Fields are dotted
+    paths, the result keeps the nesting of the document. Documents stored
+    in a binary format, or if SQLite lacks JSON support, are parsed as a
+    whole and the fields picked from their contents.
+ */
+QVariant
+Database::getDoc(const QString& docId, const QStringList& fields)
+{
+    if (!initializeIfNeeded())
+        return QVariant();
+
+    QString columns;
+    for (int i = 0; i < fields.count(); ++i)
+        columns += QString(", json_extract(json, :extract%1), json_type(json, :type%1)").arg(i);
+    QSqlQuery query(cachedQuery(QString("SELECT doc_rev, conflicted, content IS NULL AS deleted, "
+        "json IS NULL AS binary%1 FROM (SELECT doc_rev, conflicted, content, "
+        "CASE WHEN json_valid(CAST(content AS TEXT)) THEN CAST(content AS TEXT) END AS json "
+        "FROM document WHERE doc_id = :docId)").arg(columns)));
+    query.bindValue(":docId", docId);
+    for (int i = 0; i < fields.count(); ++i)
+    {
+        query.bindValue(QString(":extract%1").arg(i), jsonPath(fields.at(i)));
+        query.bindValue(QString(":type%1").arg(i), jsonPath(fields.at(i)));
+    }
+
+    QVariantMap projection;
+    // Without JSON support in SQLite the whole document is parsed
+    bool parse = !query.exec();
+    if (!parse)
+    {
+        if (!query.next())
+            return setError(QString("Failed to get document %1: No document").arg(docId)) ? QVariant() : QVariant();
+        if (query.value("deleted").toBool())
+        {
+            query.finish();
+            return setError(QString("Failed to get document %1: No document").arg(docId)) ? QVariant() : QVariant();
+        }
+        if (query.value("conflicted").toBool())
+            setError(QString("Conflicts in %1").arg(docId));
+        parse = query.value("binary").toBool();
+        for (int i = 0; !parse && i < fields.count(); ++i)
+        {
+            QVariant type(query.value(5 + 2 * i));
+            if (!type.isNull())
+                insertField(projection, fields.at(i), fromJsonType(query.value(4 + 2 * i), type.toString()));
+        }
+        query.finish();
+    }
+
+    if (parse)
+    {
+        QVariantMap contents(getDoc(docId).toMap());
+        Q_FOREACH (const QString& field, fields)
+        {
+            QVariant value;
+            if (lookupField(contents, field, value))
+                insertField(projection, field, value);
+        }
+    }
+    return projection;
+}
+
+/*!
+ * \internal
+  This function creates a new revision number.
+
+  It returns a string for use in the document table's 'doc_rev' field.
+  The counters of other replicas are kept so that syncs can detect conflicts.
+ */
+
+QString Database::getNextDocRevisionNumber(QString doc_id)
+{
+    Revision revision(Revision::fromString(getCurrentDocRevisionNumber(doc_id)));
+    revision.increment(Revision::replicaName(getReplicaUid()));
+    return revision.toString();
+}
+
+/*!
+ * \internal
+    The getCurrentDocRevisionNumber(QString doc_id) function
+returns the current string value from the document table's
+doc_rev field.
+
+ */
+
+
+QString Database::getCurrentDocRevisionNumber(QString doc_id){
+    if (!initializeIfNeeded())
+        return QString();
+
+    QSqlQuery query(cachedQuery("SELECT doc_rev from document WHERE doc_id = :docId"));
+    query.bindValue(":docId", doc_id);
+
+    if (query.exec())
+    {
+        while (query.next())
+        {
+            QString revision(query.value("doc_rev").toString());
+            query.finish();
+            return revision;
+        }
+
+    }
+    else{
+        return setError(query.lastError().text()) ? QString() : QString();
+    }
+    return QString();
+}
+
+/*!
+ * \internal
+ * \brief Database::updateSyncLog
+ *
+ * This method is used at the end of a synchronization session,
+ * to update the database with the latest information known about the peer
+ * database that was synced against.
+ */
+void Database::updateSyncLog(bool insert, QString uid, QString generation, QString transaction_id)
+{
+
+    if (!initializeIfNeeded())
+        return;
+
+    QSqlQuery query(m_db.exec());
+
+    if(insert==true){
+        query.prepare("INSERT INTO sync_log(known_generation,known_transation_id,known_transation_id) VALUES(:knownGeneration, :knownTransactionId, :replicaUid)");
+
+    }
+    else{
+        query.prepare("UPDATE sync_log SET known_generation = :knownGeneration, known_transation_id = :knownTransactionId WHERE replica_uid = :replicaUid");
+    }
+
+
+    query.bindValue(":replicaUid", uid);
+    query.bindValue(":knownGeneration", generation);
+    query.bindValue(":knownTransactionId", transaction_id);
+    if (!query.exec())
+    {
+        setError(query.lastError().text());
+
+    }
+
+}
+
+/*!
+ * \internal
+ *
+ * Whenever a document as added or modified it needs a new revision number.
+ *
+ * The revision number contains information about revisions made at the source,
+ * but also revisions to the document by target databases (and then synced with the source).
+ *
+ */
+
+void Database::updateDocRevisionNumber(QString doc_id,QString revision){
+    if (!initializeIfNeeded())
+        return;
+
+    QSqlQuery query(cachedQuery("UPDATE document SET doc_rev = :revisionId WHERE doc_id = :docId"));
+    query.bindValue(":docId", doc_id);
+    query.bindValue(":revisionId", revision);
+    if (!query.exec())
+    {
+        setError(query.lastError().text());
+
+    }
+
+}
+
+/*!
+    The getCurrentGenerationNumber() function searches for the
+current generation number from the  sqlite_sequence table.
+The return value can then be used during a synchronization session,
+amongst other things.
+
+ */
+
+int Database::getCurrentGenerationNumber(){
+
+    int sequence_number = -1;
+
+    QSqlQuery query(cachedQuery("SELECT seq FROM sqlite_sequence WHERE name = 'transaction_log'"));
+
+    if (query.exec())
+    {
+        while (query.next())
+        {
+            sequence_number = (query.value("seq").toInt());
+
+        }
+
+    }
+    else{
+        setError(query.lastError().text());
+    }
+
+    return sequence_number;
+
+}
+
+/*!
+    The generateNewTransactionId() function generates a random
+transaction id string, for use when creating new transations.
+
+ */
+
+QString Database::generateNewTransactionId(){
+
+    QString uid = "T-"+QUuid::createUuid().toString();
+    uid = uid.replace("}","");
+    uid = uid.replace("{","");
+    return uid;
+
+}
+
+/*!
+    Each time a document in the Database is created or updated a
+new transaction is performed, and information about it inserted into the
+transation_log table using the createNewTransaction(QString doc_id)
+function.
+
+ */
+
+int Database::createNewTransaction(QString doc_id){
+
+    QString transaction_id = generateNewTransactionId();
+
+    QSqlQuery query(cachedQuery("INSERT INTO transaction_log(doc_id, transaction_id) VALUES(:docId, :transactionId)"));
+    query.bindValue(":docId", doc_id);
+    query.bindValue(":transactionId", transaction_id);
+
+    if (!query.exec()){
+        return -1;
+    }
+    else{
+        m_writesSinceCompaction++;
+        m_writesSinceSnapshot++;
+        return 0;
+    }
+
+    return -1;
+}
+
+/*!
+    \internal
+    Stores \a contents under \a docId, which is set to a newly generated docId
+    if it's empty, and records a new transaction. Neither a database
+    transaction is started nor are any changes notified, it's up to the
+    caller to do that.
+    Returns the new revision of the document, or an empty string on failure.
+ */
+QString
+Database::writeDoc(const QVariant& contents, QString& docId)
+{
+    bool exists = !docId.isEmpty() && !getCurrentDocRevisionNumber(docId).isEmpty();
+
+    QString revision_number = getNextDocRevisionNumber(docId);
+
+    if (exists)
+    {
+        QSqlQuery query(cachedQuery("UPDATE document SET doc_rev=:docRev, content=:docJson WHERE doc_id = :docId"));
+        query.bindValue(":docId", docId);
+        query.bindValue(":docRev", revision_number);
+        query.bindValue(":docJson", serializeContents(contents));
+        if (!query.exec())
+            return setError(QString("Failed to put/ update document %1: %2\n%3").arg(docId).arg(query.lastError().text()).arg(query.lastQuery())) ? "" : "";
+    }
+    else
+    {
+        if (docId.isEmpty())
+            docId = QString("D-%1").arg(QUuid::createUuid().toString().mid(1).replace("}",""));
+        if (!QRegExp("^[a-zA-Z0-9.%_-]+$").exactMatch(docId))
+            return setError(QString("Invalid docID %1").arg(docId)) ? "" : "";
+
+        QSqlQuery query(cachedQuery("INSERT INTO document (doc_id, doc_rev, content) VALUES (:docId, :docRev, :docJson)"));
+        query.bindValue(":docId", docId);
+        query.bindValue(":docRev", revision_number);
+        query.bindValue(":docJson", serializeContents(contents));
+        if (!query.exec())
+            return setError(QString("Failed to put document %1: %2\n%3").arg(docId).arg(query.lastError().text()).arg(query.lastQuery())) ? "" : "";
+    }
+
+    QMutexLocker locker(&m_mutex);
+    m_documentCache.remove(docId);
+    locker.unlock();
+
+    if (!updateDocumentFields(docId, contents, m_storageFormat != Binary))
+        return "";
+
+    createNewTransaction(docId);
+
+    return revision_number;
+}
+
+/*!
+    \qmlmethod string Database::putDoc(var, string)
+    Updates the existing \a contents of the document identified by \a docId if
+    there's no error.
+    If no \a docId is given or \a docId is an empty string the \a contents will be
+    stored under an autogenerated name.
+    Returns the new revision of the document, or -1 on failure.
+ */
+/*!
+    Updates the existing \a contents of the document identified by \a docId if
+    there's no error.
+    If no \a docId is given or \a docId is an empty string the \a contents will be
+    stored under an autogenerated name.
+    Returns the new revision of the document, or -1 on failure.
+ */
+QString
+Database::putDoc(QVariant contents, const QString& docId)
+{
+    if (!initializeIfNeeded())
+        return "";
+
+    if (contents.canConvert<QVariantMap>())
+        contents = contents.value<QVariantMap>();
+
+    ScopedTransaction t(m_db);
+
+    QString newOrEmptyDocId(docId);
+    QString revision_number = writeDoc(contents, newOrEmptyDocId);
+    if (revision_number.isEmpty())
+    {
+        // Nothing of a partially written document may be committed
+        t.rollback();
+        return "";
+    }
+    t.commit();
+    compactIfNeeded();
+
+    updateModelRow(newOrEmptyDocId);
+
+    Q_EMIT docChanged(newOrEmptyDocId, contents);
+    Q_FOREACH (Database* peer, connectionPeers(m_db, this))
+        peer->onPeerDocChanged(newOrEmptyDocId, contents);
+
+    return revision_number;
+}
+
+/*!
+    \qmlmethod list<string> Database::putDocs(list<var>, list<string>)
+    Stores all \a docs in a single transaction, each under the docId at the
+    same position in \a docIds, or under autogenerated names if no \a docIds
+    are given. If any document fails to be stored none of them are.
+    Views are updated and docsChanged() is emitted only once for the batch.
+    Returns the new revisions of the documents, or an empty list on failure.
+ */
+/*!
+    Stores all \a docs in a single transaction, each under the docId at the
+    same position in \a docIds, or under autogenerated names if no \a docIds
+    are given. If any document fails to be stored none of them are.
+    Views are updated and docsChanged() is emitted only once for the batch.
+    Returns the new revisions of the documents, or an empty list on failure.
+ */
+QStringList
+Database::putDocs(QVariantList docs, QStringList docIds)
+{
+    QStringList revisions;
+    if (!initializeIfNeeded())
+        return revisions;
+
+    if (!docIds.isEmpty() && docIds.count() != docs.count())
+        return setError(QString("Failed to put documents: %1 documents but %2 docIDs").arg(docs.count()).arg(docIds.count())) ? revisions : revisions;
+
+    ScopedTransaction t(m_db);
+
+    QStringList changedDocIds;
+    for (int i = 0; i < docs.count(); ++i)
+    {
+        QVariant contents(docs.at(i));
+        if (contents.canConvert<QVariantMap>())
+            contents = contents.value<QVariantMap>();
+
+        QString newOrEmptyDocId(docIds.isEmpty() ? QString() : docIds.at(i));
+        QString revision_number = writeDoc(contents, newOrEmptyDocId);
+        if (revision_number.isEmpty())
+        {
+            t.rollback();
+            return QStringList();
+        }
+        revisions.append(revision_number);
+        changedDocIds.append(newOrEmptyDocId);
+    }
+    t.commit();
+    compactIfNeeded();
+
+    resetModel();
+
+    Q_EMIT docsChanged(changedDocIds);
+    Q_FOREACH (Database* peer, connectionPeers(m_db, this))
+        peer->onPeerDocsChanged(changedDocIds);
+
+    return revisions;
+}
+
+/*!
+    \qmlmethod void Database::deleteDoc(string)
+    Deletes the document identified by \a docId. It's kept as a tombstone
+    that's left out of listings until purgeTombstones() removes it. Deleting
+    a document that doesn't exist, or was deleted already, is an error.
+ */
+/*!
+    Deletes the document identified by \a docId. It's kept as a tombstone
+    that's left out of listings until purgeTombstones() removes it. Deleting
+    a document that doesn't exist, or was deleted already, is an error.
+ */
+void
+Database::deleteDoc(const QString& docId)
+{
+    if (!initializeIfNeeded())
+        return;
+
+    // Tombstones are only written for documents that exist
+    if (!findMissingDoc(QStringList() << docId).isEmpty())
+    {
+        setError(QString("Failed to delete document %1: No document").arg(docId));
+        return;
+    }
+    putDoc(QString(), docId);
+}
+
+/*!
+    \internal
+    Returns the first of \a docIds that doesn't exist or is already deleted,
+    or an empty string if all of them can be deleted.
+ */
+QString
+Database::findMissingDoc(const QStringList& docIds)
+{
+    QSqlQuery query(cachedQuery("SELECT content IS NULL AS deleted FROM document "
+        "WHERE doc_id = :docId"));
+    Q_FOREACH (const QString& docId, docIds)
+    {
+        query.bindValue(":docId", docId);
+        bool found = query.exec() && query.next() && !query.value("deleted").toBool();
+        query.finish();
+        if (!found)
+            return docId;
+    }
+    return QString();
+}
+
+/*!
+    \qmlmethod void Database::deleteDocs(list<string>)
+    Deletes all documents identified by \a docIds in a single transaction.
+    If any of them doesn't exist none is deleted.
+ */
+/*!
+    Deletes all documents identified by \a docIds in a single transaction.
+    If any of them doesn't exist none is deleted.
+ */
+void
+Database::deleteDocs(const QStringList& docIds)
+{
+    if (!initializeIfNeeded())
+        return;
+
+    // Tombstones are only written for documents that exist
+    QString missing(findMissingDoc(docIds));
+    if (!missing.isEmpty())
+    {
+        setError(QString("Failed to delete document %1: No document").arg(missing));
+        return;
+    }
+
+    QVariantList docs;
+    for (int i = 0; i < docIds.count(); ++i)
+        docs.append(QString());
+    putDocs(docs, docIds);
+}
+
+/*!
+    \qmlmethod AsyncResult Database::getDocAsync(string)
+    Loads the contents of the document \a docId in the background. The
+    finished signal of the returned AsyncResult passes the contents.
+ */
+/*!
+    Loads the contents of the document \a docId in the background.
+    The returned AsyncResult provides the contents when it's finished.
+ */
+AsyncResult*
+Database::getDocAsync(const QString& docId)
+{
+    AsyncResult* result(new AsyncResult(AsyncResult::GetDoc, this));
+    result->m_docId = docId;
+    return queueRequest(result);
+}
+
+/*!
+    \qmlmethod AsyncResult Database::putDocAsync(var, string)
+    Updates the existing \a contents of the document identified by \a docId,
+    or creates a new document, in the background. The finished signal of the
+    returned AsyncResult passes the new revision. docChanged is emitted
+    right before that.
+ */
+/*!
+    Updates the existing \a contents of the document identified by \a docId,
+    or creates a new document, in the background. The returned AsyncResult
+    provides the new revision and docId when it's finished.
+ */
+AsyncResult*
+Database::putDocAsync(QVariant contents, const QString& docId)
+{
+    // Values from QML can only be used on this thread
+    if (contents.canConvert<QVariantMap>())
+        contents = contents.value<QVariantMap>();
+
+    AsyncResult* result(new AsyncResult(AsyncResult::PutDoc, this));
+    result->m_contents = contents;
+    result->m_docId = docId;
+    return queueRequest(result);
+}
+
+/*!
+    \qmlmethod AsyncResult Database::listDocsAsync()
+    Lists the docId of every document in the background. The finished
+    signal of the returned AsyncResult passes the list.
+ */
+/*!
+    Lists the docId of every document in the background.
+    The returned AsyncResult provides the list when it's finished.
+ */
+AsyncResult*
+Database::listDocsAsync()
+{
+    return queueRequest(new AsyncResult(AsyncResult::ListDocs, this));
+}
+
+/*!
+    \internal
+    Hands \a result to the worker thread, which is started on first use.
+    An in-memory database can't be opened by a second connection, so its
+    requests are carried out right away, the result is still announced later.
+ */
+AsyncResult*
+Database::queueRequest(AsyncResult* result)
+{
+    result->m_path = m_path;
+    result->m_storageFormat = m_storageFormat;
+    result->m_journalMode = m_journalMode;
+    result->m_synchronous = m_synchronous;
+    result->m_cacheSize = m_cacheSize;
+    result->m_mmapSize = m_mmapSize;
+    result->m_pageSize = m_pageSize;
+    result->m_documentCacheSize = getDocumentCacheSize();
+    result->m_compactionThreshold = m_compactionThreshold;
+    QObject::connect(result, &AsyncResult::completed, this, &Database::onAsyncCompleted, Qt::QueuedConnection);
+
+    if (m_path.isEmpty())
+    {
+        QString docId(result->m_docId);
+        QString error;
+        QVariant value(runRequest(result->m_operation, result->m_contents, docId, error));
+        result->complete(value, docId, error);
+        return result;
+    }
+
+    if (!m_workerThread)
+    {
+        m_workerThread = new QThread(this);
+        m_worker = new DatabaseWorker;
+        m_worker->moveToThread(m_workerThread);
+        QObject::connect(m_workerThread, &QThread::finished, m_worker, &QObject::deleteLater);
+        m_workerThread->start();
+    }
+    QMetaObject::invokeMethod(m_worker, "process", Qt::QueuedConnection, Q_ARG(QObject*, result));
+    return result;
+}
+
+/*!
+    \internal
+    Carries out an AsyncResult::Operation on this connection, without
+    emitting any signals about changes. Returns the result of the operation,
+    \a docId is updated with the docId that was written and \a error with
+    the error if it failed.
+ */
+QVariant
+Database::runRequest(int operation, const QVariant& contents, QString& docId, QString& error)
+{
+    QMutexLocker locker(&m_mutex);
+    m_error.clear();
+    locker.unlock();
+    QVariant value;
+    switch (operation)
+    {
+    case AsyncResult::GetDoc:
+        value = getDoc(docId);
+        break;
+    case AsyncResult::PutDoc:
+        if (initializeIfNeeded())
+        {
+            ScopedTransaction t(m_db);
+            QString revision(writeDoc(contents, docId));
+            if (revision.isEmpty())
+                t.rollback();
+            else
+                value = revision;
+        }
+        compactIfNeeded();
+        break;
+    case AsyncResult::ListDocs:
+        value = QStringList(listDocs());
+        break;
+    }
+    error = lastError();
+    return value;
+}
+
+/*!
+    \internal
+    Brings the model and the cache up to date with an operation that was
+    carried out and announces the \a result.
+ */
+void
+Database::onAsyncCompleted(AsyncResult* result)
+{
+    if (result->m_operation == AsyncResult::PutDoc && result->m_error.isEmpty())
+    {
+        QMutexLocker locker(&m_mutex);
+        m_documentCache.remove(result->m_docId);
+        locker.unlock();
+        updateModelRow(result->m_docId);
+        Q_EMIT docChanged(result->m_docId, result->m_contents);
+        Q_FOREACH (Database* peer, connectionPeers(m_db, this))
+            peer->onPeerDocChanged(result->m_docId, result->m_contents);
+    }
+    result->finish();
+}
+
+/*!
+    \internal
+    Brings the model and the cache up to date after another Database using
+    the same connection modified \a docId and announces the change.
+ */
+void
+Database::onPeerDocChanged(const QString& docId, const QVariant& contents)
+{
+    QMutexLocker locker(&m_mutex);
+    m_documentCache.remove(docId);
+    locker.unlock();
+    updateModelRow(docId);
+    Q_EMIT docChanged(docId, contents);
+}
+
+/*!
+    \internal
+    Reloads the model after another Database using the same connection
+    modified all of \a docIds at once and announces the change.
+ */
+void
+Database::onPeerDocsChanged(const QStringList& docIds)
+{
+    QMutexLocker locker(&m_mutex);
+    Q_FOREACH (const QString& docId, docIds)
+        m_documentCache.remove(docId);
+    locker.unlock();
+    resetModel();
+    Q_EMIT docsChanged(docIds);
+}
+
+/*!
+    \internal
+    Updates the row of \a docId after it was written, inserting it at its
+    position in the model or notifying that its data changed, instead of
+    resetting the whole model. Documents past the rows fetched so far are
+    left to fetchMore().
+ */
+void
+Database::updateModelRow(const QString& docId)
+{
+    // Rows are ordered by docId, find the first that isn't less than docId
+    int row = 0;
+    int count = m_modelRows.count();
+    while (count > 0)
+    {
+        int step = count / 2;
+        if (m_modelRows.at(row + step).docId < docId)
+        {
+            row += step + 1;
+            count -= step + 1;
+        }
+        else
+            count = step;
+    }
+
+    QSqlQuery query(cachedQuery("SELECT content FROM document WHERE doc_id = :docId"));
+    query.bindValue(":docId", docId);
+    // Deleted documents are removed from the model like missing ones
+    bool exists = query.exec() && query.next() && !query.value("content").isNull();
+    QByteArray content(exists ? query.value("content").toByteArray() : QByteArray());
+    query.finish();
+
+    bool fetched = row < m_modelRows.count() && m_modelRows.at(row).docId == docId;
+    if (fetched && exists)
+    {
+        m_modelRows[row].content = content;
+        m_modelRows[row].contents = QVariant();
+        m_modelRows[row].loaded = false;
+        moveModelWindow(row, row + 1);
+        Q_EMIT dataChanged(index(row), index(row));
+    }
+    else if (fetched)
+    {
+        beginRemoveRows(QModelIndex(), row, row);
+        m_modelRows.removeAt(row);
+        // The window moves along with the rows after the removed one
+        if (row < m_firstLoadedRow)
+            m_firstLoadedRow--;
+        if (row < m_lastLoadedRow)
+            m_lastLoadedRow--;
+        endRemoveRows();
+    }
+    else if (exists && (row < m_modelRows.count() || m_modelComplete))
+    {
+        ModelRow newRow;
+        newRow.docId = docId;
+        newRow.content = content;
+        newRow.loaded = false;
+        beginInsertRows(QModelIndex(), row, row);
+        m_modelRows.insert(row, newRow);
+        if (row < m_firstLoadedRow)
+            m_firstLoadedRow++;
+        if (row < m_lastLoadedRow)
+            m_lastLoadedRow++;
+        endInsertRows();
+        moveModelWindow(row, row + 1);
+    }
+}
+
+/*!
+ * \brief Database::resetModel
+ *
+ * Resets the Database model, documents are fetched again as needed.
+ */
+
+void Database::resetModel(){
+
+    beginResetModel();
+    m_modelRows.clear();
+    m_firstLoadedRow = 0;
+    m_lastLoadedRow = 0;
+    m_modelComplete = false;
+    endResetModel();
+
+}
+
+
+/*!
+    \qmlmethod list<string> Database::listDocs()
+    Returns a list of all stored documents by their docId.
+ */
+/*!
+    Returns a list of all stored documents by their docId.
+ */
+QList<QString>
+Database::listDocs()
+{
+    QList<QString> list;
+    if (!initializeIfNeeded())
+        return list;
+
+    QSqlQuery query(cachedQuery("SELECT doc_id FROM document WHERE content IS NOT NULL ORDER BY doc_id"));
+    if (query.exec())
+    {
+        while (query.next())
+        {
+            list.append(query.value("doc_id").toString());
+        }
+        return list;
+    }
+
+    return setError(QString("Failed to list documents: %1\n%2").arg(query.lastError().text()).arg(query.lastQuery())) ? list : list;
 }
 
 /*!
-    Describes the error as a string if the last operation failed.
+    \qmlmethod list<string> Database::listDocs(int, int)
+    Returns at most \a limit docId values of stored documents, skipping the
+    first \a offset documents in the order of their docId.
  */
-bool
-Database::setError(const QString& error)
+/*!
+    Returns at most \a limit docId values of stored documents, skipping the
+    first \a offset documents in the order of their docId.
+ */
+QList<QString>
+Database::listDocs(int offset, int limit)
 {
-    qWarning("u1db: %s", qPrintable(error));
-    m_error = error;
-    Q_EMIT errorChanged(error);
-    return false;
+    QList<QString> list;
+    if (!initializeIfNeeded())
+        return list;
+
+    QSqlQuery query(cachedQuery("SELECT doc_id FROM document WHERE content IS NOT NULL "
+        "ORDER BY doc_id LIMIT :limit OFFSET :offset"));
+    query.bindValue(":limit", limit);
+    query.bindValue(":offset", offset);
+    if (query.exec())
+    {
+        while (query.next())
+            list.append(query.value("doc_id").toString());
+        return list;
+    }
+
+    return setError(QString("Failed to list documents: %1\n%2").arg(query.lastError().text()).arg(query.lastQuery())) ? list : list;
 }
 
 /*!
-    \qmlproperty string Database::error
-    The last error as a string if the last operation failed.
- */
-/*!
-    The last error as a string if the last operation failed.
+    Returns at most \a limit docId values of stored documents that come
+    after \a lastDocId in the order of their docId, or all of them if
+    \a limit is negative. Unlike skipping an offset, only the returned
+    documents are visited.
  */
-QString
-Database::lastError()
+QStringList
+Database::listDocsAfter(const QString& lastDocId, int limit)
 {
-    return m_error;
+    QStringList list;
+    if (!initializeIfNeeded())
+        return list;
+
+    QSqlQuery query(cachedQuery("SELECT doc_id FROM document WHERE doc_id > :lastDocId AND content IS NOT NULL "
+        "ORDER BY doc_id LIMIT :limit"));
+    query.bindValue(":lastDocId", lastDocId.isNull() ? QString("") : lastDocId);
+    query.bindValue(":limit", limit < 0 ? -1 : limit);
+    if (!query.exec())
+        return setError(QString("Failed to list documents: %1\n%2").arg(query.lastError().text()).arg(query.lastQuery())) ? list : list;
+
+    while (query.next())
+        list.append(query.value("doc_id").toString());
+    return list;
 }
 
 /*!
-    Ensures that the underlying database works, or tries to set it up:
-
-    The SQlite backend is loaded - it's an optional Qt5 module and can fail
-    If @path is an existing database, it'll be opened
-    For a new database, the default schema will be applied
+    Calls \a callback with the docId, revision and stored content of every
+    document in the order of their docId, until it returns false. Documents
+    are read in batches of \a batchSize, so memory use doesn't grow with the
+    size of the database. The callback may use the Database, changes it makes
+    to documents that weren't visited yet can be seen or not.
+    Returns false if reading failed.
  */
 bool
-Database::initializeIfNeeded(const QString& path)
+Database::forEachDoc(DocumentCallback callback, int batchSize)
 {
-    if (m_db.isOpen())
-        return true;
-
-    /* A unique ID is used for the connection name to ensure that we aren't
-       re-using or replacing other opend databases. */
-    if (!m_db.isValid())
-        m_db = QSqlDatabase::addDatabase("QSQLITE",QUuid::createUuid().toString());
-
-    if (!m_db.isValid())
-        return setError("QSqlDatabase error");
+    if (!initializeIfNeeded())
+        return false;
+    if (batchSize < 1)
+        batchSize = Database::PAGE_SIZE;
 
-    if (path != Database::MEMORY_PATH)
+    struct Row
     {
-        QDir parent(QFileInfo(path).dir());
-        if (!parent.mkpath(parent.path()))
-            setError(QString("Failed to make parent folder %1").arg(parent.path()));
-    }
+        QString docId;
+        QString revision;
+        QByteArray content;
+    };
+
+    QString lastDocId;
+    int fetched = batchSize;
+    while (fetched == batchSize)
+    {
+        QSqlQuery query(cachedQuery("SELECT doc_id, doc_rev, content FROM document "
+            "WHERE doc_id > :lastDocId AND content IS NOT NULL ORDER BY doc_id LIMIT :limit"));
+        query.bindValue(":lastDocId", lastDocId);
+        query.bindValue(":limit", batchSize);
+        if (!query.exec())
+            return setError(QString("Failed to list documents: %1\n%2").arg(query.lastError().text()).arg(query.lastQuery()));
 
-    m_db.setDatabaseName(path);
+        // The batch is read completely so that the callback can run queries
+        QList<Row> rows;
+        while (query.next())
+        {
+            Row row;
+            row.docId = query.value("doc_id").toString();
+            row.revision = query.value("doc_rev").toString();
+            row.content = query.value("content").toByteArray();
+            rows.append(row);
+        }
+        query.finish();
 
-    if (!m_db.open())
-        return setError(QString("Failed to open '%1`: %2").arg(path).arg(m_db.lastError().text()));
-    if (!isInitialized())
-    {
-        if (!isInitialized())
+        fetched = rows.count();
+        Q_FOREACH (const Row& row, rows)
         {
-            QFile file(":/dbschema.sql");
-            if (file.open(QIODevice::ReadOnly | QIODevice::Text))
-            {
-                ScopedTransaction t(m_db);
-
-                while (!file.atEnd())
-                {
-                    QByteArray line = file.readLine();
-                    while (!line.endsWith(";\n") && !file.atEnd())
-                        line += file.readLine();
-                    if (m_db.exec(line).lastError().isValid())
-                        return setError(QString("Failed to apply internal schema: %1\n%2").arg(m_db.lastError().text()).arg(QString(line)));
-                }
-
-                QSqlQuery query(m_db.exec());
-                query.prepare("INSERT OR REPLACE INTO u1db_config VALUES ('replica_uid', :uuid)");
-                query.bindValue(":uuid", QUuid::createUuid().toString());
-                if (!query.exec())
-                    return setError(QString("Failed to apply internal schema: %1\n%2").arg(m_db.lastError().text()).arg(query.lastQuery()));
-                // Double-check
-                if (query.boundValue(0).toString() != getReplicaUid())
-                    return setError(QString("Invalid replica uid: %1").arg(query.boundValue(0).toString()));
-            }
-            else
-                return setError(QString("Failed to read internal schema: FileError %1").arg(file.error()));
+            if (!callback(row.docId, row.revision, row.content))
+                return true;
+            lastDocId = row.docId;
         }
     }
     return true;
 }
 
 /*!
-    Instantiate a new Database with an optional \a parent,
-    usually by declaring it as a QML item.
+    \qmlproperty string Database::path
+    A relative \a path can be given to store the database in an app-specific
+    writable folder. This is recommended as it ensures to work with confinement.
+    If more control is needed absolute paths or local file URIs can be used.
+    By default or if the path is empty everything is stored in memory.
  */
-Database::Database(QObject *parent) :
-    QAbstractListModel(parent), m_path("")
+/*!
+    A relative \a path can be given to store the database in an app-specific
+    writable folder. This is recommended as it ensures to work with confinement.
+    If more control is needed absolute paths or local file URIs can be used.
+    By default or if the path is empty everything is stored in memory.
+ */
+void
+Database::setPath(const QString& path)
 {
-    initializeIfNeeded();
+    if (m_path == path)
+        return;
+
+    abortBackups();
+    beginResetModel();
+    // Prepared queries belong to the connection that is about to be closed
+    m_statements.clear();
+    QMutexLocker locker(&m_mutex);
+    m_documentCache.clear();
+    m_readPath.clear();
+    locker.unlock();
+    m_modelRows.clear();
+    m_firstLoadedRow = 0;
+    m_lastLoadedRow = 0;
+    m_modelComplete = false;
+    m_replicaUid.clear();
+    updateReadGeneration(this, false);
+    releaseConnection(m_db, this);
+    // An in-memory database is only created once it's used
+    if (!path.isEmpty())
+        initializeIfNeeded(sanitizePath(path));
+    endResetModel();
+
+    m_path = path;
+    if (m_path.isEmpty() && !m_snapshotPath.isEmpty())
+        restoreSnapshot();
+    updateSnapshotTimer();
+    Q_EMIT pathChanged(m_path);
 }
 
 /*!
-    Used to implement QAbstractListModel
-    Returns docId matching the given row index
-    assuming all documents are ordered consistently
+ * Returns the path of the database.
  */
 QString
-Database::getDocIdByRow(int row) const
+Database::getPath()
 {
-    if (!m_db.isOpen())
-        return QString();
-
-    QSqlQuery query(m_db.exec());
-    query.prepare("SELECT doc_id FROM document LIMIT 1 OFFSET :row");
-    query.bindValue(":row", row);
-    if (query.exec() && query.next())
-        return query.value("doc_id").toString();
-    return QString();
+    return m_path;
 }
 
 /*!
-    \internal
-    Used to implement QAbstractListModel
-    Implements the variables exposed to the Delegate in a model
-    QVariant contents
-    QString docId
-    int index (built-in)
+    Returns the journal mode, empty if the default of SQLite is used.
  */
-QVariant
-Database::data(const QModelIndex & index, int role) const
+QString
+Database::getJournalMode()
 {
-    QString docId(getDocIdByRow(index.row()));
-    if (role == 0) // contents
-        return getDocUnchecked(docId);
-    if (role == 1) // docId
-        return docId;
-    return QVariant();
+    return m_journalMode;
 }
 
 /*!
-    \internal
-    Used to implement QAbstractListModel
-    Defines \b{contents} and \b{docId} as variables exposed to the Delegate in a model
-    \b{index} is supported out of the box.
+    \qmlproperty string Database::journalMode
+    The SQLite journal mode, one of \e delete, \e truncate, \e persist,
+    \e memory, \e wal or \e off. By default a rollback journal is used.
+    Write-ahead logging with \e wal is recommended together with a
+    synchronous value of \e normal for frequent writes on flash storage.
+    The mode is applied when the database is opened and whenever it changes.
+    If SQLite can't use the mode, for example \e wal for an in-memory
+    database, an error is reported and the mode in effect is set instead.
  */
-QHash<int, QByteArray>
-Database::roleNames() const
+/*!
+    Sets the SQLite \a journalMode, one of \e delete, \e truncate,
+    \e persist, \e memory, \e wal or \e off. By default a rollback journal
+    is used. The mode is applied when the database is opened and whenever
+    it changes.
+ */
+void
+Database::setJournalMode(const QString& journalMode)
 {
-    QHash<int, QByteArray> roles;
-    roles.insert(0, "contents");
-    roles.insert(1, "docId");
-    return roles;
+    QString mode(journalMode.toLower());
+    if (m_journalMode == mode)
+        return;
+
+    if (!(QStringList() << "" << "delete" << "truncate" << "persist" << "memory" << "wal" << "off").contains(mode))
+    {
+        setError(QString("Invalid journal mode %1").arg(journalMode));
+        return;
+    }
+
+    m_journalMode = mode;
+    Q_EMIT journalModeChanged(m_journalMode);
+    // The mode SQLite actually uses is announced if it differs
+    applyPragmas();
 }
 
 /*!
-    \internal
-    Used to implement QAbstractListModel
-    The number of rows: the number of documents in the database.
+    Returns the synchronous mode, empty if the default of SQLite is used.
  */
-int
-Database::rowCount(const QModelIndex & parent) const
+QString
+Database::getSynchronous()
 {
-    if (!m_db.isOpen())
-        return 0;
-
-    QSqlQuery query(m_db.exec());
-    query.prepare("SELECT COUNT(*) AS count FROM document");
-    if (!(query.exec() && query.next()))
-        return 0;
-    return query.value("count").toInt();
+    return m_synchronous;
 }
 
 /*!
-    Same functionality as Database::getDoc() except it won't set Database::lastError() and it
-    doesn't implicitly try to initialize the underlying database.
-    \a docId must be a valid unique ID string
-    Use cases: model implementations, Document::getContents()
+    \qmlproperty string Database::synchronous
+    How often SQLite waits for data to be written to disk, one of \e off,
+    \e normal, \e full or \e extra. The default is \e full. With a
+    journalMode of \e wal, \e normal remains safe against corruption but
+    may lose the most recent transactions on power loss.
  */
-QVariant
-Database::getDocUnchecked(const QString& docId) const
+/*!
+    Sets how often SQLite waits for data to be written to disk,
+    \a synchronous is one of \e off, \e normal, \e full or \e extra.
+ */
+void
+Database::setSynchronous(const QString& synchronous)
 {
-    if (!m_db.isOpen())
-        return QVariant();
+    QString mode(synchronous.toLower());
+    if (m_synchronous == mode)
+        return;
 
-    QSqlQuery query(m_db.exec());
-    query.prepare("SELECT doc_rev, content FROM document WHERE doc_id = :docId");
-    query.bindValue(":docId", docId);
-    if (query.exec() && query.next())
+    if (!(QStringList() << "" << "off" << "normal" << "full" << "extra").contains(mode))
     {
-        // Convert JSON string to the Variant that QML expects
-        QJsonDocument json(QJsonDocument::fromJson(query.value("content").toByteArray()));
-        Q_EMIT docLoaded(docId, json.object().toVariantMap());
-        return json.object().toVariantMap();
+        setError(QString("Invalid synchronous mode %1").arg(synchronous));
+        return;
     }
-    return QVariant();
+
+    m_synchronous = mode;
+    applyPragmas();
+    Q_EMIT synchronousChanged(m_synchronous);
 }
 
 /*!
- * \internal
- * \brief Database::getDocumentContents
- *
- * Returns the string representation of a document that has
- * been selected from the database using a document id.
- *
+    Returns the page cache size, 0 if the default of SQLite is used.
  */
+int
+Database::getCacheSize()
+{
+    return m_cacheSize;
+}
 
-QString
-Database::getDocumentContents(const QString& docId)
+/*!
+    \qmlproperty int Database::cacheSize
+    The size of the page cache, as a number of pages if positive or in
+    kibibytes if negative. 0 keeps the default of SQLite.
+ */
+/*!
+    Sets the size of the page cache to \a cacheSize, as a number of pages if
+    positive or in kibibytes if negative. 0 keeps the default of SQLite.
+ */
+void
+Database::setCacheSize(int cacheSize)
 {
-    if (!initializeIfNeeded())
-        return QString();
+    if (m_cacheSize == cacheSize)
+        return;
 
-    QSqlQuery query(m_db.exec());
-    query.prepare("SELECT document.doc_rev, document.content, "
-        "count(conflicts.doc_rev) AS conflicts FROM document LEFT OUTER JOIN "
-        "conflicts ON conflicts.doc_id = document.doc_id WHERE "
-        "document.doc_id = :docId GROUP BY document.doc_id, "
-        "document.doc_rev, document.content");
-    query.bindValue(":docId", docId);
-    if (query.exec())
     {
-        if (query.next())
-        {
-            if (query.value("conflicts").toInt() > 0)
-                setError(QString("Conflicts in %1").arg(docId));
-            return query.value("content").toString();
-        }
-        return setError(QString("Failed to get document %1: No document").arg(docId)) ? QString() : QString();
+        QMutexLocker locker(&m_mutex);
+        m_cacheSize = cacheSize;
     }
-    return setError(QString("Failed to get document %1: %2\n%3").arg(docId).arg(query.lastError().text()).arg(query.lastQuery())) ? QString() : QString();
+    applyPragmas();
+    Q_EMIT cacheSizeChanged(m_cacheSize);
 }
 
+/*!
+    Returns the maximum size of memory-mapped I/O, -1 if the default of
+    SQLite is used.
+ */
+qint64
+Database::getMmapSize()
+{
+    return m_mmapSize;
+}
 
 /*!
-    \qmlmethod Variant Database::getDoc(string)
-    Returns the contents of a document by \a docId in a form that QML recognizes
-    as a Variant object, it's identical to Document::getContents() with the
-    same \a docId.
+    \qmlproperty int Database::mmapSize
+    The maximum number of bytes of the database file that are accessed
+    through memory-mapped I/O, 0 disables it. -1 keeps the default of SQLite.
  */
 /*!
- *  Returns the contents of a document by \a docId in a form that QML recognizes
- *  as a Variant object, it's identical to Document::getContents() with the
- *  same \a docId.
+    Sets the maximum number of bytes of the database file that are accessed
+    through memory-mapped I/O to \a mmapSize, 0 disables it. -1 keeps the
+    default of SQLite.
  */
-QVariant
-Database::getDoc(const QString& docId)
+void
+Database::setMmapSize(qint64 mmapSize)
 {
-    if (!initializeIfNeeded())
-        return QVariant();
+    if (m_mmapSize == mmapSize)
+        return;
 
-    QSqlQuery query(m_db.exec());
-    query.prepare("SELECT document.doc_rev, document.content, "
-        "count(conflicts.doc_rev) AS conflicts FROM document LEFT OUTER JOIN "
-        "conflicts ON conflicts.doc_id = document.doc_id WHERE "
-        "document.doc_id = :docId GROUP BY document.doc_id, "
-        "document.doc_rev, document.content");
-    query.bindValue(":docId", docId);
-    if (query.exec())
     {
-        if (query.next())
-        {
-            if (query.value("conflicts").toInt() > 0)
-                setError(QString("Conflicts in %1").arg(docId));
-            // Convert JSON string to the Variant that QML expects
-            QJsonDocument json(QJsonDocument::fromJson(query.value("content").toByteArray()));
-            Q_EMIT docLoaded(docId, json.object().toVariantMap());
-            return json.object().toVariantMap();
-        }
-        return setError(QString("Failed to get document %1: No document").arg(docId)) ? QVariant() : QVariant();
+        QMutexLocker locker(&m_mutex);
+        m_mmapSize = mmapSize;
     }
-    return setError(QString("Failed to get document %1: %2\n%3").arg(docId).arg(query.lastError().text()).arg(query.lastQuery())) ? QVariant() : QVariant();
+    applyPragmas();
+    Q_EMIT mmapSizeChanged(m_mmapSize);
 }
 
 /*!
- * \internal
-  This function creates a new revision number.
-
-  It returns a string for use in the document table's 'doc_rev' field.
+    Returns the page size, 0 if the default of SQLite is used.
  */
-
-QString Database::getNextDocRevisionNumber(QString doc_id)
+int
+Database::getPageSize()
 {
+    return m_pageSize;
+}
 
-    QString revision_number = getReplicaUid()+":1";
-
-    QString current_revision_number = getCurrentDocRevisionNumber(doc_id);
+/*!
+    \qmlproperty int Database::pageSize
+    The page size in bytes used for new databases, a power of two between
+    512 and 65536. 0 keeps the default of SQLite. Existing databases keep
+    their page size.
+ */
+/*!
+    Sets the page size in bytes used for new databases to \a pageSize, a power
+    of two between 512 and 65536. 0 keeps the default of SQLite.
+ */
+void
+Database::setPageSize(int pageSize)
+{
+    if (m_pageSize == pageSize)
+        return;
 
-    /*!
-        Some revisions contain information from previous
-conflicts/syncs. Revisions are delimited by '|'.
+    if (pageSize != 0 && (pageSize < 512 || pageSize > 65536 || (pageSize & (pageSize - 1)) != 0))
+    {
+        setError(QString("Invalid page size %1").arg(pageSize));
+        return;
+    }
 
-     */
+    m_pageSize = pageSize;
+    applyPragmas();
+    Q_EMIT pageSizeChanged(m_pageSize);
+}
 
-    QStringList current_revision_list = current_revision_number.split("|");
+/*!
+    Returns the maximum number of bytes of parsed documents that are cached.
+ */
+int
+Database::getDocumentCacheSize()
+{
+    QMutexLocker locker(&m_mutex);
+    return m_documentCache.maxCost();
+}
 
-    Q_FOREACH (QString current_revision, current_revision_list) {
+/*!
+    \qmlproperty int Database::documentCacheSize
+    The maximum size in bytes of stored documents whose parsed contents are
+    kept in memory, least recently used documents are dropped first.
+    0 disables the cache. The default is 4 MiB.
+ */
+/*!
+    Sets the maximum size in bytes of stored documents whose parsed contents
+    are kept in memory to \a documentCacheSize, least recently used documents
+    are dropped first. 0 disables the cache. The default is 4 MiB.
+ */
+void
+Database::setDocumentCacheSize(int documentCacheSize)
+{
+    QMutexLocker locker(&m_mutex);
+    if (m_documentCache.maxCost() == documentCacheSize)
+        return;
 
-        /*!
-            Each revision contains two pieces of information,
-the uid of the database that made the revsion, and a counter
-for the revsion. This information is delimited by ':'.
+    m_documentCache.setMaxCost(qMax(documentCacheSize, 0));
+    documentCacheSize = m_documentCache.maxCost();
+    locker.unlock();
+    Q_EMIT documentCacheSizeChanged(documentCacheSize);
+}
 
-         */
+/*!
+    Returns the format used to store documents.
+ */
+Database::StorageFormat
+Database::getStorageFormat()
+{
+    return m_storageFormat;
+}
 
-        QStringList current_revision_number_list = current_revision.split(":");
+/*!
+    \qmlproperty enumeration Database::storageFormat
+    The format used to store documents that are written from now on:
+    \list
+    \li Database.IndentedJson - human-readable JSON text
+    \li Database.CompactJson - JSON text without whitespace, the default
+    \li Database.Binary - a binary encoding that is smaller and faster to parse
+    \endlist
+    Documents in any format are read transparently, use migrateStorageFormat()
+    to convert documents that were stored before.
+ */
+/*!
+    Sets the format used to store documents that are written from now on to
+    \a storageFormat. Documents in any format are read transparently.
+ */
+void
+Database::setStorageFormat(StorageFormat storageFormat)
+{
+    if (m_storageFormat == storageFormat)
+        return;
 
-        if(current_revision_number_list[0]==getReplicaUid()) {
+    m_storageFormat = storageFormat;
+    Q_EMIT storageFormatChanged(m_storageFormat);
+}
 
-            /*!
-                If the current revision uid  is the same as this Database's uid the counter portion is increased by one.
+/*!
+    \internal
+    Encodes \a contents in the current storage format. Contents that aren't
+    a JSON object are stored as they are.
+ */
+QVariant
+Database::serializeContents(const QVariant& contents) const
+{
+    // Deleted documents are stored as NULL
+    if (!contents.isValid() || (contents.type() == QVariant::String && contents.toString().isEmpty()))
+        return QVariant(QVariant::String);
 
-             */
+    // Parse Variant from QML as JsonDocument, fallback to string
+    QJsonDocument json(QJsonDocument::fromVariant(contents));
+    if (json.isEmpty())
+        return contents;
 
-            int revision_generation_number = current_revision_number_list[1].toInt()+1;
+    switch (m_storageFormat)
+    {
+    case IndentedJson:
+        return json.toJson(QJsonDocument::Indented);
+    case Binary:
+#if QT_VERSION >= QT_VERSION_CHECK(5, 12, 0)
+        return QCborValue(QCborMap::fromJsonObject(json.object())).toCbor();
+#else
+        return json.toBinaryData();
+#endif
+    case CompactJson:
+    default:
+        return json.toJson(QJsonDocument::Compact);
+    }
+}
 
-            revision_number = getReplicaUid()+":"+QString::number(revision_generation_number);
+/*!
+    \qmlmethod int Database::migrateStorageFormat()
+    Rewrites all stored documents in the current storageFormat, without
+    changing their revisions. Returns the number of converted documents,
+    or -1 if an error occurred.
+ */
+/*!
+    Rewrites all stored documents in the current storage format, without
+    changing their revisions. Returns the number of converted documents,
+    or -1 if an error occurred.
+ */
+int
+Database::migrateStorageFormat()
+{
+    if (!initializeIfNeeded())
+        return -1;
 
+    ScopedTransaction t(m_db);
+    int migrated = 0;
+    QString lastDocId;
+    bool more = true;
+    while (more)
+    {
+        QSqlQuery select(cachedQuery("SELECT doc_id, content FROM document "
+            "WHERE doc_id > :lastDocId ORDER BY doc_id LIMIT :limit"));
+        select.bindValue(":lastDocId", lastDocId);
+        select.bindValue(":limit", Database::PAGE_SIZE);
+        if (!select.exec())
+        {
+            t.rollback();
+            return setError(QString("Failed to migrate documents: %1\n%2").arg(select.lastError().text()).arg(select.lastQuery())) ? -1 : -1;
         }
-        else {
-
-            /*!
-                If the current revision uid  is not the same as this Database's uid then the revision represents a change that originated in another database.
-
-             */
-            //revision_number+="|"+current_revision;
 
-            /* Not sure if the above is necessary,
-             *and did not appear to be working as intended either.
-             *
-             * Commented out, but maybe OK to delete.
-             */
+        QList<QPair<QString, QVariant> > rows;
+        int fetched = 0;
+        while (select.next())
+        {
+            fetched++;
+            lastDocId = select.value("doc_id").toString();
+            QByteArray content(select.value("content").toByteArray());
+            QVariantMap contents(parseContents(content));
+            // Deleted and unparseable documents are left as they are
+            if (contents.isEmpty())
+                continue;
+            QVariant converted(serializeContents(contents));
+            if (converted.toByteArray() != content)
+                rows.append(qMakePair(lastDocId, converted));
         }
+        more = fetched == Database::PAGE_SIZE;
+        select.finish();
 
+        typedef QPair<QString, QVariant> Row;
+        Q_FOREACH (const Row& row, rows)
+        {
+            QSqlQuery update(cachedQuery("UPDATE document SET content = :content WHERE doc_id = :docId"));
+            update.bindValue(":content", row.second);
+            update.bindValue(":docId", row.first);
+            if (!update.exec())
+            {
+                t.rollback();
+                return setError(QString("Failed to migrate document %1: %2\n%3").arg(row.first).arg(update.lastError().text()).arg(update.lastQuery())) ? -1 : -1;
+            }
+            migrated++;
+        }
+    }
+    // String values move between document_fields and the expression indexes
+    if (migrated > 0 && !(getFieldIndexes() + getFieldIndexes(true)).isEmpty() && !reindexDocuments())
+    {
+        t.rollback();
+        return -1;
     }
+    t.commit();
+    return migrated;
+}
 
-    /*!
-        The Database UID has curly brackets, but they are not required for the revision number and need to be removed.
+/*!
+    Returns the number of writes after which the transaction log is compacted.
+ */
+int
+Database::getCompactionThreshold()
+{
+    return m_compactionThreshold;
+}
 
-     */
+/*!
+    \qmlproperty int Database::compactionThreshold
+    The number of document writes after which compactTransactionLog() is run
+    automatically. 0 disables automatic compaction, which is the default.
+ */
+/*!
+    Sets the number of document writes after which the transaction log is
+    compacted automatically to \a compactionThreshold, 0 disables it.
+ */
+void
+Database::setCompactionThreshold(int compactionThreshold)
+{
+    if (m_compactionThreshold == compactionThreshold)
+        return;
 
-    revision_number = revision_number.replace("{","");
+    m_compactionThreshold = qMax(compactionThreshold, 0);
+    Q_EMIT compactionThresholdChanged(m_compactionThreshold);
+}
 
-    revision_number = revision_number.replace("}","");
+/*!
+    \qmlmethod int Database::compactTransactionLog()
+    Removes transactions that were superseded by a later transaction of the
+    same document and that are older than the lowest generation known by
+    any replica in the sync log. Returns the number of removed transactions,
+    or -1 if an error occurred.
+ */
+/*!
+    Removes transactions that were superseded by a later transaction of the
+    same document and that are older than the lowest generation known by
+    any replica in the sync log, so that listTransactionsSince() returns every
+    document only once. Generation numbers aren't reused.
+    Returns the number of removed transactions, or -1 if an error occurred.
+ */
+int
+Database::compactTransactionLog()
+{
+    if (!initializeIfNeeded())
+        return -1;
 
-    return revision_number;
+    // Without any known replica every superseded transaction can go
+    QSqlQuery known(cachedQuery("SELECT min(known_generation) AS generation FROM sync_log"));
+    if (!(known.exec() && known.next()))
+        return setError(QString("Failed to compact transactions: %1\n%2").arg(known.lastError().text()).arg(known.lastQuery())) ? -1 : -1;
+    qlonglong generation(known.value("generation").isNull()
+        ? std::numeric_limits<qlonglong>::max() : known.value("generation").toLongLong());
+    known.finish();
+
+    QSqlQuery query(cachedQuery("DELETE FROM transaction_log WHERE generation < :generation "
+        "AND EXISTS (SELECT 1 FROM transaction_log later WHERE "
+        "later.doc_id = transaction_log.doc_id AND later.generation > transaction_log.generation)"));
+    query.bindValue(":generation", generation);
+    if (!query.exec())
+        return setError(QString("Failed to compact transactions: %1\n%2").arg(query.lastError().text()).arg(query.lastQuery())) ? -1 : -1;
 
+    int reclaimed = query.numRowsAffected();
+    m_writesSinceCompaction = 0;
+    QMutexLocker locker(&m_mutex);
+    m_transactionsReclaimed += reclaimed;
+    return reclaimed;
 }
 
 /*!
- * \internal
-    The getCurrentDocRevisionNumber(QString doc_id) function
-returns the current string value from the document table's
-doc_rev field.
-
+    \qmlmethod int Database::purgeTombstones(int)
+    Removes deleted documents for good if they weren't changed since
+    \a olderThanGeneration, along with their transactions. Returns the number
+    of purged documents, or -1 if an error occurred.
  */
-
-
-QString Database::getCurrentDocRevisionNumber(QString doc_id){
+/*!
+    Removes deleted documents for good if they weren't changed since
+    \a olderThanGeneration, along with their transactions. Replicas that
+    haven't synced since then won't learn about the deletion.
+    Returns the number of purged documents, or -1 if an error occurred.
+ */
+int
+Database::purgeTombstones(int olderThanGeneration)
+{
     if (!initializeIfNeeded())
-        return QString();
-
-    QSqlQuery query(m_db.exec());
+        return -1;
 
-    query.prepare("SELECT doc_rev from document WHERE doc_id = :docId");
-    query.bindValue(":docId", doc_id);
+    ScopedTransaction t(m_db);
+    QSqlQuery purge(cachedQuery("DELETE FROM document WHERE content IS NULL AND NOT EXISTS "
+        "(SELECT 1 FROM transaction_log WHERE transaction_log.doc_id = document.doc_id "
+        "AND transaction_log.generation >= :generation)"));
+    purge.bindValue(":generation", olderThanGeneration);
+    if (!purge.exec())
+    {
+        t.rollback();
+        return setError(QString("Failed to purge deleted documents: %1\n%2").arg(purge.lastError().text()).arg(purge.lastQuery())) ? -1 : -1;
+    }
+    int purged = purge.numRowsAffected();
 
-    if (query.exec())
+    QStringList cleanups;
+    cleanups << "DELETE FROM transaction_log WHERE doc_id NOT IN (SELECT doc_id FROM document)"
+        << "DELETE FROM conflicts WHERE doc_id NOT IN (SELECT doc_id FROM document)"
+        << "DELETE FROM document_fields WHERE doc_id NOT IN (SELECT doc_id FROM document)";
+    Q_FOREACH (QString cleanup, cleanups)
     {
-        while (query.next())
+        QSqlQuery query(cachedQuery(cleanup));
+        if (!query.exec())
         {
-            return query.value("doc_rev").toString();
+            t.rollback();
+            return setError(QString("Failed to purge deleted documents: %1\n%2").arg(query.lastError().text()).arg(query.lastQuery())) ? -1 : -1;
         }
-
     }
-    else{
-        return setError(query.lastError().text()) ? QString() : QString();
-    }
-    return QString();
+    return purged;
 }
 
 /*!
- * \internal
- * \brief Database::updateSyncLog
- *
- * This method is used at the end of a synchronization session,
- * to update the database with the latest information known about the peer
- * database that was synced against.
+    \internal
+    Compacts the transaction log if compactionThreshold writes happened since
+    it was last compacted.
  */
-void Database::updateSyncLog(bool insert, QString uid, QString generation, QString transaction_id)
+void
+Database::compactIfNeeded()
 {
+    if (m_compactionThreshold > 0 && m_writesSinceCompaction >= m_compactionThreshold)
+        compactTransactionLog();
+}
 
+/*!
+    \qmlmethod AsyncResult Database::backupTo(string, int)
+    Copies the database to the file at \a path while it remains in use,
+    \a pagesPerStep pages at a time, or all at once if it's negative. The
+    finished signal of the returned AsyncResult passes true on success.
+ */
+/*!
+    Copies the database to the file at \a path while it remains in use, using
+    the online backup API of SQLite. \a pagesPerStep pages are copied at a time
+    from the event loop, or all at once if it's negative, so that writers
+    aren't blocked for long. The returned AsyncResult provides true on
+    success. A backup in progress is aborted if the path of the Database
+    changes.
+ */
+AsyncResult*
+Database::backupTo(const QString& path, int pagesPerStep)
+{
+    AsyncResult* result(new AsyncResult(AsyncResult::Backup, this));
+    QObject::connect(result, &AsyncResult::completed, this, &Database::onAsyncCompleted, Qt::QueuedConnection);
     if (!initializeIfNeeded())
-        return;
+    {
+        result->complete(false, QString(), lastError());
+        return result;
+    }
 
-    QSqlQuery query(m_db.exec());
+    sqlite3* handle(sqliteHandle(m_db));
+    if (!handle)
+    {
+        // Without the backup API the copy is made at once, and announced
+        // later like a backup that finished in one step
+        QString error;
+        bool copied(exportTo(sanitizePath(path), error));
+        QTimer::singleShot(0, result, [result, copied, error]() {
+            result->complete(copied, QString(), error);
+        });
+        return result;
+    }
 
-    if(insert==true){
-        query.prepare("INSERT INTO sync_log(known_generation,known_transation_id,known_transation_id) VALUES(:knownGeneration, :knownTransactionId, :replicaUid)");
+    BackupJob* job(new BackupJob(result, this));
+    job->start(handle, sanitizePath(path), pagesPerStep);
+    return result;
+}
 
+/*!
+    \internal
+    Copies the database to the file at \a path with SQL, for when the SQLite
+    connection can't be used with the backup API. An existing file is only
+    replaced once the copy is complete.
+ */
+bool
+Database::exportTo(const QString& path, QString& error)
+{
+    QDir parent(QFileInfo(path).dir());
+    parent.mkpath(parent.path());
+    QString temporary(path + "-copy");
+    QFile::remove(temporary);
+
+    QSqlQuery query(m_db);
+    query.prepare("VACUUM INTO :path");
+    query.bindValue(":path", temporary);
+    bool copied(query.exec());
+    if (!copied)
+        error = QString("Failed to copy database: %1").arg(query.lastError().text());
+    query.finish();
+
+    // SQLite before 3.27 lacks VACUUM INTO, files are copied as they are
+    if (!copied && m_db.databaseName() != Database::MEMORY_PATH)
+    {
+        m_db.exec("PRAGMA wal_checkpoint(TRUNCATE)");
+        // Writers wait for the read transaction while the file is copied
+        ScopedTransaction t(m_db);
+        m_db.exec("SELECT COUNT(*) FROM u1db_config");
+        copied = QFile::copy(m_db.databaseName(), temporary);
+        error = copied ? QString() : QString("Failed to copy database to '%1'").arg(path);
     }
-    else{
-        query.prepare("UPDATE sync_log SET known_generation = :knownGeneration, known_transation_id = :knownTransactionId WHERE replica_uid = :replicaUid");
+    if (!copied)
+    {
+        QFile::remove(temporary);
+        return false;
     }
 
+    QFile::remove(path);
+    if (!QFile::rename(temporary, path))
+    {
+        QFile::remove(temporary);
+        error = QString("Failed to replace '%1'").arg(path);
+        return false;
+    }
+    return true;
+}
 
-    query.bindValue(":replicaUid", uid);
-    query.bindValue(":knownGeneration", generation);
-    query.bindValue(":knownTransactionId", transaction_id);
+/*!
+    \internal
+    Replaces all tables of the database with those of the database file at
+    \a path with SQL, for when the SQLite connection can't be used with the
+    backup API.
+ */
+bool
+Database::importFrom(const QString& path, QString& error)
+{
+    QSqlQuery query(m_db);
+    query.prepare("ATTACH DATABASE :path AS snapshot");
+    query.bindValue(":path", path);
     if (!query.exec())
     {
-        setError(query.lastError().text());
+        error = QString("Failed to open '%1': %2").arg(path).arg(query.lastError().text());
+        return false;
+    }
 
+    QStringList statements;
+    query.exec("SELECT type, name FROM main.sqlite_master "
+        "WHERE type IN ('table', 'view') AND name NOT LIKE 'sqlite_%'");
+    while (query.next())
+        statements << QString("DROP %1 main.\"%2\"").arg(query.value("type").toString().toUpper()).arg(query.value("name").toString());
+    // Rows are copied before indexes and triggers are created
+    query.exec("SELECT type, name, sql FROM snapshot.sqlite_master "
+        "WHERE sql IS NOT NULL AND name NOT LIKE 'sqlite_%' ORDER BY type != 'table'");
+    while (query.next())
+    {
+        statements << query.value("sql").toString();
+        if (query.value("type").toString() == "table")
+            statements << QString("INSERT INTO main.\"%1\" SELECT * FROM snapshot.\"%1\"").arg(query.value("name").toString());
     }
+    query.finish();
 
+    bool copied(true);
+    {
+        ScopedTransaction t(m_db);
+        Q_FOREACH (const QString& statement, statements)
+        {
+            if (m_db.exec(statement).lastError().isValid())
+            {
+                error = QString("Failed to copy database: %1\n%2").arg(m_db.lastError().text()).arg(statement);
+                t.rollback();
+                copied = false;
+                break;
+            }
+        }
+    }
+    m_db.exec("DETACH DATABASE snapshot");
+    return copied;
 }
 
 /*!
- * \internal
- *
- * Whenever a document as added or modified it needs a new revision number.
- *
- * The revision number contains information about revisions made at the source,
- * but also revisions to the document by target databases (and then synced with the source).
- *
+    \internal
+    Stops backups in progress, their results report an error.
  */
+void
+Database::abortBackups()
+{
+    qDeleteAll(findChildren<BackupJob*>(QString(), Qt::FindDirectChildrenOnly));
+}
 
-void Database::updateDocRevisionNumber(QString doc_id,QString revision){
-    if (!initializeIfNeeded())
+/*!
+    Returns the file that the contents of an in-memory database are saved to.
+ */
+QString
+Database::getSnapshotPath()
+{
+    return m_snapshotPath;
+}
+
+/*!
+    \qmlproperty string Database::snapshotPath
+    If set, an in-memory database loads its contents from this file and saves
+    them back every snapshotInterval milliseconds if they changed, as well as
+    when the Database is destroyed. Writes happen at the speed of memory while
+    at most one interval of changes can be lost. Relative paths are handled
+    like \l path.
+ */
+/*!
+    Sets the file that the contents of an in-memory database are loaded from
+    and saved to every snapshotInterval milliseconds to \a snapshotPath.
+ */
+void
+Database::setSnapshotPath(const QString& snapshotPath)
+{
+    if (m_snapshotPath == snapshotPath)
         return;
 
-    QSqlQuery query(m_db.exec());
+    m_snapshotPath = snapshotPath;
+    if (m_path.isEmpty() && !m_snapshotPath.isEmpty())
+        restoreSnapshot();
+    updateSnapshotTimer();
+    Q_EMIT snapshotPathChanged(m_snapshotPath);
+}
 
-    query.prepare("UPDATE document SET doc_rev = :revisionId WHERE doc_id = :docId");
-    query.bindValue(":docId", doc_id);
-    query.bindValue(":revisionId", revision);
-    if (!query.exec())
-    {
-        setError(query.lastError().text());
+/*!
+    Returns the interval in milliseconds between snapshots.
+ */
+int
+Database::getSnapshotInterval()
+{
+    return m_snapshotInterval;
+}
 
-    }
+/*!
+    \qmlproperty int Database::snapshotInterval
+    The interval in milliseconds in which an in-memory database is saved to
+    snapshotPath if it changed. 0 saves it only when the Database is
+    destroyed. The default is 10 seconds.
+ */
+/*!
+    Sets the interval in milliseconds between snapshots to \a snapshotInterval,
+    0 saves only when the Database is destroyed.
+ */
+void
+Database::setSnapshotInterval(int snapshotInterval)
+{
+    if (m_snapshotInterval == snapshotInterval)
+        return;
 
+    m_snapshotInterval = qMax(snapshotInterval, 0);
+    updateSnapshotTimer();
+    Q_EMIT snapshotIntervalChanged(m_snapshotInterval);
 }
 
 /*!
-    The getCurrentGenerationNumber() function searches for the
-current generation number from the  sqlite_sequence table.
-The return value can then be used during a synchronization session,
-amongst other things.
-
+    \internal
+    Replaces the contents of the in-memory database with the snapshot file,
+    if there is one.
  */
+bool
+Database::restoreSnapshot()
+{
+    QString path(sanitizePath(m_snapshotPath));
+    if (!QFile::exists(path) || !initializeIfNeeded())
+        return true;
 
-int Database::getCurrentGenerationNumber(){
+    QString error;
+    sqlite3* handle(sqliteHandle(m_db));
+    sqlite3* snapshot(handle ? BackupJob::open(path, true, error) : 0);
+    if (handle && !snapshot)
+        return setError(error);
 
-    int sequence_number = -1;
+    beginResetModel();
+    m_statements.clear();
+    QMutexLocker locker(&m_mutex);
+    m_documentCache.clear();
+    locker.unlock();
+    m_modelRows.clear();
+    m_firstLoadedRow = 0;
+    m_lastLoadedRow = 0;
+    m_modelComplete = false;
+    // The snapshot comes with the replica uid it was taken from
+    m_replicaUid.clear();
+    bool copied(handle ? BackupJob::copy(snapshot, handle, error) : importFrom(path, error));
+    BackupJob::close(snapshot);
+    endResetModel();
+    m_writesSinceSnapshot = 0;
 
-    QSqlQuery query(m_db.exec());
+    if (!copied)
+        return setError(error);
+    // Snapshots written by older versions may need an upgrade
+    return upgradeSchema();
+}
+
+/*!
+    \internal
+    Starts a snapshot of the in-memory database if it changed since the last
+    one, unless one is still in progress. The writes it covers are only
+    forgotten once it succeeded, so a failed snapshot is retried.
+ */
+void
+Database::snapshotIfNeeded()
+{
+    if (m_writesSinceSnapshot == 0 || !findChildren<BackupJob*>(QString(), Qt::FindDirectChildrenOnly).isEmpty())
+        return;
 
-    query.prepare("SELECT seq FROM sqlite_sequence WHERE name = 'transaction_log'");
+    // Writes made while the snapshot runs are left for the next one
+    int writes(m_writesSinceSnapshot);
+    AsyncResult* result(backupTo(m_snapshotPath));
+    QObject::connect(result, &AsyncResult::completed, this, [this, writes](AsyncResult* completed) {
+        if (completed->m_error.isEmpty())
+            m_writesSinceSnapshot = qMax(0, m_writesSinceSnapshot - writes);
+    });
+}
 
-    if (query.exec())
+/*!
+    \internal
+    Runs the snapshot timer while an in-memory database has a snapshotPath.
+ */
+void
+Database::updateSnapshotTimer()
+{
+    if (m_path.isEmpty() && !m_snapshotPath.isEmpty() && m_snapshotInterval > 0)
     {
-        while (query.next())
+        if (!m_snapshotTimer)
         {
-            sequence_number = (query.value("seq").toInt());
-
+            m_snapshotTimer = new QTimer(this);
+            QObject::connect(m_snapshotTimer, &QTimer::timeout, this, &Database::snapshotIfNeeded);
         }
-
-    }
-    else{
-        setError(query.lastError().text());
+        m_snapshotTimer->start(m_snapshotInterval);
     }
-
-    return sequence_number;
-
+    else if (m_snapshotTimer)
+        m_snapshotTimer->stop();
 }
 
 /*!
-    The generateNewTransactionId() function generates a random
-transaction id string, for use when creating new transations.
-
+   Stores a new index under the given \a indexName, with \a expressions.
+   An existing index of the same name is replaced if the expressions differ.
+   Fields that are plain paths such as "managers.name" get an SQLite index on
+   their value in the stored JSON, which lookups use instead of
+   document_fields.
  */
+QString
+Database::putIndex(const QString& indexName, QStringList expressions)
+{
+    if (indexName.isEmpty() || expressions.isEmpty())
+        return QString("Either name or expressions is empty");
 
-QString Database::generateNewTransactionId(){
-
-    QString uid = "T-"+QUuid::createUuid().toString();
-    uid = uid.replace("}","");
-    uid = uid.replace("{","");
-    return uid;
+    Q_FOREACH (QString expression, expressions)
+        if (expression.isEmpty() || expression.isNull())
+            return QString("Empty expression in list");
 
-}
+    if (!initializeIfNeeded())
+        return QString("Database isn't ready");
 
-/*!
-    Each time a document in the Database is created or updated a
-new transaction is performed, and information about it inserted into the
-transation_log table using the createNewTransaction(QString doc_id)
-function.
+    ScopedTransaction t(m_db);
 
- */
+    // Definitions are listed from the last offset to the first
+    QStringList existing;
+    Q_FOREACH (QString expression, getIndexExpressions(indexName))
+        existing.prepend(expression);
 
-int Database::createNewTransaction(QString doc_id){
+    bool changed = existing != expressions;
+    if (changed && !existing.isEmpty())
+    {
+        QSqlQuery remove(cachedQuery("DELETE FROM index_definitions WHERE name = :indexName"));
+        remove.bindValue(":indexName", indexName);
+        if (!remove.exec())
+        {
+            t.rollback();
+            return QString("Failed to replace index definition: %1\n%2").arg(remove.lastError().text()).arg(remove.lastQuery());
+        }
+    }
 
-    QString transaction_id = generateNewTransactionId();
+    if (changed)
+    {
+        QSqlQuery query(m_db.exec());
+        query.prepare("INSERT INTO index_definitions VALUES (:indexName, :offset, :field)");
 
-    QSqlQuery query(m_db.exec());
+        QVariantList indexNameData;
+        QVariantList offsetData;
+        QVariantList fieldData;
+        for (int i = 0; i < expressions.count(); ++i)
+        {
+            indexNameData << indexName;
+            offsetData << i;
+            fieldData << expressions.at(i);
+        }
+        query.addBindValue(indexNameData);
+        query.addBindValue(offsetData);
+        query.addBindValue(fieldData);
 
-    QString queryString = "INSERT INTO transaction_log(doc_id, transaction_id) VALUES('"+doc_id+"', '"+transaction_id+"')";
+        if (!query.execBatch())
+        {
+            t.rollback();
+            return QString("Failed to insert index definition: %1\n%2").arg(m_db.lastError().text()).arg(query.lastQuery());
+        }
+    }
 
-    if (!query.exec(queryString)){
-        return -1;
+    // Databases created before expression indexes get them here as well
+    QStringList fieldIndexes(getFieldIndexes() + getFieldIndexes(true));
+    if (!updateFieldIndexes())
+    {
+        t.rollback();
+        return lastError();
     }
-    else{
-        return 0;
+
+    // Index existing documents, new ones are indexed by putDoc()
+    if ((changed || getFieldIndexes() + getFieldIndexes(true) != fieldIndexes) && !reindexDocuments())
+    {
+        t.rollback();
+        return QString("Failed to index documents: %1").arg(lastError());
     }
 
-    return -1;
+    return QString();
 }
 
 /*!
-    \qmlmethod string Database::putDoc(var, string)
-    Updates the existing \a contents of the document identified by \a docId if
-    there's no error.
-    If no \a docId is given or \a docId is an empty string the \a contents will be
-    stored under an autogenerated name.
-    Returns the new revision of the document, or -1 on failure.
- */
-/*!
-    Updates the existing \a contents of the document identified by \a docId if
-    there's no error.
-    If no \a docId is given or \a docId is an empty string the \a contents will be
-    stored under an autogenerated name.
-    Returns the new revision of the document, or -1 on failure.
+   Removes the index \a indexName stored with putIndex(), along with the
+   values and SQLite indexes of fields that no other index uses.
+   Returns an error message, or an empty string on success.
  */
 QString
-Database::putDoc(QVariant contents, const QString& docId)
+Database::deleteIndex(const QString& indexName)
 {
     if (!initializeIfNeeded())
-        return "";
-
-    if (contents.canConvert<QVariantMap>())
-        contents = contents.value<QVariantMap>();
+        return QString("Database isn't ready");
 
     ScopedTransaction t(m_db);
 
-    QString newOrEmptyDocId(docId);
-    QVariant oldDoc = newOrEmptyDocId.isEmpty() ? QVariant() : getDocUnchecked(newOrEmptyDocId);
-
-    QString revision_number = getNextDocRevisionNumber(newOrEmptyDocId);
-
-    QSqlQuery query(m_db.exec());
-    if (oldDoc.isValid())
+    QStringList statements;
+    statements << "DELETE FROM index_definitions WHERE name = :indexName"
+        << "DELETE FROM document_fields WHERE field_name NOT IN (SELECT field FROM index_definitions)";
+    Q_FOREACH (QString statement, statements)
     {
-        query.prepare("UPDATE document SET doc_rev=:docRev, content=:docJson WHERE doc_id = :docId");
-        query.bindValue(":docId", newOrEmptyDocId);
-        query.bindValue(":docRev", revision_number);
-        // Parse Variant from QML as JsonDocument, fallback to string
-        QString json(QJsonDocument::fromVariant(contents).toJson());
-        query.bindValue(":docJson", json.isEmpty() ? contents : json);
+        QSqlQuery query(cachedQuery(statement));
+        if (statement.contains(":indexName"))
+            query.bindValue(":indexName", indexName);
         if (!query.exec())
-            return setError(QString("Failed to put/ update document %1: %2\n%3").arg(newOrEmptyDocId).arg(query.lastError().text()).arg(query.lastQuery())) ? "" : "";
-        query.prepare("DELETE FROM document_fields WHERE doc_id = :docId");
-        query.bindValue(":docId", newOrEmptyDocId);
-        if (!query.exec())
-            return setError(QString("Failed to delete document field %1: %2\n%3").arg(newOrEmptyDocId).arg(query.lastError().text()).arg(query.lastQuery())) ? "" : "";
-
-        createNewTransaction(newOrEmptyDocId);
-
+        {
+            t.rollback();
+            return QString("Failed to delete index %1: %2\n%3").arg(indexName).arg(query.lastError().text()).arg(query.lastQuery());
+        }
     }
-    else
-    {
-        if (newOrEmptyDocId.isEmpty())
-            newOrEmptyDocId = QString("D-%1").arg(QUuid::createUuid().toString().mid(1).replace("}",""));
-        if (!QRegExp("^[a-zA-Z0-9.%_-]+$").exactMatch(newOrEmptyDocId))
-            return setError(QString("Invalid docID %1").arg(newOrEmptyDocId)) ? "" : "";
-
-        query.prepare("INSERT INTO document (doc_id, doc_rev, content) VALUES (:docId, :docRev, :docJson)");
-        query.bindValue(":docId", newOrEmptyDocId);
-        query.bindValue(":docRev", revision_number);
-        // Parse Variant from QML as JsonDocument, fallback to string
-        QJsonDocument json(QJsonDocument::fromVariant(contents));
-        query.bindValue(":docJson", json.isEmpty() ? contents : json.toJson());
-        if (!query.exec())
-            return setError(QString("Failed to put document %1: %2\n%3").arg(docId).arg(query.lastError().text()).arg(query.lastQuery())) ? "" : "";
 
-        createNewTransaction(newOrEmptyDocId);
+    if (!updateFieldIndexes())
+    {
+        t.rollback();
+        return lastError();
     }
+    return QString();
+}
 
-    beginResetModel();
-    endResetModel();
-    /* FIXME investigate correctly notifying about new rows
-    beginInsertRows(QModelIndex(), rowCount(), 0);
-    endInsertRows();
-    */
-
-    Q_EMIT docChanged(newOrEmptyDocId, contents);
+/*!
+    \internal
+    Lists the fields that have an SQLite index on their string values in the
+    stored JSON, or on their numeric values if \a numeric is true, see
+    updateFieldIndexes().
+ */
+QStringList
+Database::getFieldIndexes(bool numeric)
+{
+    QStringList fields;
+
+    const QString& prefix(numeric ? NUMBER_INDEX_PREFIX : FIELD_INDEX_PREFIX);
+    QSqlQuery query(cachedQuery("SELECT substr(name, :offset) AS field FROM sqlite_master "
+        "WHERE type = 'index' AND substr(name, 1, :length) = :prefix ORDER BY name"));
+    query.bindValue(":offset", prefix.size() + 1);
+    query.bindValue(":length", prefix.size());
+    query.bindValue(":prefix", prefix);
+    if (!query.exec())
+        return setError(QString("Failed to lookup field indexes: %1\n%2").arg(query.lastError().text()).arg(query.lastQuery())) ? fields : fields;
 
-    return revision_number;
+    while (query.next())
+        fields.append(query.value("field").toString());
+    return fields;
 }
 
 /*!
-    \qmlmethod void Database::deleteDoc(string)
-    Deletes the document identified by \a docId.
+    \internal
+    Creates SQLite indexes on the string and on the numeric values in the
+    stored JSON for every indexed field that's a plain path, and drops those
+    of fields that aren't indexed anymore. The numeric index keeps numbers
+    in their natural order for range lookups. Without JSON support in SQLite
+    no indexes are created and all values are kept in document_fields, any
+    other failure to create an index is an error.
  */
+bool
+Database::updateFieldIndexes()
+{
+    QStringList indexed(getIndexedFields());
+    for (int kind = 0; kind < 2; ++kind)
+    {
+        bool numeric = kind == 1;
+        const QString& prefix(numeric ? NUMBER_INDEX_PREFIX : FIELD_INDEX_PREFIX);
+        QStringList existing(getFieldIndexes(numeric));
+        Q_FOREACH (QString field, existing)
+        {
+            if (indexed.contains(field))
+                continue;
+            QSqlQuery drop(m_db.exec(QString("DROP INDEX \"%1%2\"").arg(prefix, field)));
+            if (drop.lastError().isValid())
+                return setError(QString("Failed to drop index of field %1: %2").arg(field).arg(drop.lastError().text()));
+        }
+        Q_FOREACH (QString field, indexed)
+        {
+            if (existing.contains(field) || !isPlainField(field))
+                continue;
+            QSqlQuery create(m_db.exec(QString("CREATE INDEX \"%1%2\" ON document(%3) WHERE content IS NOT NULL").arg(
+                prefix, field, fieldExpression(field, numeric))));
+            if (!create.lastError().isValid())
+                continue;
+            // Without JSON support values are kept in document_fields instead
+            if (create.lastError().databaseText().startsWith("no such function: json_"))
+                return true;
+            return setError(QString("Failed to create index of field %1: %2").arg(field).arg(create.lastError().text()));
+        }
+    }
+    return true;
+}
+
 /*!
-    Deletes the document identified by \a docId.
+    \internal
+    Rebuilds the document_fields rows of all documents.
  */
-void
-Database::deleteDoc(const QString& docId)
+bool
+Database::reindexDocuments()
 {
-    putDoc(QString(), docId);
+    QSqlQuery documents(m_db.exec());
+    documents.prepare("SELECT doc_id, content FROM document WHERE content IS NOT NULL");
+    if (!documents.exec())
+        return setError(QString("Failed to list documents: %1\n%2").arg(documents.lastError().text()).arg(documents.lastQuery()));
+    while (documents.next())
+    {
+        QByteArray content(documents.value("content").toByteArray());
+        if (!updateDocumentFields(documents.value("doc_id").toString(), parseContents(content), !isBinaryContent(content)))
+            return false;
+    }
+    return true;
 }
 
 /*!
- * \brief Database::resetModel
- *
- * Resets the Database model.
+    \internal
+    Lists the fields of all indexes stored with putIndex().
  */
+QStringList
+Database::getIndexedFields()
+{
+    QStringList fields;
 
-void Database::resetModel(){
-
-    beginResetModel();
-    endResetModel();
+    QSqlQuery query(cachedQuery("SELECT DISTINCT field FROM index_definitions"));
+    if (!query.exec())
+        return setError(QString("Failed to lookup index definitions: %1\n%2").arg(m_db.lastError().text()).arg(query.lastQuery())) ? fields : fields;
 
+    while (query.next())
+        fields.append(query.value("field").toString());
+    return fields;
 }
 
-
-/*!
-    \qmlmethod list<string> Database::listDocs()
-    Returns a list of all stored documents by their docId.
- */
 /*!
-    Returns a list of all stored documents by their docId.
+    \internal
+    Replaces the document_fields rows of \a docId with the values of all
+    indexed fields found in \a contents. An empty \a contents only removes
+    existing rows, which is what happens for deleted documents.
+    String and numeric values of fields with an expression index are left
+    out if the document is stored as JSON text, as indicated by
+    \a textContent, since they're looked up through the index.
  */
-QList<QString>
-Database::listDocs()
+bool
+Database::updateDocumentFields(const QString& docId, const QVariant& contents, bool textContent)
 {
-    QList<QString> list;
-    if (!initializeIfNeeded())
-        return list;
+    QSqlQuery query(cachedQuery("DELETE FROM document_fields WHERE doc_id = :docId"));
+    query.bindValue(":docId", docId);
+    if (!query.exec())
+        return setError(QString("Failed to delete document field %1: %2\n%3").arg(docId).arg(query.lastError().text()).arg(query.lastQuery()));
 
-    QSqlQuery query(m_db.exec());
-    query.prepare("SELECT document.doc_id, document.doc_rev, document.content, "
-        "count(conflicts.doc_rev) FROM document LEFT OUTER JOIN conflicts "
-        "ON conflicts.doc_id = document.doc_id GROUP BY document.doc_id, "
-        "document.doc_rev, document.content");
-    if (query.exec())
+    QStringList fields(getIndexedFields());
+    if (fields.isEmpty())
+        return true;
+
+    if (textContent)
     {
-        while (query.next())
+        QVariantMap map(contents.toMap());
+        Q_FOREACH (QString field, getFieldIndexes())
         {
-            list.append(query.value("doc_id").toString());
+            QVariant value;
+            if (lookupField(map, field, value) && value.type() == QVariant::String)
+                fields.removeOne(field);
+        }
+        Q_FOREACH (QString field, getFieldIndexes(true))
+        {
+            QVariant value;
+            if (lookupField(map, field, value) && isNumber(value))
+                fields.removeOne(field);
         }
-        return list;
     }
 
-    return setError(QString("Failed to list documents: %1\n%2").arg(query.lastError().text()).arg(query.lastQuery())) ? list : list;
+    QList<QPair<QString, QVariant> > values;
+    collectFieldValues(contents.toMap(), QString(), fields, values);
+    if (values.isEmpty())
+        return true;
+
+    // The value is the string that Query matches against, the sort key
+    // keeps its type so that values are ordered like Query orders them
+    QVariantList docIdData;
+    QVariantList fieldData;
+    QVariantList valueData;
+    QVariantList sortKeyData;
+    for (int i = 0; i < values.count(); ++i)
+    {
+        docIdData << docId;
+        fieldData << values.at(i).first;
+        valueData << values.at(i).second.toString();
+        sortKeyData << sortKey(values.at(i).second);
+    }
+    QSqlQuery insert(cachedQuery("INSERT INTO document_fields (doc_id, field_name, value, sort_key) "
+        "VALUES (:docId, :fieldName, :value, :sortKey)"));
+    insert.bindValue(":docId", docIdData);
+    insert.bindValue(":fieldName", fieldData);
+    insert.bindValue(":value", valueData);
+    insert.bindValue(":sortKey", sortKeyData);
+    if (!insert.execBatch())
+        return setError(QString("Failed to insert document field %1: %2\n%3").arg(docId).arg(insert.lastError().text()).arg(insert.lastQuery()));
+    return true;
 }
 
 /*!
-    \qmlproperty string Database::path
-    A relative \a path can be given to store the database in an app-specific
-    writable folder. This is recommended as it ensures to work with confinement.
-    If more control is needed absolute paths or local file URIs can be used.
-    By default or if the path is empty everything is stored in memory.
- */
-/*!
-    A relative \a path can be given to store the database in an app-specific
-    writable folder. This is recommended as it ensures to work with confinement.
-    If more control is needed absolute paths or local file URIs can be used.
-    By default or if the path is empty everything is stored in memory.
+    Returns the docIds, in order, of all documents with a value for the
+    indexed \a field that matches all of the given \a patterns. A pattern is
+    either an exact value or a prefix followed by '*', '*' alone matches any
+    value. The lookup uses the expression index of the field and
+    document_fields so no document has to be parsed.
+
+    Up to \a limit docIds after \a lastDocId are returned, a negative
+    \a limit returns all of them, so that they can be read page by page.
  */
-void
-Database::setPath(const QString& path)
+QStringList
+Database::getIndexedDocIds(const QString& field, const QStringList& patterns, const QString& lastDocId, int limit)
 {
-    if (m_path == path)
-        return;
+    QStringList list;
+    if (!initializeIfNeeded())
+        return list;
 
-    beginResetModel();
-    m_db.close();
-    initializeIfNeeded(sanitizePath(path));
-    endResetModel();
+    QMap<QString, QVariant> bindings;
+    QString sql(QString("SELECT doc_id FROM document_fields WHERE field_name = :fieldName%1%2").arg(
+        patternConditions("value", patterns, QString(), bindings), pageConditions(lastDocId, QString(), bindings)));
+    // String values are found through the expression index of the field
+    if (getFieldIndexes().contains(field))
+    {
+        QString expression(fieldExpression(field));
+        sql = QString("SELECT doc_id FROM document WHERE content IS NOT NULL AND %1 IS NOT NULL%2%3 UNION %4").arg(
+            expression, patternConditions(expression, patterns, "json_", bindings),
+            pageConditions(lastDocId, "json_", bindings), sql);
+    }
 
-    m_path = path;
-    Q_EMIT pathChanged(m_path);
-}
+    QSqlQuery query(cachedQuery(sql + " ORDER BY doc_id LIMIT :limit"));
+    query.bindValue(":fieldName", field);
+    query.bindValue(":limit", limit < 0 ? -1 : limit);
+    QMapIterator<QString, QVariant> i(bindings);
+    while (i.hasNext())
+    {
+        i.next();
+        query.bindValue(i.key(), i.value());
+    }
+    if (!query.exec())
+        return setError(QString("Failed to lookup index field %1: %2\n%3").arg(field).arg(query.lastError().text()).arg(query.lastQuery())) ? list : list;
 
-/*!
- * Returns the path of the database.
- */
-QString
-Database::getPath()
-{
-    return m_path;
+    while (query.next())
+        list.append(query.value("doc_id").toString());
+
+    // Numbers are found through the numeric index of the field and have to
+    // match the patterns as the same string as in document_fields
+    if (!getFieldIndexes(true).contains(field))
+        return list;
+
+    QString expression(fieldExpression(field, true));
+    QString where;
+    bindings.clear();
+    for (int j = 0; j < patterns.count(); ++j)
+    {
+        QString pattern(patterns.at(j));
+        if (pattern.contains("*"))
+            continue;
+        double number = pattern.toDouble();
+        // No number is written as this string
+        if (numberText(number) != pattern)
+            return list;
+        where += QString(" AND %1 = :number%2").arg(expression).arg(j);
+        bindings.insert(QString(":number%1").arg(j), number);
+    }
+    where += pageConditions(lastDocId, "number_", bindings);
+
+    QSqlQuery numbers(cachedQuery(QString("SELECT doc_id, %1 AS value FROM document "
+        "WHERE content IS NOT NULL AND %1 IS NOT NULL%2 ORDER BY doc_id").arg(expression, where)));
+    QMapIterator<QString, QVariant> k(bindings);
+    while (k.hasNext())
+    {
+        k.next();
+        numbers.bindValue(k.key(), k.value());
+    }
+    if (!numbers.exec())
+        return setError(QString("Failed to lookup index field %1: %2\n%3").arg(field).arg(numbers.lastError().text()).arg(numbers.lastQuery())) ? list : list;
+
+    int count = list.count();
+    while (numbers.next() && (limit < 0 || list.count() - count < limit))
+    {
+        QString value(numberText(numbers.value("value")));
+        bool matches = true;
+        Q_FOREACH (QString pattern, patterns)
+        {
+            int wildcard = pattern.indexOf("*");
+            if (wildcard != -1 && !value.startsWith(pattern.left(wildcard)))
+                matches = false;
+        }
+        if (matches)
+            list.append(numbers.value("doc_id").toString());
+    }
+    if (list.count() > count)
+    {
+        list.sort();
+        list.removeDuplicates();
+        if (limit >= 0)
+            list = list.mid(0, limit);
+    }
+    return list;
 }
 
 /*!
-   Stores a new index under the given \a indexName, with \a expressions.
-   An existing index won't be replaced implicitly, an error will be set in that case.
+    Returns the docIds, in order, of documents with a value for the indexed
+    \a field between \a lower and \a upper. Both bounds are inclusive, an
+    invalid bound leaves the range open.
+
+    Numeric bounds are looked up through the numeric index of the field,
+    dates as ISO 8601 strings and anything else as strings through the
+    string index, so that only documents within the range are visited.
+    Dates may be stored with any time zone and numbers of binary documents
+    are compared as typed sort keys from document_fields, so the list can
+    include a few documents whose value is outside of the range. Query
+    compares the actual values to filter those out.
+
+    Up to \a limit docIds after \a lastDocId are returned, a negative
+    \a limit returns all of them.
  */
-QString
-Database::putIndex(const QString& indexName, QStringList expressions)
+QStringList
+Database::getIndexedDocIdsInRange(const QString& field, const QVariant& lower, const QVariant& upper,
+    const QString& lastDocId, int limit)
 {
-    if (indexName.isEmpty() || expressions.isEmpty())
-        return QString("Either name or expressions is empty");
+    QStringList list;
+    if (!initializeIfNeeded())
+        return list;
 
-    Q_FOREACH (QString expression, expressions)
-        if (expression.isEmpty() || expression.isNull())
-            return QString("Empty expression in list");
+    bool numeric = isNumber(lower) || isNumber(upper);
+    bool exclusiveUpper = false;
+    QString column("value");
+    QVariant from(lower);
+    QVariant to(upper);
+    if (numeric)
+    {
+        // Numbers sort before any text or other value
+        column = "sort_key";
+        if (lower.isValid())
+            from = lower.toDouble();
+        if (upper.isValid())
+            to = upper.toDouble();
+        else
+        {
+            to = QString("");
+            exclusiveUpper = true;
+        }
+    }
+    else if (lower.userType() == QMetaType::QDateTime || upper.userType() == QMetaType::QDateTime)
+    {
+        // Stored in another time zone the date is at most a day off
+        if (lower.isValid())
+            from = lower.toDateTime().toUTC().date().addDays(-1).toString(Qt::ISODate);
+        if (upper.isValid())
+            to = upper.toDateTime().toUTC().date().addDays(2).toString(Qt::ISODate);
+        exclusiveUpper = true;
+    }
+    else
+    {
+        if (lower.isValid())
+            from = lower.toString();
+        if (upper.isValid())
+            to = upper.toString();
+    }
 
-    if (!initializeIfNeeded())
-        return QString("Database isn't ready");
+    QMap<QString, QVariant> bindings;
+    QString sql(QString("SELECT doc_id FROM document_fields WHERE field_name = :fieldName%1%2").arg(
+        rangeConditions(column, from, to, exclusiveUpper, QString(), bindings), pageConditions(lastDocId, QString(), bindings)));
+    if (getFieldIndexes(numeric).contains(field))
+    {
+        QString expression(fieldExpression(field, numeric));
+        sql = QString("SELECT doc_id FROM document WHERE content IS NOT NULL AND %1 IS NOT NULL%2%3 UNION %4").arg(
+            expression, rangeConditions(expression, from, to, exclusiveUpper, "json_", bindings),
+            pageConditions(lastDocId, "json_", bindings), sql);
+    }
 
-    ScopedTransaction t(m_db);
+    QSqlQuery query(cachedQuery(sql + " ORDER BY doc_id LIMIT :limit"));
+    query.bindValue(":fieldName", field);
+    query.bindValue(":limit", limit < 0 ? -1 : limit);
+    QMapIterator<QString, QVariant> i(bindings);
+    while (i.hasNext())
+    {
+        i.next();
+        query.bindValue(i.key(), i.value());
+    }
+    if (!query.exec())
+        return setError(QString("Failed to lookup range of index field %1: %2\n%3").arg(field).arg(query.lastError().text()).arg(query.lastQuery())) ? list : list;
 
-    QStringList results = getIndexExpressions(indexName);
-    bool changed = false;
-    Q_FOREACH (QString expression, expressions)
-        if (results.contains(expression))
-            changed = true;
-    if (changed)
-        return QString("Index conflicts with existing index");
+    while (query.next())
+        list.append(query.value("doc_id").toString());
+    return list;
+}
 
-    QSqlQuery query(m_db.exec());
-    query.prepare("INSERT INTO index_definitions VALUES (:indexName, :offset, :field)");
+/*!
+    Returns docIds of documents with a value for the indexed \a field,
+    ordered by that value and then by docId, once for every distinct value
+    of a document. Numbers come before strings and other values such as
+    booleans after them, like Query orders them, \a descending reverses the
+    order of the values. Up to \a limit docIds are returned, a negative
+    \a limit returns all of them.
+
+    The value of each docId is appended to \a keys unless it's 0. Passing
+    the last docId and value that were returned as \a lastDocId and
+    \a lastKey returns the next page, without visiting the rows before it.
+
+    The values are read in order from the expression indexes of the field
+    and from document_fields, where they're kept as REAL, TEXT or BLOB so
+    that SQLite compares them in that order. Each of them is read up to
+    \a limit rows only before they're merged.
+ */
+QStringList
+Database::getOrderedDocIds(const QString& field, bool descending, int limit,
+    const QString& lastDocId, const QVariant& lastKey, QVariantList* keys)
+{
+    QStringList list;
+    if (!initializeIfNeeded())
+        return list;
 
-    QVariantList indexNameData;
-    QVariantList offsetData;
-    QVariantList fieldData;
-    for (int i = 0; i < expressions.count(); ++i)
+    QString order(QString(" ORDER BY sort_key %1, doc_id LIMIT :%2limit").arg(descending ? "DESC" : "ASC"));
+    QMap<QString, QVariant> bindings;
+    QStringList parts;
+    if (getFieldIndexes(true).contains(field))
     {
-        indexNameData << indexName;
-        offsetData << i;
-        fieldData << expressions.at(i);
+        QString expression(fieldExpression(field, true));
+        parts << QString("SELECT * FROM (SELECT doc_id, %1 AS sort_key FROM document "
+            "WHERE content IS NOT NULL AND %1 IS NOT NULL%2%3)").arg(expression,
+            keysetConditions(expression, descending, lastDocId, lastKey, "number_", bindings), order.arg("number_"));
+        bindings.insert(":number_limit", limit < 0 ? -1 : limit);
     }
-    query.addBindValue(indexNameData);
-    query.addBindValue(offsetData);
-    query.addBindValue(fieldData);
-
-    if (!query.execBatch())
-        return QString("Failed to insert index definition: %1\n%2").arg(m_db.lastError().text()).arg(query.lastQuery());
+    if (getFieldIndexes().contains(field))
+    {
+        QString expression(fieldExpression(field));
+        parts << QString("SELECT * FROM (SELECT doc_id, %1 AS sort_key FROM document "
+            "WHERE content IS NOT NULL AND %1 IS NOT NULL%2%3)").arg(expression,
+            keysetConditions(expression, descending, lastDocId, lastKey, "json_", bindings), order.arg("json_"));
+        bindings.insert(":json_limit", limit < 0 ? -1 : limit);
+    }
+    parts << QString("SELECT * FROM (SELECT DISTINCT doc_id, sort_key FROM document_fields "
+        "WHERE field_name = :fieldName AND sort_key IS NOT NULL%1%2)").arg(
+        keysetConditions("sort_key", descending, lastDocId, lastKey, "fields_", bindings), order.arg("fields_"));
+    bindings.insert(":fields_limit", limit < 0 ? -1 : limit);
+
+    QSqlQuery query(cachedQuery(parts.join(" UNION ") + order.arg(QString())));
+    query.bindValue(":fieldName", field);
+    query.bindValue(":limit", limit < 0 ? -1 : limit);
+    QMapIterator<QString, QVariant> i(bindings);
+    while (i.hasNext())
+    {
+        i.next();
+        query.bindValue(i.key(), i.value());
+    }
+    if (!query.exec())
+        return setError(QString("Failed to order by index field %1: %2\n%3").arg(field).arg(query.lastError().text()).arg(query.lastQuery())) ? list : list;
 
-    return QString();
+    while (query.next())
+    {
+        list.append(query.value("doc_id").toString());
+        if (!keys)
+            continue;
+        // Empty text and blobs are read as null, which would be bound as NULL
+        QVariant key(query.value("sort_key"));
+        if (key.userType() == QMetaType::QString && key.isNull())
+            key = QString("");
+        else if (key.userType() == QMetaType::QByteArray && key.isNull())
+            key = QByteArray("");
+        keys->append(key);
+    }
+    return list;
 }
 
 /*!
@@ -904,11 +3926,10 @@ Database::getIndexExpressions(const QString& indexName)
     if (!initializeIfNeeded())
         return expressions;
 
-    QSqlQuery query(m_db.exec());
-    query.prepare("SELECT field FROM index_definitions WHERE name = :indexName ORDER BY offset DESC");
+    QSqlQuery query(cachedQuery("SELECT field FROM index_definitions WHERE name = :indexName ORDER BY offset DESC"));
     query.bindValue(":indexName", indexName);
     if (!query.exec())
-        return setError(QString("Failed to lookup index definition: %1\n%2").arg(m_db.lastError().text()).arg(query.lastQuery())) ? expressions : expressions;
+        return setError(QString("Failed to lookup index definition: %1\n%2").arg(query.lastError().text()).arg(query.lastQuery())) ? expressions : expressions;
 
     while (query.next())
          expressions.append(query.value("field").toString());
@@ -927,40 +3948,40 @@ Database::getIndexKeys(const QString& indexName)
         return list;
 
     QStringList expressions = getIndexExpressions(indexName);
-    QString valueFields, tables, noValueWhere;
-    int i = 0;
-    Q_FOREACH (QString expression, expressions)
-    {
-        valueFields += QString("d%1.value,").arg(i);
-        tables += QString("document_fields d%1,").arg(i);
-        noValueWhere += QString("d.doc_id = d%1.doc_id AND d%1.field_name = \"%2\" AND ").arg(
-            i).arg(expression);
-    }
-    if (valueFields.endsWith(","))
-        valueFields.chop(1);
-    if (tables.endsWith(","))
-        tables.chop(1);
-    if (noValueWhere.endsWith("AND "))
-        noValueWhere.chop(4);
+    if (expressions.isEmpty())
+        return list;
 
-    QString where;
-    i = 0;
-    Q_FOREACH (QString expression, expressions)
+    QStringList fieldIndexes(getFieldIndexes());
+    QStringList numberIndexes(getFieldIndexes(true));
+    QString valueFields, tables;
+    for (int i = 0; i < expressions.count(); ++i)
     {
-        where += QString("%1 AND d%2.value NOT NULL AND ").arg(noValueWhere).arg(i);
-        i++;
+        QString values(QString("SELECT doc_id, value FROM document_fields WHERE field_name = :field%1").arg(i));
+        if (fieldIndexes.contains(expressions.at(i)))
+            values = QString("SELECT doc_id, %1 AS value FROM document WHERE content IS NOT NULL AND %1 IS NOT NULL UNION ALL %2").arg(
+                fieldExpression(expressions.at(i)), values);
+        if (numberIndexes.contains(expressions.at(i)))
+            values = QString("SELECT doc_id, %1 AS value FROM document WHERE content IS NOT NULL AND %1 IS NOT NULL UNION ALL %2").arg(
+                fieldExpression(expressions.at(i), true), values);
+        valueFields += QString("%1d%2.value").arg(i ? ", " : "").arg(i);
+        if (i == 0)
+            tables = QString("(%1) d0").arg(values);
+        else
+            tables += QString(" JOIN (%1) d%2 ON d%2.doc_id = d0.doc_id").arg(values).arg(i);
     }
-    if (where.endsWith("AND "))
-        where.chop(4);
 
     QSqlQuery query(m_db.exec());
-    query.prepare(QString("SELECT %1 FROM document d, %2 WHERE %3 GROUP BY %1").arg(
-        valueFields, tables, where));
+    query.prepare(QString("SELECT %1 FROM %2 GROUP BY %1").arg(valueFields, tables));
+    for (int i = 0; i < expressions.count(); ++i)
+        query.bindValue(QString(":field%1").arg(i), expressions.at(i));
     if (!query.exec())
         return setError(QString("Failed to get index keys: %1\n%2").arg(m_db.lastError().text()).arg(query.lastQuery())) ? list : list;
 
     while (query.next())
-        list.append(query.value("value").toString());
+    {
+        QVariant key(query.value(0));
+        list.append(isNumber(key) ? numberText(key) : key.toString());
+    }
     return list;
 }
 
@@ -21,42 +21,130 @@
 #define U1DB_DATABASE_H
 
 #include "global.h"
+#include "asyncresult.h"
+#include "lazydocument.h"
 
 #include <QtCore/QObject>
 #include <QSqlDatabase>
+#include <QSqlQuery>
 #include <QVariant>
 #include <QAbstractListModel>
+#include <QCache>
+#include <QMutex>
+#include <functional>
+
+QT_BEGIN_NAMESPACE
+class QThread;
+class QTimer;
+QT_END_NAMESPACE
 
 QT_BEGIN_NAMESPACE_U1DB
 
+class DatabaseWorker;
+
 class Q_DECL_EXPORT Database : public QAbstractListModel {
     Q_OBJECT
+    Q_ENUMS(StorageFormat)
     /*! path */
     Q_PROPERTY(QString path READ getPath WRITE setPath NOTIFY pathChanged)
     /*! error */
     Q_PROPERTY(QString error READ lastError NOTIFY errorChanged)
+    /*! journalMode */
+    Q_PROPERTY(QString journalMode READ getJournalMode WRITE setJournalMode NOTIFY journalModeChanged)
+    /*! synchronous */
+    Q_PROPERTY(QString synchronous READ getSynchronous WRITE setSynchronous NOTIFY synchronousChanged)
+    /*! cacheSize */
+    Q_PROPERTY(int cacheSize READ getCacheSize WRITE setCacheSize NOTIFY cacheSizeChanged)
+    /*! mmapSize */
+    Q_PROPERTY(qint64 mmapSize READ getMmapSize WRITE setMmapSize NOTIFY mmapSizeChanged)
+    /*! pageSize */
+    Q_PROPERTY(int pageSize READ getPageSize WRITE setPageSize NOTIFY pageSizeChanged)
+    /*! documentCacheSize */
+    Q_PROPERTY(int documentCacheSize READ getDocumentCacheSize WRITE setDocumentCacheSize NOTIFY documentCacheSizeChanged)
+    /*! storageFormat */
+    Q_PROPERTY(StorageFormat storageFormat READ getStorageFormat WRITE setStorageFormat NOTIFY storageFormatChanged)
+    /*! compactionThreshold */
+    Q_PROPERTY(int compactionThreshold READ getCompactionThreshold WRITE setCompactionThreshold NOTIFY compactionThresholdChanged)
+    /*! snapshotPath */
+    Q_PROPERTY(QString snapshotPath READ getSnapshotPath WRITE setSnapshotPath NOTIFY snapshotPathChanged)
+    /*! snapshotInterval */
+    Q_PROPERTY(int snapshotInterval READ getSnapshotInterval WRITE setSnapshotInterval NOTIFY snapshotIntervalChanged)
 public:
     Database(QObject* parent = 0);
+    ~Database();
+
+    typedef std::function<bool (const QString& docId, const QString& revision, const QByteArray& content)> DocumentCallback;
+
+    enum StorageFormat {
+        IndentedJson,
+        CompactJson,
+        Binary
+    };
 
 
     // QAbstractListModel
     QVariant data(const QModelIndex & index, int role = Qt::DisplayRole) const;
     QHash<int, QByteArray>roleNames() const;
     int rowCount(const QModelIndex & parent = QModelIndex()) const;
+    bool canFetchMore(const QModelIndex & parent) const;
+    void fetchMore(const QModelIndex & parent);
     void resetModel();
 
     QString getPath();
     void setPath(const QString& path);
+    QString getJournalMode();
+    void setJournalMode(const QString& journalMode);
+    QString getSynchronous();
+    void setSynchronous(const QString& synchronous);
+    int getCacheSize();
+    void setCacheSize(int cacheSize);
+    qint64 getMmapSize();
+    void setMmapSize(qint64 mmapSize);
+    int getPageSize();
+    void setPageSize(int pageSize);
+    int getDocumentCacheSize();
+    void setDocumentCacheSize(int documentCacheSize);
+    StorageFormat getStorageFormat();
+    void setStorageFormat(StorageFormat storageFormat);
+    Q_INVOKABLE int migrateStorageFormat();
+    int getCompactionThreshold();
+    void setCompactionThreshold(int compactionThreshold);
+    Q_INVOKABLE int compactTransactionLog();
+    Q_INVOKABLE int purgeTombstones(int olderThanGeneration);
+    QString getSnapshotPath();
+    void setSnapshotPath(const QString& snapshotPath);
+    int getSnapshotInterval();
+    void setSnapshotInterval(int snapshotInterval);
+    Q_INVOKABLE AsyncResult* backupTo(const QString& path, int pagesPerStep=Database::PAGE_SIZE);
     Q_INVOKABLE QVariant getDoc(const QString& docId);
+    Q_INVOKABLE QVariant getDoc(const QString& docId, const QStringList& fields);
+    Q_INVOKABLE LazyDocument* getLazyDoc(const QString& docId);
     QString getDocumentContents(const QString& docId);
     QVariant getDocUnchecked(const QString& docId) const;
     Q_INVOKABLE QString putDoc(QVariant newDoc, const QString& docID=QString());
     Q_INVOKABLE void deleteDoc(const QString& docID);
+    Q_INVOKABLE QStringList putDocs(QVariantList docs, QStringList docIds=QStringList());
+    Q_INVOKABLE void deleteDocs(const QStringList& docIds);
+    Q_INVOKABLE AsyncResult* getDocAsync(const QString& docId);
+    Q_INVOKABLE AsyncResult* putDocAsync(QVariant newDoc, const QString& docID=QString());
+    Q_INVOKABLE AsyncResult* listDocsAsync();
     Q_INVOKABLE QList<QString> listDocs();
+    Q_INVOKABLE QList<QString> listDocs(int offset, int limit);
+    QStringList listDocsAfter(const QString& lastDocId, int limit=-1);
+    bool forEachDoc(DocumentCallback callback, int batchSize=Database::PAGE_SIZE);
+    static QVariantMap parseContents(const QByteArray& content);
     Q_INVOKABLE QString lastError();
     Q_INVOKABLE QString putIndex(const QString& index_name, QStringList expressions);
+    Q_INVOKABLE QString deleteIndex(const QString& indexName);
     Q_INVOKABLE QStringList getIndexExpressions(const QString& indexName);
     Q_INVOKABLE QStringList getIndexKeys(const QString& indexName);
+    QStringList getIndexedDocIds(const QString& field, const QStringList& patterns=QStringList(),
+        const QString& lastDocId=QString(), int limit=-1);
+    QStringList getIndexedDocIdsInRange(const QString& field, const QVariant& lower, const QVariant& upper,
+        const QString& lastDocId=QString(), int limit=-1);
+    QStringList getOrderedDocIds(const QString& field, bool descending=false, int limit=-1,
+        const QString& lastDocId=QString(), const QVariant& lastKey=QVariant(), QVariantList* keys=0);
+    Q_INVOKABLE QVariantMap getStatistics();
 
     /* Functions handy for Synchronization */
     QString getNextDocRevisionNumber(QString doc_id);
@@ -77,30 +165,152 @@ Q_SIGNALS:
         An error occurred. Use lastError() to check it.
      */
     void errorChanged(const QString& error);
+    /*!
+        The journal mode changed.
+     */
+    void journalModeChanged(const QString& journalMode);
+    /*!
+        The synchronous mode changed.
+     */
+    void synchronousChanged(const QString& synchronous);
+    /*!
+        The page cache size changed.
+     */
+    void cacheSizeChanged(int cacheSize);
+    /*!
+        The memory-mapped I/O size changed.
+     */
+    void mmapSizeChanged(qint64 mmapSize);
+    /*!
+        The page size changed.
+     */
+    void pageSizeChanged(int pageSize);
+    /*!
+        The size of the document cache changed.
+     */
+    void documentCacheSizeChanged(int documentCacheSize);
+    /*!
+        The format used to store documents changed.
+     */
+    void storageFormatChanged(StorageFormat storageFormat);
+    /*!
+        The number of writes after which transactions are compacted changed.
+     */
+    void compactionThresholdChanged(int compactionThreshold);
+    /*!
+        The file that in-memory contents are saved to changed.
+     */
+    void snapshotPathChanged(const QString& snapshotPath);
+    /*!
+        The interval between snapshots changed.
+     */
+    void snapshotIntervalChanged(int snapshotInterval);
     /*!
         A document's contents were modified.
      */
     void docChanged(const QString& docId, QVariant content);
     /*!
-        A document was loaded via its docID.
+        Several documents were modified at once by putDocs() or deleteDocs().
+     */
+    void docsChanged(const QStringList& docIds);
+    /*!
+        A document was loaded via its docID. It is only emitted in the thread
+        owning the Database, reads from other threads don't notify.
      */
     void docLoaded(const QString& docId, QVariant content) const;
 private:
     //Q_DISABLE_COPY(Database)
+    friend class DatabaseWorker;
+    friend class Synchronizer;
+    friend class Query;
     static const QString MEMORY_PATH;
+    static const int PAGE_SIZE;
+    static const int DOCUMENT_CACHE_SIZE;
+    static const int MODEL_WINDOW;
+    static const int SCHEMA_VERSION;
+
+    struct CachedDocument
+    {
+        QString revision;
+        QVariant contents;
+    };
+
+    struct ModelRow
+    {
+        QString docId;
+        QByteArray content;
+        QVariant contents;
+        bool loaded;
+    };
 
     QString m_path;
     QSqlDatabase m_db;
+    QString m_readPath;
     QString m_error;
+    QString m_replicaUid;
+    QString m_journalMode;
+    QString m_synchronous;
+    int m_cacheSize;
+    qint64 m_mmapSize;
+    int m_pageSize;
+    StorageFormat m_storageFormat;
+    int m_compactionThreshold;
+    int m_writesSinceCompaction;
+    int m_transactionsReclaimed;
+    qint64 m_initializeTime;
+    mutable QCache<QString, QSqlQuery> m_statements;
+    mutable int m_statementCacheHits;
+    mutable int m_statementCacheMisses;
+    mutable QCache<QString, CachedDocument> m_documentCache;
+    mutable int m_documentCacheHits;
+    mutable int m_documentCacheMisses;
+    mutable QList<ModelRow> m_modelRows;
+    mutable int m_firstLoadedRow;
+    mutable int m_lastLoadedRow;
+    bool m_modelComplete;
+    QThread* m_workerThread;
+    DatabaseWorker* m_worker;
+    QString m_snapshotPath;
+    int m_snapshotInterval;
+    int m_writesSinceSnapshot;
+    QTimer* m_snapshotTimer;
+    mutable QMutex m_mutex;
 
     QString getReplicaUid();
+    static QString readReplicaUid(const QString& path, QString& error);
     QString sanitizePath(const QString& path);
     bool isInitialized();
+    bool applyPragmas();
     bool initializeIfNeeded(const QString& path=Database::MEMORY_PATH);
+    bool upgradeSchema();
     bool setError(const QString& error);
+    QSqlQuery cachedQuery(const QString& sql) const;
+    QVariant getCachedContents(const QString& docId, const QString& revision) const;
+    QString findMissingDoc(const QStringList& docIds);
     QString getDocIdByRow(int row) const;
+    void updateModelRow(const QString& docId);
+    void moveModelWindow(int first, int last) const;
+    QStringList getIndexedFields();
+    QStringList getFieldIndexes(bool numeric=false);
+    bool updateFieldIndexes();
+    bool reindexDocuments();
+    bool updateDocumentFields(const QString& docId, const QVariant& contents, bool textContent);
+    QVariant serializeContents(const QVariant& contents) const;
 
+    QString writeDoc(const QVariant& contents, QString& docId);
+    AsyncResult* queueRequest(AsyncResult* result);
+    QVariant runRequest(int operation, const QVariant& contents, QString& docId, QString& error);
+    void onAsyncCompleted(AsyncResult* result);
+    void onPeerDocChanged(const QString& docId, const QVariant& contents);
+    void onPeerDocsChanged(const QStringList& docIds);
     int createNewTransaction(QString doc_id);
+    void compactIfNeeded();
+    void abortBackups();
+    bool exportTo(const QString& path, QString& error);
+    bool importFrom(const QString& path, QString& error);
+    bool restoreSnapshot();
+    void snapshotIfNeeded();
+    void updateSnapshotTimer();
     QString generateNewTransactionId();
     int getCurrentGenerationNumber();
 
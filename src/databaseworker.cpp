@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2013 Canonical, Ltd.
+ *
+ * Authors:
+ *  Christian Dywan <christian.dywan@canonical.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "databaseworker.h"
+#include "database.h"
+#include "asyncresult.h"
+#include "private.h"
+
+QT_BEGIN_NAMESPACE_U1DB
+
+DatabaseWorker::DatabaseWorker(QObject *parent) :
+    QObject(parent), m_database(0)
+{
+}
+
+/*
+    Runs the AsyncResult \a request against the worker's own connection,
+    which is created on first use so that it belongs to the worker thread.
+ */
+void
+DatabaseWorker::process(QObject* request)
+{
+    AsyncResult* result = static_cast<AsyncResult*>(request);
+    if (!m_database)
+        m_database = new Database(this);
+
+    // Follow the settings of the owner as they were when the request was made,
+    // so that writes behave the same, tuning comes first to be applied when
+    // the connection is opened
+    if (!result->m_journalMode.isEmpty())
+        m_database->setJournalMode(result->m_journalMode);
+    if (!result->m_synchronous.isEmpty())
+        m_database->setSynchronous(result->m_synchronous);
+    m_database->setCacheSize(result->m_cacheSize);
+    m_database->setMmapSize(result->m_mmapSize);
+    m_database->setPageSize(result->m_pageSize);
+    m_database->setDocumentCacheSize(result->m_documentCacheSize);
+    m_database->setCompactionThreshold(result->m_compactionThreshold);
+    m_database->setStorageFormat(static_cast<Database::StorageFormat>(result->m_storageFormat));
+    m_database->setPath(result->m_path);
+
+    QString docId(result->m_docId);
+    QString error;
+    QVariant value(m_database->runRequest(result->m_operation, result->m_contents, docId, error));
+    result->complete(value, docId, error);
+}
+
+QT_END_NAMESPACE_U1DB
+
+#include "moc_databaseworker.cpp"
@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2013 Canonical, Ltd.
+ *
+ * Authors:
+ *  Christian Dywan <christian.dywan@canonical.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef U1DB_DATABASEWORKER_H
+#define U1DB_DATABASEWORKER_H
+
+#include <QtCore/QObject>
+
+#include "global.h"
+
+QT_BEGIN_NAMESPACE_U1DB
+
+class Database;
+
+/*
+    Carries out asynchronous operations of a Database on its own thread, with
+    a separate connection to the same database file.
+ */
+class DatabaseWorker : public QObject {
+    Q_OBJECT
+public:
+    DatabaseWorker(QObject* parent = 0);
+
+public Q_SLOTS:
+    void process(QObject* request);
+
+private:
+    Q_DISABLE_COPY(DatabaseWorker)
+    Database* m_database;
+};
+
+QT_END_NAMESPACE_U1DB
+
+#endif // U1DB_DATABASEWORKER_H
@@ -4,18 +4,25 @@ CREATE TABLE transaction_log (
     doc_id TEXT NOT NULL,
     transaction_id TEXT NOT NULL
 );
+CREATE INDEX transaction_log_doc_id_generation_idx
+    ON transaction_log(doc_id, generation);
 CREATE TABLE document (
     doc_id TEXT PRIMARY KEY,
     doc_rev TEXT NOT NULL,
-    content TEXT
+    content TEXT,
+    conflicted INTEGER NOT NULL DEFAULT 0
 );
+CREATE INDEX document_live_idx ON document(doc_id) WHERE content IS NOT NULL;
 CREATE TABLE document_fields (
     doc_id TEXT NOT NULL,
     field_name TEXT NOT NULL,
-    value TEXT
+    value TEXT,
+    sort_key
 );
 CREATE INDEX document_fields_field_value_doc_idx
     ON document_fields(field_name, value, doc_id);
+CREATE INDEX document_fields_field_sort_key_doc_idx
+    ON document_fields(field_name, sort_key, doc_id);
 
 CREATE TABLE sync_log (
     replica_uid TEXT PRIMARY KEY,
@@ -28,6 +35,8 @@ CREATE TABLE conflicts (
     content TEXT,
     CONSTRAINT conflicts_pkey PRIMARY KEY (doc_id, doc_rev)
 );
+CREATE TRIGGER conflicts_insert AFTER INSERT ON conflicts BEGIN UPDATE document SET conflicted = 1 WHERE doc_id = NEW.doc_id; END;
+CREATE TRIGGER conflicts_delete AFTER DELETE ON conflicts BEGIN UPDATE document SET conflicted = EXISTS (SELECT 1 FROM conflicts WHERE doc_id = OLD.doc_id) WHERE doc_id = OLD.doc_id; END;
 CREATE TABLE index_definitions (
     name TEXT,
     offset INT,
@@ -39,4 +48,4 @@ CREATE TABLE u1db_config (
     name TEXT PRIMARY KEY,
     value TEXT
 );
-INSERT INTO u1db_config VALUES ('sql_schema', '0');
+INSERT INTO u1db_config VALUES ('sql_schema', '5');
@@ -83,6 +83,13 @@ Document::onDocChanged(const QString& docId, QVariant content)
     }
 }
 
+void
+Document::onDocsChanged(const QStringList& docIds)
+{
+    if (docIds.contains(m_docId))
+        onDocChanged(m_docId, QVariant());
+}
+
 void
 Document::onPathChanged(const QString& path)
 {
@@ -132,6 +139,7 @@ Document::setDatabase(Database* database)
         }
         QObject::connect(m_database, &Database::pathChanged, this, &Document::onPathChanged);
         QObject::connect(m_database, &Database::docChanged, this, &Document::onDocChanged);
+        QObject::connect(m_database, &Database::docsChanged, this, &Document::onDocsChanged);
     }
     Q_EMIT databaseChanged(database);
 }
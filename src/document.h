@@ -86,6 +86,7 @@ private:
     QVariant m_contents;
 
     void onDocChanged(const QString& docID, QVariant content);
+    void onDocsChanged(const QStringList& docIds);
     void onPathChanged(const QString& path);
 };
 
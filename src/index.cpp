@@ -82,6 +82,13 @@ Index::onPathChanged(const QString& path)
 
 void
 Index::onDocChanged(const QString& docId, QVariant content)
+{
+    // Only the results of this document need to be updated
+    Q_EMIT docChanged(docId);
+}
+
+void
+Index::onDocsChanged(const QStringList& docIds)
 {
     Q_EMIT dataInvalidated();
 }
@@ -90,12 +97,12 @@ Index::onDocChanged(const QString& docId, QVariant content)
     \qmlproperty Database Index::database
     Sets the Database to lookup documents from and store the index in. The
     dataInvalidated() signal will be emitted on all changes that could affect
-    the index.
+    the index, or docChanged() if a single document was modified.
  */
 /*!
     Sets the \a database to lookup documents from and store the index in. The
     dataInvalidated() signal will be emitted on all changes that could affect
-    the index.
+    the index, or docChanged() if a single document was modified.
  */
 void
 Index::setDatabase(Database* database)
@@ -114,6 +121,7 @@ Index::setDatabase(Database* database)
         m_database->putIndex(m_name, m_expression);
         QObject::connect(m_database, &Database::pathChanged, this, &Index::onPathChanged);
         QObject::connect(m_database, &Database::docChanged, this, &Index::onDocChanged);
+        QObject::connect(m_database, &Database::docsChanged, this, &Index::onDocsChanged);
         Q_EMIT dataInvalidated();
     }
 
@@ -195,10 +203,10 @@ Index::setExpression(QStringList expression)
 
 /*!
    \internal
- * Iterates through the documents stored in the database and creates the list of results based on the Index expressions.
+ * Iterates through the given documents and creates the list of results based on the Index expressions.
  */
 
-void Index::generateIndexResults()
+void Index::generateIndexResults(const QStringList& documents)
 {
     m_results.clear();
 
@@ -206,8 +214,6 @@ void Index::generateIndexResults()
 
     if(db){
 
-        QList<QString> documents = db->listDocs();
-
         Q_FOREACH (QString docId, documents){
 
             QVariant document = db->getDocUnchecked(docId);
@@ -222,11 +228,75 @@ void Index::generateIndexResults()
 
 }
 
+/*!
+   \internal
+ * Looks up the documents which have a value for any of the expressions in
+ * the database, so that only those need to be parsed. The \a patterns map an
+ * expression to the values it has to match, see Database::getIndexedDocIds().
+ * Expressions without patterns can be limited to the lower and upper bound
+ * in \a ranges, see Database::getIndexedDocIdsInRange().
+ * Up to \a limit documents after \a lastDocId are returned in order of their
+ * docId, a negative \a limit returns all of them.
+ */
+QStringList Index::lookupDocuments(const QMap<QString, QStringList>& patterns,
+    const QMap<QString, QPair<QVariant, QVariant> >& ranges, const QString& lastDocId, int limit)
+{
+    QStringList documents;
+
+    Database *db(getDatabase());
+    if (!db)
+        return documents;
+
+    // Without a name the expressions aren't stored as an index in the database
+    if (m_name.isEmpty())
+        return db->listDocsAfter(lastDocId, limit);
+
+    // The first documents of every expression are enough to find the first
+    // documents of all of them
+    Q_FOREACH (QString expression, m_expression)
+    {
+        if (!patterns.contains(expression) && ranges.contains(expression))
+        {
+            QPair<QVariant, QVariant> range(ranges.value(expression));
+            documents.append(db->getIndexedDocIdsInRange(expression, range.first, range.second, lastDocId, limit));
+        }
+        else
+            documents.append(db->getIndexedDocIds(expression, patterns.value(expression), lastDocId, limit));
+    }
+    documents.sort();
+    documents.removeDuplicates();
+    if (limit >= 0)
+        documents = documents.mid(0, limit);
+    return documents;
+}
+
 /*!
    \internal
  */
 QList<QVariantMap> Index::getAllResults(){
-    generateIndexResults();
+    Database *db(getDatabase());
+
+    // Without a name every document has to be parsed, so they're streamed
+    if (db && m_name.isEmpty())
+    {
+        m_results.clear();
+        db->forEachDoc([this](const QString& docId, const QString&, const QByteArray& content) {
+            appendResultsFromMap(docId, QStringList(), Database::parseContents(content), "");
+            return true;
+        });
+        return m_results;
+    }
+
+    generateIndexResults(lookupDocuments(QMap<QString, QStringList>()));
+    return m_results;
+}
+
+/*!
+   \internal
+ * Returns the results of the given \a documents only.
+ */
+QList<QVariantMap> Index::getResults(const QStringList& documents){
+    generateIndexResults(documents);
     return m_results;
 }
 
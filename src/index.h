@@ -22,6 +22,7 @@
 
 #include <QtCore/QObject>
 #include <QStringList>
+#include <QPair>
 
 #include "database.h"
 
@@ -49,6 +50,10 @@ public:
     QStringList getExpression();
     void setExpression(QStringList expression);
     QList<QVariantMap> getAllResults();
+    QStringList lookupDocuments(const QMap<QString, QStringList>& patterns,
+        const QMap<QString, QPair<QVariant, QVariant> >& ranges=(QMap<QString, QPair<QVariant, QVariant> >()),
+        const QString& lastDocId=QString(), int limit=-1);
+    QList<QVariantMap> getResults(const QStringList& documents);
 
 Q_SIGNALS:
     /*!
@@ -67,6 +72,10 @@ Q_SIGNALS:
         The database, an indexed document or the expressions changed.
      */
     void dataInvalidated();
+    /*!
+        A single document was modified, only its results may have changed.
+     */
+    void docChanged(const QString& docId);
 private:
     Q_DISABLE_COPY(Index)
     Database* m_database;
@@ -76,10 +85,11 @@ private:
 
     void onPathChanged(const QString& path);
     void onDocChanged(const QString& docId, QVariant content);
+    void onDocsChanged(const QStringList& docIds);
 
     QStringList appendResultsFromMap(QString docId, QStringList fieldsList, QVariantMap current_section, QString current_field);
     QStringList getFieldsFromList(QString docId, QStringList fieldsList, QVariantList current_section, QString current_field);
-    void generateIndexResults();
+    void generateIndexResults(const QStringList& documents);
 };
 
 QT_END_NAMESPACE_U1DB
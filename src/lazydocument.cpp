@@ -0,0 +1,175 @@
+/*
+ * Copyright (C) 2013 Canonical, Ltd.
+ *
+ * Authors:
+ *  Christian Dywan <christian.dywan@canonical.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QJsonDocument>
+
+#include "lazydocument.h"
+#include "database.h"
+#include "private.h"
+
+QT_BEGIN_NAMESPACE_U1DB
+
+/*!
+    \class LazyDocument
+    \inmodule U1db
+    \ingroup cpp
+
+    \brief The LazyDocument class gives access to single fields of a document.
+
+    It is returned by Database::getLazyDoc(). The stored document is only
+    parsed when a field is first accessed, and a field is only converted to
+    a QVariant when it is asked for, so a list row showing one field of a
+    large document doesn't build a QVariantMap of all of it.
+ */
+
+/*!
+    \qmltype LazyDocument
+    \instantiates LazyDocument
+    \inqmlmodule U1db 1.0
+    \ingroup modules
+
+    \brief LazyDocument gives access to single fields of a document.
+
+    It's returned by Database::getLazyDoc() and garbage collected once it
+    isn't referenced anymore.
+
+    \code
+    Text {
+        text: database.getLazyDoc(docId).value("author.name")
+    }
+    \endcode
+ */
+
+/*!
+    Instantiate a new LazyDocument for the stored \a content of \a docId,
+    with an optional \a parent.
+ */
+LazyDocument::LazyDocument(const QString& docId, const QByteArray& content, QObject *parent) :
+    QObject(parent), m_docId(docId), m_content(content)
+{
+}
+
+/*!
+    \qmlproperty string LazyDocument::docId
+    The docId of the document.
+ */
+/*!
+    Returns the docId of the document.
+ */
+QString
+LazyDocument::getDocId()
+{
+    return m_docId;
+}
+
+/*!
+    \qmlproperty list<string> LazyDocument::keys
+    The names of the top-level fields of the document.
+ */
+/*!
+    Returns the names of the top-level fields of the document.
+ */
+QStringList
+LazyDocument::keys()
+{
+    jsonValue(QString());
+    return m_object.keys();
+}
+
+/*!
+    \qmlmethod bool LazyDocument::contains(string)
+    Whether the document has the \a field, a dotted path such as "author.name".
+ */
+/*!
+    Returns whether the document has the \a field, a dotted path such as
+    "author.name".
+ */
+bool
+LazyDocument::contains(const QString& field)
+{
+    return !jsonValue(field).isUndefined();
+}
+
+/*!
+    \qmlmethod Variant LazyDocument::value(string)
+    Returns the value of the \a field, a dotted path such as "author.name",
+    or undefined if the document doesn't have it.
+ */
+/*!
+    Returns the value of the \a field, a dotted path such as "author.name",
+    or an invalid QVariant if the document doesn't have it. Values are only
+    converted once.
+ */
+QVariant
+LazyDocument::value(const QString& field)
+{
+    QHash<QString, QVariant>::const_iterator cached(m_values.constFind(field));
+    if (cached != m_values.constEnd())
+        return cached.value();
+
+    QJsonValue json(jsonValue(field));
+    QVariant value(json.isUndefined() ? QVariant() : json.toVariant());
+    m_values.insert(field, value);
+    return value;
+}
+
+/*!
+    \qmlmethod Variant LazyDocument::toMap()
+    Returns all of the contents, like Database::getDoc().
+ */
+/*!
+    Returns all of the contents, like Database::getDoc().
+ */
+QVariantMap
+LazyDocument::toMap()
+{
+    jsonValue(QString());
+    return m_object.toVariantMap();
+}
+
+/*
+    Returns the JSON value of the dotted \a field, parsing the document on
+    first use. An empty field only parses the document.
+ */
+QJsonValue
+LazyDocument::jsonValue(const QString& field)
+{
+    if (!m_content.isNull())
+    {
+        // Binary formats aren't JSON text, they're converted as a whole
+        QJsonDocument json(QJsonDocument::fromJson(m_content));
+        m_object = json.isObject() ? json.object() : QJsonObject::fromVariantMap(Database::parseContents(m_content));
+        m_content = QByteArray();
+    }
+    if (field.isEmpty())
+        return QJsonValue(m_object);
+
+    QJsonValue value(m_object);
+    Q_FOREACH (const QString& key, field.split('.'))
+    {
+        if (!value.isObject())
+            return QJsonValue(QJsonValue::Undefined);
+        value = value.toObject().value(key);
+    }
+    return value;
+}
+
+QT_END_NAMESPACE_U1DB
+
+#include "moc_lazydocument.cpp"
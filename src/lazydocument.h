@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2013 Canonical, Ltd.
+ *
+ * Authors:
+ *  Christian Dywan <christian.dywan@canonical.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef U1DB_LAZYDOCUMENT_H
+#define U1DB_LAZYDOCUMENT_H
+
+#include <QtCore/QObject>
+#include <QVariant>
+#include <QHash>
+#include <QJsonObject>
+#include <QStringList>
+
+#include "global.h"
+
+QT_BEGIN_NAMESPACE_U1DB
+
+class Q_DECL_EXPORT LazyDocument : public QObject {
+    Q_OBJECT
+    /*! docId */
+    Q_PROPERTY(QString docId READ getDocId CONSTANT)
+    /*! keys */
+    Q_PROPERTY(QStringList keys READ keys CONSTANT)
+public:
+    LazyDocument(const QString& docId, const QByteArray& content, QObject* parent = 0);
+
+    QString getDocId();
+    QStringList keys();
+    Q_INVOKABLE bool contains(const QString& field);
+    Q_INVOKABLE QVariant value(const QString& field);
+    Q_INVOKABLE QVariantMap toMap();
+private:
+    Q_DISABLE_COPY(LazyDocument)
+    QString m_docId;
+    QByteArray m_content;
+    QJsonObject m_object;
+    QHash<QString, QVariant> m_values;
+
+    QJsonValue jsonValue(const QString& field);
+};
+
+QT_END_NAMESPACE_U1DB
+
+#endif // U1DB_LAZYDOCUMENT_H
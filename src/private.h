@@ -17,3 +17,93 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#ifndef U1DB_PRIVATE_H
+#define U1DB_PRIVATE_H
+
+#include <QString>
+#include <QVariant>
+
+#include "global.h"
+
+QT_BEGIN_NAMESPACE_U1DB
+
+/*
+    True if \a value is a number, booleans don't count.
+ */
+inline bool
+isNumber(const QVariant& value)
+{
+    switch (value.userType())
+    {
+    case QMetaType::Int:
+    case QMetaType::UInt:
+    case QMetaType::LongLong:
+    case QMetaType::ULongLong:
+    case QMetaType::Double:
+    case QMetaType::Float:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/*
+    Numbers sort before strings like in SQLite, other values after them.
+ */
+inline int
+sortRank(const QVariant& value)
+{
+    if (isNumber(value))
+        return 0;
+    if (value.userType() == QMetaType::QString)
+        return 1;
+    return 2;
+}
+
+/*
+    Compares \a text to \a other by code point, which is the order SQLite
+    compares UTF-8 text and blobs in, unlike QString::compare() surrogates
+    sort after all other UTF-16 code units.
+ */
+inline int
+compareText(const QString& text, const QString& other)
+{
+    int count = qMin(text.size(), other.size());
+    for (int i = 0; i < count; i++)
+    {
+        ushort c = text.at(i).unicode();
+        ushort d = other.at(i).unicode();
+        if (c == d)
+            continue;
+        if (QChar::isSurrogate(c) != QChar::isSurrogate(d))
+            return QChar::isSurrogate(c) ? 1 : -1;
+        return c < d ? -1 : 1;
+    }
+    return text.size() - other.size();
+}
+
+/*
+    The value stored as sort_key in document_fields so that SQLite orders
+    it the way Query does: numbers as REAL, strings as TEXT and anything
+    else as a BLOB of its string, which SQLite sorts after text. Missing
+    values are NULL.
+ */
+inline QVariant
+sortKey(const QVariant& value)
+{
+    if (!value.isValid())
+        return QVariant();
+    if (isNumber(value))
+        return value.toDouble();
+    QString text(value.toString());
+    if (text.isNull())
+        text = QString("");
+    if (value.userType() == QMetaType::QString)
+        return text;
+    QByteArray bytes(text.toUtf8());
+    return bytes.isNull() ? QByteArray("") : bytes;
+}
+
+QT_END_NAMESPACE_U1DB
+
+#endif // U1DB_PRIVATE_H
@@ -18,6 +18,9 @@
  */
 
 #include <QStringList>
+#include <QDateTime>
+#include <QSet>
+#include <algorithm>
 
 #include "query.h"
 #include "database.h"
@@ -25,6 +28,131 @@
 
 QT_BEGIN_NAMESPACE_U1DB
 
+namespace
+{
+/* The number of consecutive rows starting at row with the same docId */
+int
+countRows(const QStringList& rowDocIds, int row)
+{
+    int count = 1;
+    while (row + count < rowDocIds.count() && rowDocIds.at(row + count) == rowDocIds.at(row))
+        count++;
+    return count;
+}
+
+/* The position of the first docId in a sorted list that isn't less than docId */
+int
+lowerBound(const QStringList& docIds, const QString& docId)
+{
+    int row = 0;
+    int count = docIds.count();
+    while (count > 0)
+    {
+        int step = count / 2;
+        if (docIds.at(row + step) < docId)
+        {
+            row += step + 1;
+            count -= step + 1;
+        }
+        else
+            count = step;
+    }
+    return row;
+}
+
+/* Converts a date or an ISO 8601 string, which is how JSON stores dates */
+bool
+toDateTime(const QVariant& value, QDateTime& dateTime)
+{
+    if (value.userType() == QMetaType::QDateTime)
+        dateTime = value.toDateTime();
+    else if (value.userType() == QMetaType::QDate)
+        dateTime = QDateTime(value.toDate(), QTime(0, 0));
+    else if (value.userType() == QMetaType::QString)
+        dateTime = QDateTime::fromString(value.toString(), Qt::ISODate);
+    else
+        return false;
+    return dateTime.isValid();
+}
+
+/* The operand of a range as a double, a QDateTime or a string */
+QVariant
+toOperand(const QVariant& value)
+{
+    QDateTime dateTime;
+    if (isNumber(value))
+        return value.toDouble();
+    if (value.userType() != QMetaType::QString && toDateTime(value, dateTime))
+        return dateTime;
+    return value.toString();
+}
+
+/*
+    Compares value to an operand returned by toOperand(), the order is
+    negative, zero or positive like for QString::compare(). Numbers only
+    compare to numbers, dates to dates and ISO 8601 strings and strings to
+    strings, otherwise false is returned.
+ */
+bool
+compareOperand(const QVariant& value, const QVariant& operand, int& order)
+{
+    if (operand.userType() == QMetaType::Double)
+    {
+        if (!isNumber(value))
+            return false;
+        double number = value.toDouble();
+        order = number < operand.toDouble() ? -1 : number > operand.toDouble() ? 1 : 0;
+        return true;
+    }
+    if (operand.userType() == QMetaType::QDateTime)
+    {
+        QDateTime dateTime;
+        if (!toDateTime(value, dateTime))
+            return false;
+        order = dateTime < operand.toDateTime() ? -1 : dateTime > operand.toDateTime() ? 1 : 0;
+        return true;
+    }
+    if (value.userType() != QMetaType::QString)
+        return false;
+    order = value.toString().compare(operand.toString());
+    return true;
+}
+
+/*
+    Compares sort keys read from the database or made by sortKey() the way
+    SQLite does, numbers before text before blobs, the order is negative,
+    zero or positive like for QString::compare().
+ */
+int
+compareSortKeys(const QVariant& key, const QVariant& other)
+{
+    int order = sortRank(key) - sortRank(other);
+    if (order != 0)
+        return order;
+    if (isNumber(key))
+        return key.toDouble() < other.toDouble() ? -1 : key.toDouble() > other.toDouble() ? 1 : 0;
+    if (key.userType() == QMetaType::QString)
+        return compareText(key.toString(), other.toString());
+    return compareText(QString::fromUtf8(key.toByteArray()), QString::fromUtf8(other.toByteArray()));
+}
+
+/* The docIds of rows in the order they first appear in */
+QStringList
+uniqueDocIds(const QStringList& rowDocIds)
+{
+    QStringList documents;
+    QSet<QString> listed;
+    Q_FOREACH (QString docId, rowDocIds)
+    {
+        if (listed.contains(docId))
+            continue;
+        listed.insert(docId);
+        documents.append(docId);
+    }
+    return documents;
+}
+}
+
 /*!
     \class Query
     \inmodule U1db
@@ -71,7 +199,8 @@ QT_BEGIN_NAMESPACE_U1DB
     usually by declaring it as a QML item.
  */
 Query::Query(QObject *parent) :
-    QAbstractListModel(parent), m_index(0)
+    QAbstractListModel(parent), m_index(0), m_limit(-1), m_offset(0), m_lazy(false),
+    m_skipped(0), m_complete(true)
 {
 }
 
@@ -87,7 +216,7 @@ Query::data(const QModelIndex & index, int role) const
     if (role == 0) // contents
         return m_results.at(index.row());
     if (role == 1) // docId
-        return m_documents.at(index.row());
+        return m_rowDocIds.at(index.row());
     return QVariant();
 }
 
@@ -117,6 +246,77 @@ Query::rowCount(const QModelIndex & parent) const
     return m_results.count();
 }
 
+/*!
+    \internal
+    Used to implement QAbstractListModel
+    Whether the lazy model has results left that weren't fetched yet.
+ */
+bool
+Query::canFetchMore(const QModelIndex & parent) const
+{
+    if (parent.isValid() || !m_lazy)
+        return false;
+    return !m_complete;
+}
+
+/*!
+    \internal
+    Used to implement QAbstractListModel
+    Fetches the next page of documents and appends their matching results.
+    With orderBy the page is read from the index in the database in order
+    of the first expression, otherwise from the documents the index looks
+    up after the last one fetched, so that only fetched documents are ever
+    parsed.
+ */
+void
+Query::fetchMore(const QModelIndex & parent)
+{
+    if (!canFetchMore(parent) || !m_index)
+        return;
+
+    QStringList rowDocIds;
+    QList<QVariant> rowResults;
+    // Pages without any match are skipped so that rows are always added
+    while (rowDocIds.isEmpty() && !m_complete)
+    {
+        if (fetchesInOrder())
+            fetchOrderedRows(rowDocIds, rowResults);
+        else
+        {
+            QStringList page(m_index->lookupDocuments(m_patterns, m_ranges, m_cursorDocId, Database::PAGE_SIZE));
+            if (!page.isEmpty())
+                m_cursorDocId = page.last();
+            m_complete = page.count() < Database::PAGE_SIZE;
+            matchResults(m_index->getResults(page), rowDocIds, rowResults);
+        }
+
+        int skipped = qMin(m_offset - m_skipped, rowDocIds.count());
+        if (skipped > 0)
+        {
+            rowDocIds = rowDocIds.mid(skipped);
+            rowResults = rowResults.mid(skipped);
+            m_skipped += skipped;
+        }
+        if (m_limit >= 0 && m_results.count() + rowDocIds.count() >= m_limit)
+        {
+            rowDocIds = rowDocIds.mid(0, m_limit - m_results.count());
+            rowResults = rowResults.mid(0, m_limit - m_results.count());
+            m_complete = true;
+        }
+    }
+    if (rowDocIds.isEmpty())
+        return;
+
+    beginInsertRows(QModelIndex(), m_results.count(), m_results.count() + rowDocIds.count() - 1);
+    m_rowDocIds.append(rowDocIds);
+    m_results.append(rowResults);
+    endInsertRows();
+
+    m_documents = uniqueDocIds(m_rowDocIds);
+    Q_EMIT documentsChanged(m_documents);
+    Q_EMIT resultsChanged(m_results);
+}
+
 /*!
     FIXME
  */
@@ -133,23 +333,123 @@ Query::getIndex()
 void
 Query::onDataInvalidated()
 {
-    m_documents.clear();
-    m_results.clear();
-
     if (!m_index)
+    {
+        m_documents.clear();
+        m_complete = true;
+        updateRows(QStringList(), QList<QVariant>());
         return;
+    }
     generateQueryResults();
 
 }
 
 /*!
     \internal
-    Manually triggers reloading of the query.
+    Re-evaluates the single document \a docId that was changed, instead of
+    looking up all documents again, and inserts, updates or removes only
+    its rows. A lazy model only shows rows it fetched the position of.
  */
-void Query::generateQueryResults()
+void
+Query::onDocChanged(const QString& docId)
 {
-    QList<QVariantMap> results(m_index->getAllResults());
+    if (!m_index)
+        return;
 
+    // A change can move results into or out of the window
+    bool windowed = m_offset > 0 || m_limit >= 0;
+    if (windowed && !m_lazy)
+    {
+        generateQueryResults();
+        return;
+    }
+
+    QStringList rowDocIds;
+    QList<QVariant> rowResults;
+    matchResults(m_index->getResults(QStringList() << docId), rowDocIds, rowResults);
+    if (m_lazy)
+    {
+        for (int j = rowDocIds.count() - 1; j >= 0; j--)
+        {
+            if (!isFetched(docId, rowResults.at(j)))
+            {
+                rowDocIds.removeAt(j);
+                rowResults.removeAt(j);
+            }
+        }
+    }
+
+    // Fetched rows of the window can be updated where they are, unless
+    // they move or the document enters or leaves the window
+    if (windowed)
+    {
+        QList<int> rows;
+        for (int row = 0; row < m_rowDocIds.count(); row++)
+            if (m_rowDocIds.at(row) == docId)
+                rows.append(row);
+        bool inPlace = rows.count() == rowDocIds.count();
+        for (int j = 0; inPlace && j < rows.count(); j++)
+            Q_FOREACH (const SortKey& sortKey, m_sortKeys)
+                if (m_results.at(rows.at(j)).toMap().value(sortKey.key) != rowResults.at(j).toMap().value(sortKey.key))
+                    inPlace = false;
+        // Without an offset nothing before the window could have changed
+        if (inPlace && (!rows.isEmpty() || m_offset == 0))
+        {
+            for (int j = 0; j < rows.count(); j++)
+                replaceRows(rows.at(j), 1, rowDocIds.mid(j, 1), rowResults.mid(j, 1));
+            if (!rows.isEmpty())
+                Q_EMIT resultsChanged(m_results);
+            return;
+        }
+        generateQueryResults();
+        return;
+    }
+
+    // Ordered rows of the document are moved to where their values belong
+    if (!m_sortKeys.isEmpty() && (!m_lazy || fetchesInOrder()))
+    {
+        QList<QVariant> oldResults;
+        for (int row = 0; row < m_rowDocIds.count(); row++)
+            if (m_rowDocIds.at(row) == docId)
+                oldResults.append(m_results.at(row));
+        if (oldResults == rowResults)
+            return;
+        for (int row = m_rowDocIds.count() - 1; row >= 0; row--)
+            if (m_rowDocIds.at(row) == docId)
+                replaceRows(row, 1, QStringList(), QList<QVariant>());
+        for (int j = 0; j < rowDocIds.count(); j++)
+            replaceRows(orderedRow(docId, rowResults.at(j)), 0, rowDocIds.mid(j, 1), rowResults.mid(j, 1));
+        m_documents = uniqueDocIds(m_rowDocIds);
+
+        Q_EMIT documentsChanged(m_documents);
+        Q_EMIT resultsChanged(m_results);
+        return;
+    }
+
+    int row = lowerBound(m_rowDocIds, docId);
+    int oldCount = row < m_rowDocIds.count() && m_rowDocIds.at(row) == docId ? countRows(m_rowDocIds, row) : 0;
+    if (oldCount == 0 && rowDocIds.isEmpty())
+        return;
+    replaceRows(row, oldCount, rowDocIds, rowResults);
+
+    int position = lowerBound(m_documents, docId);
+    bool listed = position < m_documents.count() && m_documents.at(position) == docId;
+    if (listed && rowDocIds.isEmpty())
+        m_documents.removeAt(position);
+    else if (!listed && !rowDocIds.isEmpty())
+        m_documents.insert(position, docId);
+
+    Q_EMIT documentsChanged(m_documents);
+    Q_EMIT resultsChanged(m_results);
+}
+
+/*!
+    \internal
+    Converts the query into a list of maps of fields to the values they have
+    to match.
+ */
+QVariantList Query::buildQueryList()
+{
     /* Convert "*" or 123 or "aa" into  a list */
     /* Also convert ["aa", 123] into [{foo:"aa", bar:123}] */
     QVariantList queryList(m_query.toList());
@@ -176,143 +476,585 @@ void Query::generateQueryResults()
             queryList.append(QVariant(valueMap));
         }
     }
+    return queryList;
+}
 
-    Q_FOREACH (QVariantMap mapIdResult, results) {
-        QString docId((mapIdResult["docId"]).toString());
-        QVariant result_variant(mapIdResult["result"]);
-        QVariantMap result(result_variant.toMap());
-
-        QMapIterator<QString,QVariant> j(result);
-
-        bool match = true;
+/*!
+    \internal
+    Compiles the query into matchers per field, and the values each
+    expression has to match so that only documents with a matching value in
+    the index need to be looked at. Done whenever the query, the index or its
+    expressions change, so that results are matched without parsing the
+    query again.
+ */
+void Query::compileQuery()
+{
+    m_matchers.clear();
+    m_patterns.clear();
+    m_ranges.clear();
+    m_compiledExpression.clear();
+    if (!m_index)
+        return;
 
-        while(j.hasNext()){
+    m_compiledExpression = m_index->getExpression();
+    QVariantList queryList(buildQueryList());
+    Q_FOREACH (QVariant j_value, queryList) {
+        QVariantMap valueMap(j_value.toMap());
+        QMapIterator<QString, QVariant> k(valueMap);
+        while (k.hasNext()) {
+            k.next();
+            if (k.value().userType() == QMetaType::QVariantMap) {
+                compileRange(k.key(), k.value().toMap());
+                continue;
+            }
+            QString query(k.value().toString());
+            int wildcard = query.indexOf("*");
+            FieldMatcher matcher;
+            if (query == "*")
+                matcher.kind = FieldMatcher::Any;
+            else if (wildcard == -1)
+                matcher.kind = FieldMatcher::Exact;
+            else
+                matcher.kind = FieldMatcher::Prefix;
+            matcher.setText(wildcard == -1 ? query : query.left(wildcard));
+            m_matchers[k.key()].append(matcher);
+        }
+    }
 
-            j.next();
+    Q_FOREACH (QString expression, m_compiledExpression) {
+        QString key(expression.split(".").last());
+        Q_FOREACH (QVariant j_value, queryList) {
+            QVariantMap valueMap(j_value.toMap());
+            if (valueMap.contains(key) && valueMap.value(key).userType() != QMetaType::QVariantMap)
+                m_patterns[expression].append(valueMap.value(key).toString());
+        }
+        QPair<QVariant, QVariant> range;
+        if (rangeOfField(key, range))
+            m_ranges.insert(expression, range);
+    }
+}
 
-            if (!iterateQueryList(queryList, j.key(), j.value())) {
-                match = false;
-                break;
+/*!
+    \internal
+    Compiles the \a operators of a range such as {'>=': 1, '<': 10} or
+    {'between': [1, 10]} into matchers of \a field.
+ */
+void Query::compileRange(const QString& field, const QVariantMap& operators)
+{
+    QMapIterator<QString, QVariant> i(operators);
+    while (i.hasNext()) {
+        i.next();
+        FieldMatcher matcher;
+        if (i.key() == "between") {
+            QVariantList bounds(i.value().toList());
+            if (bounds.count() != 2) {
+                qWarning("u1db: Query operator 'between' expects two values");
+                continue;
             }
+            matcher.kind = FieldMatcher::GreaterOrEqual;
+            matcher.operand = toOperand(bounds.at(0));
+            m_matchers[field].append(matcher);
+            matcher.kind = FieldMatcher::LessOrEqual;
+            matcher.operand = toOperand(bounds.at(1));
+            m_matchers[field].append(matcher);
+            continue;
+        }
 
+        if (i.key() == ">")
+            matcher.kind = FieldMatcher::Greater;
+        else if (i.key() == ">=")
+            matcher.kind = FieldMatcher::GreaterOrEqual;
+        else if (i.key() == "<")
+            matcher.kind = FieldMatcher::Less;
+        else if (i.key() == "<=")
+            matcher.kind = FieldMatcher::LessOrEqual;
+        else {
+            qWarning("u1db: Unknown Query operator '%s'", qPrintable(i.key()));
+            continue;
         }
+        matcher.operand = toOperand(i.value());
+        m_matchers[field].append(matcher);
+    }
+}
 
-        if(match == true){
-            // Results must be unique and not empty aka deleted
-            if (result_variant.isValid())
-            {
-                if (!m_documents.contains(docId))
-                    m_documents.append(docId);
+/*!
+    \internal
+    Narrows the matchers of \a field down to one \a range that can be
+    looked up in the index, with inclusive bounds. Returns false if there
+    are no range matchers or their operands are of different types.
+ */
+bool Query::rangeOfField(const QString& field, QPair<QVariant, QVariant>& range) const
+{
+    QVariant operand;
+    Q_FOREACH (const FieldMatcher& matcher, m_matchers.value(field)) {
+        if (matcher.kind < FieldMatcher::Greater)
+            continue;
+        if (operand.isValid() && operand.userType() != matcher.operand.userType())
+            return false;
+        operand = matcher.operand;
 
-                m_results.append(result);
-            }
-        }
+        int order = 0;
+        if (matcher.kind == FieldMatcher::Greater || matcher.kind == FieldMatcher::GreaterOrEqual) {
+            if (!range.first.isValid() || (compareOperand(operand, range.first, order) && order > 0))
+                range.first = operand;
+        } else if (!range.second.isValid() || (compareOperand(operand, range.second, order) && order < 0))
+            range.second = operand;
+    }
+    return operand.isValid();
+}
 
+/*!
+    \internal
+    Sets the \a text that Exact and Prefix match, and the numbers or the
+    boolean it stands for, those only if they're converted back to the
+    same text. A value matches if its text representation is equal, without
+    converting every value to a string.
+ */
+void Query::FieldMatcher::setText(const QString& text)
+{
+    this->text = text;
+    number = text.toDouble(&isNumber);
+    isNumber = isNumber && QVariant(number).toString() == text;
+    integer = text.toLongLong(&isInteger);
+    isInteger = isInteger && QString::number(integer) == text;
+    isBool = text == "true" || text == "false";
+    boolean = text == "true";
+}
+
+/*!
+    \internal
+    Returns true if \a value is matched by this matcher. Ranges compare
+    numbers, dates or strings according to the type of the operand.
+ */
+bool Query::FieldMatcher::matches(const QVariant& value) const
+{
+    int order = 0;
+    switch (kind)
+    {
+    case Any:
+        return true;
+    case Exact:
+        switch (value.userType())
+        {
+        case QMetaType::QString:
+            return *static_cast<const QString*>(value.constData()) == text;
+        case QMetaType::Double:
+            return isNumber && value.toDouble() == number;
+        case QMetaType::Int:
+        case QMetaType::UInt:
+        case QMetaType::LongLong:
+            return isInteger && value.toLongLong() == integer;
+        case QMetaType::Bool:
+            return isBool && value.toBool() == boolean;
+        }
+        return value.toString() == text;
+    case Prefix:
+        if (value.userType() == QMetaType::QString)
+            return static_cast<const QString*>(value.constData())->startsWith(text, Qt::CaseSensitive);
+        return value.toString().startsWith(text, Qt::CaseSensitive);
+    case Greater:
+        return compareOperand(value, operand, order) && order > 0;
+    case GreaterOrEqual:
+        return compareOperand(value, operand, order) && order >= 0;
+    case Less:
+        return compareOperand(value, operand, order) && order < 0;
+    case LessOrEqual:
+        return compareOperand(value, operand, order) && order <= 0;
     }
+    return false;
+}
 
-    resetModel();
+/*!
+    \internal
+    Returns true if every field of \a result is matched by all matchers
+    compiled for it.
+ */
+bool Query::matchesResult(const QVariantMap& result) const
+{
+    for (QVariantMap::const_iterator j = result.constBegin(); j != result.constEnd(); ++j) {
+        QHash<QString, QVector<FieldMatcher> >::const_iterator matchers(m_matchers.constFind(j.key()));
+        if (matchers == m_matchers.constEnd())
+            continue;
+        for (QVector<FieldMatcher>::const_iterator k = matchers->constBegin(); k != matchers->constEnd(); ++k)
+            if (!k->matches(j.value()))
+                return false;
+    }
+    return true;
+}
 
-    Q_EMIT documentsChanged(m_documents);
-    Q_EMIT resultsChanged(m_results);
+/*!
+    \internal
+    Returns true if the row of \a docId with \a result comes before the row
+    of \a otherDocId with \a otherResult according to orderBy. Numbers come
+    before strings and rows without a value last, rows with equal values
+    are ordered by docId. This is the order of sort_key in document_fields,
+    see Database::getOrderedDocIds().
+ */
+bool Query::lessRow(const QString& docId, const QVariant& result, const QString& otherDocId, const QVariant& otherResult) const
+{
+    QVariantMap values(result.toMap());
+    QVariantMap otherValues(otherResult.toMap());
+    Q_FOREACH (const SortKey& sortKey, m_sortKeys) {
+        QVariant value(values.value(sortKey.key));
+        QVariant other(otherValues.value(sortKey.key));
+        if (!value.isValid() || !other.isValid()) {
+            if (value.isValid() != other.isValid())
+                return value.isValid();
+            continue;
+        }
+        int order = sortRank(value) - sortRank(other);
+        if (order == 0 && isNumber(value))
+            order = value.toDouble() < other.toDouble() ? -1 : value.toDouble() > other.toDouble() ? 1 : 0;
+        else if (order == 0)
+            order = compareText(value.toString(), other.toString());
+        if (order != 0)
+            return sortKey.descending ? order > 0 : order < 0;
+    }
+    return docId < otherDocId;
 }
 
 /*!
- * \brief Query::resetModel
- *
- * Resets the model of the Query
- *
+    \internal
+    Sorts \a rowDocIds and \a rowResults according to orderBy.
  */
+void Query::sortRows(QStringList& rowDocIds, QList<QVariant>& rowResults) const
+{
+    QVector<int> rows(rowDocIds.count());
+    for (int j = 0; j < rows.count(); j++)
+        rows[j] = j;
+    std::stable_sort(rows.begin(), rows.end(), [&](int row, int other) {
+        return lessRow(rowDocIds.at(row), rowResults.at(row), rowDocIds.at(other), rowResults.at(other));
+    });
 
-void Query::resetModel(){
-    beginResetModel();
-    endResetModel();
+    QStringList sortedDocIds;
+    QList<QVariant> sortedResults;
+    Q_FOREACH (int row, rows) {
+        sortedDocIds.append(rowDocIds.at(row));
+        sortedResults.append(rowResults.at(row));
+    }
+    rowDocIds = sortedDocIds;
+    rowResults = sortedResults;
 }
 
 /*!
     \internal
-    Loop through the query assuming it's a list.
+    The position in the ordered rows of the model for a row of \a docId
+    with \a result, after any rows that are equal.
+ */
+int Query::orderedRow(const QString& docId, const QVariant& result) const
+{
+    int row = 0;
+    int count = m_rowDocIds.count();
+    while (count > 0)
+    {
+        int step = count / 2;
+        if (!lessRow(docId, result, m_rowDocIds.at(row + step), m_results.at(row + step)))
+        {
+            row += step + 1;
+            count -= step + 1;
+        }
+        else
+            count = step;
+    }
+    return row;
+}
 
-    For example:
-    queryList: { type: 'show' }
-    field: 'type'
-    value: 'show'
+/*!
+    \internal
+    Appends the \a results of the index that match the query to \a rowDocIds
+    and \a rowResults.
  */
-bool Query::iterateQueryList(QVariantList queryList, QString field, QVariant value)
+void Query::matchResults(const QList<QVariantMap>& results, QStringList& rowDocIds, QList<QVariant>& rowResults)
 {
-    QListIterator<QVariant> j(queryList);
+    for (QList<QVariantMap>::const_iterator j = results.constBegin(); j != results.constEnd(); ++j) {
+        QVariant result(j->value("result"));
+        // Results must not be empty aka deleted
+        if (result.isValid() && matchesResult(result.toMap())) {
+            rowDocIds.append(j->value("docId").toString());
+            rowResults.append(result.toMap());
+        }
+    }
+}
 
-    while (j.hasNext()) {
-        QVariant j_value = j.next();
-        QVariantMap valueMap(j_value.toMap());
-        if (!queryMap(valueMap, value.toString(), field))
-            return false;
+/*!
+    \internal
+    Manually triggers reloading of the query.
+ */
+void Query::generateQueryResults()
+{
+    // The expressions of the index were changed since it was compiled
+    if (m_index->getExpression() != m_compiledExpression)
+        compileQuery();
+
+    if (m_lazy)
+    {
+        resetLazyRows();
+        return;
     }
 
-    return true;
+    // Only the matching results are sorted, there's no need to read the
+    // order of all documents from the index
+    QStringList rowDocIds;
+    QList<QVariant> rowResults;
+    matchResults(m_index->getResults(m_index->lookupDocuments(m_patterns, m_ranges)), rowDocIds, rowResults);
+    if (!m_sortKeys.isEmpty())
+        sortRows(rowDocIds, rowResults);
+    if (m_offset > 0 || m_limit >= 0)
+    {
+        rowDocIds = rowDocIds.mid(m_offset, m_limit);
+        rowResults = rowResults.mid(m_offset, m_limit);
+    }
+
+    // Results must be unique
+    m_documents = uniqueDocIds(rowDocIds);
+    updateRows(rowDocIds, rowResults);
+
+    Q_EMIT documentsChanged(m_documents);
+    Q_EMIT resultsChanged(m_results);
 }
 
 /*!
     \internal
-    Verify that query is an identical or wild card match.
+    Whether the lazy model reads results in order of the first orderBy
+    expression from the index in the database, rather than by docId.
  */
-bool Query::queryMatchesValue(QString query, QString value)
+bool Query::fetchesInOrder() const
 {
-    if (query == "*")
-        return true;
-    if (query == value)
-        return true;
-    if (!query.contains ("*"))
-       return false;
-    QString prefix(query.split("*")[0]);
-    return value.startsWith(prefix, Qt::CaseSensitive);
+    return !m_sortKeys.isEmpty() && !m_index->getName().isEmpty() && m_index->getDatabase();
 }
 
 /*!
     \internal
-    Handle different types of string values including wildcards.
+    Reads the next page of values of the first orderBy expression from the
+    index in the database after the last one fetched, and appends the
+    results with those values to \a rowDocIds and \a rowResults. The page
+    is extended up to the last row with the same value, so that later
+    expressions can be sorted within the page.
  */
-bool Query::queryString(QString query, QVariant value)
+void Query::fetchOrderedRows(QStringList& rowDocIds, QList<QVariant>& rowResults)
 {
+    Database *db(m_index->getDatabase());
+    const SortKey& first(m_sortKeys.first());
+    QVariantList keys;
+    QStringList docIds(db->getOrderedDocIds(first.expression, first.descending, Database::PAGE_SIZE,
+        m_cursorDocId, m_cursorKey, &keys));
+    m_complete = docIds.count() < Database::PAGE_SIZE;
+    while (!m_complete)
+    {
+        QVariantList moreKeys;
+        QStringList more(db->getOrderedDocIds(first.expression, first.descending, Database::PAGE_SIZE,
+            docIds.last(), keys.last(), &moreKeys));
+        int same = 0;
+        while (same < more.count() && compareSortKeys(moreKeys.at(same), keys.last()) == 0)
+            same++;
+        docIds.append(more.mid(0, same));
+        keys.append(moreKeys.mid(0, same));
+        if (same < more.count())
+            break;
+        m_complete = more.count() < Database::PAGE_SIZE;
+    }
+    if (docIds.isEmpty())
+        return;
+    m_cursorDocId = docIds.last();
+    m_cursorKey = keys.last();
 
-    QString typeName = value.typeName();
-    if (typeName == "QVariantList") {
-        Q_FOREACH (QVariant value_string, value.toList()) {
-            if (queryString(query, value_string.toString()))
-                return true;
+    // Every value of a document is one row, each row lists the results of
+    // the document with that value
+    QHash<QString, QList<QVariantMap> > documentResults;
+    Q_FOREACH (const QVariantMap& result, m_index->getResults(uniqueDocIds(docIds)))
+        documentResults[result.value("docId").toString()].append(result);
+    QStringList pageDocIds;
+    QList<QVariant> pageResults;
+    for (int j = 0; j < docIds.count(); j++)
+    {
+        QList<QVariantMap> results;
+        Q_FOREACH (const QVariantMap& result, documentResults.value(docIds.at(j)))
+        {
+            QVariant value(result.value("result").toMap().value(first.key));
+            if (value.isValid() && compareSortKeys(sortKey(value), keys.at(j)) == 0)
+                results.append(result);
         }
-        return false;
+        matchResults(results, pageDocIds, pageResults);
     }
+    if (m_sortKeys.count() > 1)
+        sortRows(pageDocIds, pageResults);
+    rowDocIds.append(pageDocIds);
+    rowResults.append(pageResults);
+}
 
-    return queryMatchesValue(query, value.toString());
+/*!
+    \internal
+    Whether the lazy model fetched the position of the row of \a docId with
+    \a result already, so that a change of the document is shown right
+    away. Later rows are read when fetchMore() gets to them.
+ */
+bool Query::isFetched(const QString& docId, const QVariant& result) const
+{
+    if (!fetchesInOrder())
+        return m_complete || docId <= m_cursorDocId;
+
+    QVariant value(result.toMap().value(m_sortKeys.first().key));
+    // Results without a value aren't read in order from the index
+    if (!value.isValid())
+        return false;
+    if (m_complete)
+        return true;
+    if (m_cursorDocId.isEmpty())
+        return false;
+    int order = compareSortKeys(sortKey(value), m_cursorKey);
+    if (m_sortKeys.first().descending)
+        order = -order;
+    return order < 0 || (order == 0 && docId <= m_cursorDocId);
 }
 
 /*!
     \internal
-    Loop through the given map of keys and queries.
+    Removes all rows, which is done when the order of rows is changed so
+    that the new rows aren't compared to rows in another order.
+ */
+void Query::clearRows()
+{
+    beginResetModel();
+    m_rowDocIds.clear();
+    m_results.clear();
+    endResetModel();
+}
 
-    For example:
-    map: { type: 'show' }
-    value: { 'show' }
-    field: 'type'
+/*!
+    \internal
+    Drops all rows of the lazy model, which are fetched again with
+    fetchMore() as they're needed. Nothing is looked up in advance, each
+    page continues after the last docId and value that were fetched.
  */
-bool Query::queryMap(QVariantMap map, QString value, QString field)
+void Query::resetLazyRows()
 {
-    QMapIterator<QString,QVariant> k(map);
+    beginResetModel();
+    m_rowDocIds.clear();
+    m_results.clear();
+    m_documents.clear();
+    m_cursorDocId.clear();
+    m_cursorKey = QVariant();
+    m_skipped = 0;
+    m_complete = m_limit == 0;
+    endResetModel();
 
-    while(k.hasNext()){
-        k.next();
+    Q_EMIT documentsChanged(m_documents);
+    Q_EMIT resultsChanged(m_results);
+}
 
-        QString k_key = k.key();
-        QVariant k_variant = k.value();
-        QString query = k_variant.toString();
+/*!
+    \internal
+    Replaces the rows of the model with \a results, each belonging to the
+    docId at the same position in \a rowDocIds. Both the current and the new
+    rows are ordered by docId, so they can be compared document by document
+    and only rows that were inserted, removed or changed are notified.
+ */
+void Query::updateRows(const QStringList& rowDocIds, const QList<QVariant>& results)
+{
+    // Ordered rows may have moved anywhere, unless the order is the same
+    // only changed results are notified
+    if (!m_sortKeys.isEmpty())
+    {
+        if (rowDocIds != m_rowDocIds)
+        {
+            beginResetModel();
+            m_rowDocIds = rowDocIds;
+            m_results = results;
+            endResetModel();
+            return;
+        }
+        for (int row = 0; row < rowDocIds.count(); row++)
+            replaceRows(row, 1, rowDocIds.mid(row, 1), results.mid(row, 1));
+        return;
+    }
 
-        if(field == k_key){
-            if (!queryMatchesValue(query, value))
-                return false;
+    int row = 0;
+    int j = 0;
+    while (row < m_rowDocIds.count() || j < rowDocIds.count())
+    {
+        bool hasOld = row < m_rowDocIds.count();
+        bool hasNew = j < rowDocIds.count();
+        if (hasOld && (!hasNew || m_rowDocIds.at(row) < rowDocIds.at(j)))
+        {
+            // The document doesn't match anymore
+            replaceRows(row, countRows(m_rowDocIds, row), QStringList(), QList<QVariant>());
+        }
+        else if (!hasOld || rowDocIds.at(j) < m_rowDocIds.at(row))
+        {
+            // The document matches for the first time
+            int count = countRows(rowDocIds, j);
+            replaceRows(row, 0, rowDocIds.mid(j, count), results.mid(j, count));
+            row += count;
+            j += count;
+        }
+        else
+        {
+            // The document still matches, its results may have changed
+            int count = countRows(rowDocIds, j);
+            replaceRows(row, countRows(m_rowDocIds, row), rowDocIds.mid(j, count), results.mid(j, count));
+            row += count;
+            j += count;
         }
     }
+}
 
-    return true;
+/*!
+    \internal
+    Replaces the \a oldCount rows of one document starting at \a row with
+    \a results belonging to \a rowDocIds. Rows present before and after
+    are notified as changed if their results differ, the remainder as
+    removed or inserted.
+ */
+void Query::replaceRows(int row, int oldCount, const QStringList& rowDocIds, const QList<QVariant>& results)
+{
+    int newCount = rowDocIds.count();
+    int common = qMin(oldCount, newCount);
+    int first = -1;
+    int last = -1;
+    for (int k = 0; k < common; k++)
+    {
+        if (m_results.at(row + k) != results.at(k))
+        {
+            m_results[row + k] = results.at(k);
+            if (first == -1)
+                first = row + k;
+            last = row + k;
+        }
+    }
+    if (first != -1)
+        Q_EMIT dataChanged(index(first), index(last));
+    if (oldCount > common)
+    {
+        beginRemoveRows(QModelIndex(), row + common, row + oldCount - 1);
+        for (int k = common; k < oldCount; k++)
+        {
+            m_rowDocIds.removeAt(row + common);
+            m_results.removeAt(row + common);
+        }
+        endRemoveRows();
+    }
+    if (newCount > common)
+    {
+        beginInsertRows(QModelIndex(), row + common, row + newCount - 1);
+        for (int k = common; k < newCount; k++)
+        {
+            m_rowDocIds.insert(row + k, rowDocIds.at(k));
+            m_results.insert(row + k, results.at(k));
+        }
+        endInsertRows();
+    }
+}
+
+/*!
+ * \brief Query::resetModel
+ *
+ * Resets the model of the Query
+ *
+ */
+
+void Query::resetModel(){
+    beginResetModel();
+    endResetModel();
 }
 
 /*!
@@ -332,8 +1074,10 @@ Query::setIndex(Index* index)
     if (m_index)
         QObject::disconnect(m_index, 0, this, 0);
     m_index = index;
+    compileQuery();
     if (m_index){
         QObject::connect(m_index, &Index::dataInvalidated, this, &Query::onDataInvalidated);
+        QObject::connect(m_index, &Index::docChanged, this, &Query::onDocChanged);
     }
     Q_EMIT indexChanged(index);
 
@@ -354,6 +1098,12 @@ Query::getQuery()
     A query in one of the allowed forms:
     'value', ['value'] or [{'sub-field': 'value'}].
     The default is equivalent to '*'.
+
+    Instead of a value a field can be given a range such as
+    [{'price': {'>=': 5, '<': 10}}] or [{'date': {'between': [from, to]}}],
+    using the operators '>', '>=', '<', '<=' and 'between'. Numbers only
+    match numbers and dates match dates stored as ISO 8601 strings, any
+    other operand is compared as a string.
  */
 /*!
     FIXME \a query
@@ -365,10 +1115,151 @@ Query::setQuery(QVariant query)
         return;
 
     m_query = query;
+    compileQuery();
     Q_EMIT queryChanged(query);
     onDataInvalidated();
 }
 
+/*!
+    \qmlproperty list<string> Query::orderBy
+    The index expressions to order the results by, each optionally
+    followed by 'asc' or 'desc' like ['price desc', 'name']. Numbers come
+    before strings and results without a value last. The default is to
+    order by docId.
+
+    The results are sorted once they're looked up, a lazy Query reads the
+    first expression in order from the index in the database instead.
+ */
+/*!
+    Returns the expressions the results are ordered by.
+ */
+QStringList
+Query::getOrderBy()
+{
+    return m_orderBy;
+}
+
+/*!
+    Orders the results by the index expressions in \a orderBy.
+ */
+void
+Query::setOrderBy(const QStringList& orderBy)
+{
+    if (m_orderBy == orderBy)
+        return;
+
+    m_orderBy = orderBy;
+    m_sortKeys.clear();
+    Q_FOREACH (QString field, orderBy) {
+        QStringList parts(field.simplified().split(' '));
+        if (parts.first().isEmpty())
+            continue;
+        QString direction(parts.count() > 1 ? parts.at(1).toLower() : QString("asc"));
+        if (parts.count() > 2 || (direction != "asc" && direction != "desc"))
+            qWarning("u1db: Invalid Query orderBy '%s'", qPrintable(field));
+        SortKey sortKey;
+        sortKey.expression = parts.first();
+        sortKey.key = sortKey.expression.split(".").last();
+        sortKey.descending = direction == "desc";
+        m_sortKeys.append(sortKey);
+    }
+    clearRows();
+    Q_EMIT orderByChanged(orderBy);
+    onDataInvalidated();
+}
+
+/*!
+    \qmlproperty int Query::limit
+    The maximum number of results, all of them if negative which is the
+    default.
+ */
+/*!
+    Returns the maximum number of results.
+ */
+int
+Query::getLimit()
+{
+    return m_limit;
+}
+
+/*!
+    Limits the results to at most \a limit, a negative value means no limit.
+ */
+void
+Query::setLimit(int limit)
+{
+    if (m_limit == limit)
+        return;
+
+    m_limit = limit;
+    Q_EMIT limitChanged(limit);
+    onDataInvalidated();
+}
+
+/*!
+    \qmlproperty int Query::offset
+    The number of results to skip, by default none.
+ */
+/*!
+    Returns the number of skipped results.
+ */
+int
+Query::getOffset()
+{
+    return m_offset;
+}
+
+/*!
+    Skips the first \a offset results.
+ */
+void
+Query::setOffset(int offset)
+{
+    offset = qMax(offset, 0);
+    if (m_offset == offset)
+        return;
+
+    m_offset = offset;
+    Q_EMIT offsetChanged(offset);
+    onDataInvalidated();
+}
+
+/*!
+    \qmlproperty bool Query::lazy
+    If true results are fetched page by page as a view scrolls, instead of
+    looking up all of them at once. The documents and results properties
+    then only list the results fetched so far.
+
+    With orderBy pages are read from the index in the database in order of
+    the first expression, results without a value for it aren't listed.
+    Each page continues after the last value and docId fetched. A changed
+    document only updates its own rows, unless it moves into, out of or
+    within a window set by offset or limit.
+ */
+/*!
+    Returns true if results are fetched on demand.
+ */
+bool
+Query::getLazy()
+{
+    return m_lazy;
+}
+
+/*!
+    Fetches results on demand with fetchMore() if \a lazy is true.
+ */
+void
+Query::setLazy(bool lazy)
+{
+    if (m_lazy == lazy)
+        return;
+
+    m_lazy = lazy;
+    clearRows();
+    Q_EMIT lazyChanged(lazy);
+    onDataInvalidated();
+}
+
 /*!
     \qmlproperty list<string> Query::documents
     The docId's of all matched documents.
@@ -22,6 +22,8 @@
 
 #include <QtCore/QObject>
 #include <QVariant>
+#include <QHash>
+#include <QVector>
 
 #include "index.h"
 
@@ -37,6 +39,14 @@ class Q_DECL_EXPORT Query : public QAbstractListModel {
 #endif
     /*! query */
     Q_PROPERTY(QVariant query READ getQuery WRITE setQuery NOTIFY queryChanged)
+    /*! orderBy */
+    Q_PROPERTY(QStringList orderBy READ getOrderBy WRITE setOrderBy NOTIFY orderByChanged)
+    /*! limit */
+    Q_PROPERTY(int limit READ getLimit WRITE setLimit NOTIFY limitChanged)
+    /*! offset */
+    Q_PROPERTY(int offset READ getOffset WRITE setOffset NOTIFY offsetChanged)
+    /*! lazy */
+    Q_PROPERTY(bool lazy READ getLazy WRITE setLazy NOTIFY lazyChanged)
     /*! documents */
     Q_PROPERTY(QStringList documents READ getDocuments NOTIFY documentsChanged)
     /*! results */
@@ -48,11 +58,21 @@ public:
     QVariant data(const QModelIndex & index, int role = Qt::DisplayRole) const;
     QHash<int, QByteArray>roleNames() const;
     int rowCount(const QModelIndex & parent = QModelIndex()) const;
+    bool canFetchMore(const QModelIndex & parent) const;
+    void fetchMore(const QModelIndex & parent);
 
     Index* getIndex();
     void setIndex(Index* index);
     QVariant getQuery();
     void setQuery(QVariant query);
+    QStringList getOrderBy();
+    void setOrderBy(const QStringList& orderBy);
+    int getLimit();
+    void setLimit(int limit);
+    int getOffset();
+    void setOffset(int offset);
+    bool getLazy();
+    void setLazy(bool lazy);
     QStringList getDocuments();
     QList<QVariant> getResults();
 
@@ -67,6 +87,22 @@ Q_SIGNALS:
         The query changed.
      */
     void queryChanged(QVariant query);
+    /*!
+        The order of the results changed.
+     */
+    void orderByChanged(QStringList orderBy);
+    /*!
+        The maximum number of results changed.
+     */
+    void limitChanged(int limit);
+    /*!
+        The number of skipped results changed.
+     */
+    void offsetChanged(int offset);
+    /*!
+        Fetching results on demand was enabled or disabled.
+     */
+    void lazyChanged(bool lazy);
     /*!
         The documents matching the query changed.
      */
@@ -79,18 +115,84 @@ private:
     Q_DISABLE_COPY(Query)
     Index* m_index;
     QStringList m_documents;
+    QStringList m_rowDocIds;
     QList<QVariant> m_results;
     QVariant m_query;
 
+    struct FieldMatcher
+    {
+        enum Kind
+        {
+            Any,
+            Exact,
+            Prefix,
+            Greater,
+            GreaterOrEqual,
+            Less,
+            LessOrEqual
+        };
+
+        FieldMatcher() : kind(Any), isNumber(false), number(0), isInteger(false), integer(0),
+            isBool(false), boolean(false) {}
+
+        Kind kind;
+        QString text;
+        QVariant operand;
+        // The text of Exact converted once for values that aren't strings
+        bool isNumber;
+        double number;
+        bool isInteger;
+        qlonglong integer;
+        bool isBool;
+        bool boolean;
+
+        void setText(const QString& text);
+        bool matches(const QVariant& value) const;
+    };
+
+    QHash<QString, QVector<FieldMatcher> > m_matchers;
+    QMap<QString, QStringList> m_patterns;
+    QMap<QString, QPair<QVariant, QVariant> > m_ranges;
+    QStringList m_compiledExpression;
+
+    struct SortKey
+    {
+        QString expression;
+        QString key;
+        bool descending;
+    };
+
+    QStringList m_orderBy;
+    QList<SortKey> m_sortKeys;
+    int m_limit;
+    int m_offset;
+    bool m_lazy;
+    QString m_cursorDocId;
+    QVariant m_cursorKey;
+    int m_skipped;
+    bool m_complete;
+
     void onDataInvalidated();
+    void onDocChanged(const QString& docId);
 
     bool debug();
+    QVariantList buildQueryList();
+    void compileQuery();
+    void compileRange(const QString& field, const QVariantMap& operators);
+    bool rangeOfField(const QString& field, QPair<QVariant, QVariant>& range) const;
+    bool matchesResult(const QVariantMap& result) const;
+    bool lessRow(const QString& docId, const QVariant& result, const QString& otherDocId, const QVariant& otherResult) const;
+    void sortRows(QStringList& rowDocIds, QList<QVariant>& rowResults) const;
+    int orderedRow(const QString& docId, const QVariant& result) const;
+    void matchResults(const QList<QVariantMap>& results, QStringList& rowDocIds, QList<QVariant>& rowResults);
     void generateQueryResults();
-    bool iterateQueryList(QVariantList list, QString field, QVariant value);
-    bool queryMatchesValue(QString query, QString value);
-    bool queryString(QString query, QVariant value);
-    bool queryMap(QVariantMap map, QString value, QString field);
-    bool queryField(QString field, QVariant value);
+    bool fetchesInOrder() const;
+    void fetchOrderedRows(QStringList& rowDocIds, QList<QVariant>& rowResults);
+    bool isFetched(const QString& docId, const QVariant& result) const;
+    void resetLazyRows();
+    void clearRows();
+    void updateRows(const QStringList& rowDocIds, const QList<QVariant>& results);
+    void replaceRows(int row, int oldCount, const QStringList& rowDocIds, const QList<QVariant>& results);
 };
 
 QT_END_NAMESPACE_U1DB
@@ -0,0 +1,199 @@
+/*
+ * Copyright (C) 2013 Canonical, Ltd.
+ *
+ * Authors:
+ *  Christian Dywan <christian.dywan@canonical.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "revision.h"
+#include "private.h"
+
+QT_BEGIN_NAMESPACE_U1DB
+
+Revision::Revision()
+{
+}
+
+/*
+    Parses \a revision, ignoring pairs that lack a counter.
+ */
+Revision
+Revision::fromString(const QString& revision)
+{
+    Revision parsed;
+    int start = 0;
+    while (start < revision.size())
+    {
+        int end = revision.indexOf(QLatin1Char('|'), start);
+        if (end < 0)
+            end = revision.size();
+        int colon = revision.lastIndexOf(QLatin1Char(':'), end - 1);
+        if (colon > start)
+        {
+            bool ok;
+            qint64 counter = revision.mid(colon + 1, end - colon - 1).toLongLong(&ok);
+            if (ok)
+            {
+                QString replica(revision.mid(start, colon - start));
+                int index = parsed.lowerBound(replica);
+                if (index < parsed.m_entries.size() && parsed.m_entries.at(index).replica == replica)
+                    parsed.m_entries[index].counter = qMax(parsed.m_entries.at(index).counter, counter);
+                else
+                {
+                    Entry entry = { replica, counter };
+                    parsed.m_entries.insert(index, entry);
+                }
+            }
+        }
+        start = end + 1;
+    }
+    return parsed;
+}
+
+/*
+    Returns the name used in revisions for \a replicaUid, which is stored
+    with curly brackets.
+ */
+QString
+Revision::replicaName(const QString& replicaUid)
+{
+    if (replicaUid.startsWith(QLatin1Char('{')) && replicaUid.endsWith(QLatin1Char('}')))
+        return replicaUid.mid(1, replicaUid.size() - 2);
+    return replicaUid;
+}
+
+QString
+Revision::toString() const
+{
+    QString revision;
+    Q_FOREACH (const Entry& entry, m_entries)
+    {
+        if (!revision.isEmpty())
+            revision += QLatin1Char('|');
+        revision += entry.replica + QLatin1Char(':') + QString::number(entry.counter);
+    }
+    return revision;
+}
+
+bool
+Revision::isEmpty() const
+{
+    return m_entries.isEmpty();
+}
+
+/*
+    Returns the number of changes made by \a replica, 0 if it made none.
+ */
+qint64
+Revision::counter(const QString& replica) const
+{
+    int index = lowerBound(replica);
+    if (index < m_entries.size() && m_entries.at(index).replica == replica)
+        return m_entries.at(index).counter;
+    return 0;
+}
+
+/*
+    Counts a new change made by \a replica, keeping the counters of others.
+ */
+void
+Revision::increment(const QString& replica)
+{
+    int index = lowerBound(replica);
+    if (index < m_entries.size() && m_entries.at(index).replica == replica)
+        ++m_entries[index].counter;
+    else
+    {
+        Entry entry = { replica, 1 };
+        m_entries.insert(index, entry);
+    }
+}
+
+/*
+    Tells whether this revision happened before or after \a other, or if
+    they were made independently of each other and thus conflict.
+ */
+Revision::Order
+Revision::compare(const Revision& other) const
+{
+    bool before = false;
+    bool after = false;
+    int i = 0;
+    int j = 0;
+    while (i < m_entries.size() || j < other.m_entries.size())
+    {
+        qint64 mine = 0;
+        qint64 theirs = 0;
+        if (j >= other.m_entries.size()
+         || (i < m_entries.size() && m_entries.at(i).replica < other.m_entries.at(j).replica))
+            mine = m_entries.at(i++).counter;
+        else if (i >= m_entries.size() || other.m_entries.at(j).replica < m_entries.at(i).replica)
+            theirs = other.m_entries.at(j++).counter;
+        else
+        {
+            mine = m_entries.at(i++).counter;
+            theirs = other.m_entries.at(j++).counter;
+        }
+        before |= mine < theirs;
+        after |= mine > theirs;
+    }
+    if (before && after)
+        return Concurrent;
+    return before ? Before : after ? After : Equal;
+}
+
+/*
+    Returns a revision that succeeds both this one and \a other, with the
+    highest counter of each replica.
+ */
+Revision
+Revision::merged(const Revision& other) const
+{
+    Revision result(*this);
+    Q_FOREACH (const Entry& entry, other.m_entries)
+    {
+        int index = result.lowerBound(entry.replica);
+        if (index < result.m_entries.size() && result.m_entries.at(index).replica == entry.replica)
+            result.m_entries[index].counter = qMax(result.m_entries.at(index).counter, entry.counter);
+        else
+            result.m_entries.insert(index, entry);
+    }
+    return result;
+}
+
+/*
+    Returns the position of the first entry whose replica isn't less than
+    \a replica.
+ */
+int
+Revision::lowerBound(const QString& replica) const
+{
+    int index = 0;
+    int count = m_entries.size();
+    while (count > 0)
+    {
+        int step = count / 2;
+        if (m_entries.at(index + step).replica < replica)
+        {
+            index += step + 1;
+            count -= step + 1;
+        }
+        else
+            count = step;
+    }
+    return index;
+}
+
+QT_END_NAMESPACE_U1DB
@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2013 Canonical, Ltd.
+ *
+ * Authors:
+ *  Christian Dywan <christian.dywan@canonical.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef U1DB_REVISION_H
+#define U1DB_REVISION_H
+
+#include <QString>
+#include <QVector>
+
+#include "global.h"
+
+QT_BEGIN_NAMESPACE_U1DB
+
+/*
+    The revision of a document as a vector clock, one counter per replica
+    that modified it. Entries are kept sorted by replica so that revisions
+    are compared in a single pass. The string form is the one used by u1db,
+    "replica:counter" pairs separated by "|".
+ */
+class Q_DECL_EXPORT Revision {
+public:
+    enum Order
+    {
+        Equal,
+        Before,
+        After,
+        Concurrent
+    };
+
+    Revision();
+    static Revision fromString(const QString& revision);
+    static QString replicaName(const QString& replicaUid);
+    QString toString() const;
+    bool isEmpty() const;
+    qint64 counter(const QString& replica) const;
+    void increment(const QString& replica);
+    Order compare(const Revision& other) const;
+    Revision merged(const Revision& other) const;
+private:
+    struct Entry
+    {
+        QString replica;
+        qint64 counter;
+    };
+
+    QVector<Entry> m_entries;
+
+    int lowerBound(const QString& replica) const;
+};
+
+QT_END_NAMESPACE_U1DB
+
+#endif // U1DB_REVISION_H
@@ -25,6 +25,7 @@
 #include <QJsonDocument>
 
 #include "synchronizer.h"
+#include "revision.h"
 #include "private.h"
 
 QT_BEGIN_NAMESPACE_U1DB
@@ -901,10 +902,21 @@ void Synchronizer::syncLocalToLocal(Database *sourceDb, QMap<QString,QVariant> t
 
 QVariant Synchronizer::syncDocument(Database *from, Database *to, QString docId)
 {
-    QVariant document = from->getDoc(docId);
-    to->putDoc(document, docId);
     QString revision = from->getCurrentDocRevisionNumber(docId);
-    to->updateDocRevisionNumber(docId,revision);
+    // A deleted document has no contents and is copied as a tombstone
+    QVariant document = from->getDocUnchecked(docId);
+
+    Revision incoming(Revision::fromString(revision));
+    Revision current(Revision::fromString(to->getCurrentDocRevisionNumber(docId)));
+
+    // The target already has this change, or a later one
+    Revision::Order order = incoming.compare(current);
+    if (order == Revision::Equal || order == Revision::Before)
+        return document;
+
+    // A conflicting change of the target is overwritten but still counted
+    to->putDoc(document, docId);
+    to->updateDocRevisionNumber(docId,incoming.merged(current).toString());
 
     return document;
 }
@@ -965,10 +977,6 @@ QString Synchronizer::getUidFromLocalDb(QString dbFileName)
 
     QString dbUid;
 
-    QSqlDatabase db;
-
-    db = QSqlDatabase::addDatabase("QSQLITE",QUuid::createUuid().toString());
-
     QFile db_file(dbFileName);
 
     if(!db_file.exists())
@@ -987,10 +995,13 @@ QString Synchronizer::getUidFromLocalDb(QString dbFileName)
     }
     else
     {
-        db.setDatabaseName(dbFileName);
-        if (!db.open()){
+        // Only reads the uid, the file is never initialized or upgraded here
+        QString error;
+        dbUid = Database::readReplicaUid(dbFileName, error);
+
+        if(dbUid.isEmpty()){
 
-            QString message_value = db.lastError().text();
+            QString message_value = error;
 
             QVariantMap output_map;
             output_map.insert("concerning_property","source|targets");
@@ -999,26 +1010,12 @@ QString Synchronizer::getUidFromLocalDb(QString dbFileName)
             output_map.insert("message_value",message_value);
             m_sync_output.append(output_map);
 
+            return dbUid;
         }
-        else{
-            QSqlQuery query (db.exec("SELECT value FROM u1db_config WHERE name = 'replica_uid'"));
 
-            if(!query.lastError().isValid() && query.next()){
-                dbUid = query.value(0).toString();
-                db.close();
+        dbUid = dbUid.replace("{","");
 
-                dbUid = dbUid.replace("{","");
-
-                dbUid = dbUid.replace("}","");
-
-                return dbUid;
-            }
-            else{
-                qWarning("u1db: %s", qPrintable(query.lastError().text()));
-                db.close();
-                return dbUid;
-            }
-        }
+        dbUid = dbUid.replace("}","");
 
     }
 
@@ -1232,10 +1229,14 @@ void Synchronizer::processDataFromRemoteServer(Database *source, QString replyDa
 
                 }
 
-                if(content!=""&&id!=""&&rev!="")
+                Revision incoming(Revision::fromString(rev));
+                Revision current(Revision::fromString(source->getCurrentDocRevisionNumber(id)));
+                Revision::Order order = incoming.compare(current);
+
+                if(content!=""&&id!=""&&rev!=""&&order!=Revision::Equal&&order!=Revision::Before)
                 {
                     source->putDoc(content,id);
-                    source->updateDocRevisionNumber(id,rev);
+                    source->updateDocRevisionNumber(id,incoming.merged(current).toString());
                 }
 
             }
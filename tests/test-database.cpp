@@ -24,9 +24,32 @@
 #include "document.h"
 #include "index.h"
 #include "query.h"
+#include "revision.h"
+#include "synchronizer.h"
 
 QT_USE_NAMESPACE_U1DB
 
+class ReaderThread : public QThread
+{
+public:
+    ReaderThread(Database* db) : m_db(db) {}
+
+    QVariant contents;
+    QStringList docIds;
+    QStringList indexed;
+
+protected:
+    void run()
+    {
+        contents = m_db->getDoc("a");
+        docIds = m_db->listDocs();
+        indexed = m_db->getIndexedDocIds("color", QStringList() << "blue");
+    }
+
+private:
+    Database* m_db;
+};
+
 class U1DBDatabaseTest : public QObject
 {
     Q_OBJECT
@@ -151,6 +174,1008 @@ private Q_SLOTS:
         QCOMPARE(query.getResults(), expected_numbers);
     }
 
+    void testIndexedDocIds()
+    {
+        Database db;
+        db.putDoc(QJsonDocument::fromJson("{\"color\": \"blue\"}").toVariant(), "a");
+
+        Index index;
+        index.setDatabase(&db);
+        index.setName("by-color");
+        index.setExpression(QStringList() << "color");
+
+        db.putDoc(QJsonDocument::fromJson("{\"color\": \"green\"}").toVariant(), "b");
+        db.putDoc(QJsonDocument::fromJson("{\"size\": 1}").toVariant(), "c");
+
+        QCOMPARE(db.getIndexedDocIds("color"), QStringList() << "a" << "b");
+        QCOMPARE(db.getIndexedDocIds("color", QStringList() << "blue"), QStringList() << "a");
+        QCOMPARE(db.getIndexedDocIds("color", QStringList() << "gr*"), QStringList() << "b");
+        QCOMPARE(db.getIndexedDocIds("size"), QStringList());
+
+        db.putDoc(QJsonDocument::fromJson("{\"color\": \"green\"}").toVariant(), "a");
+        QCOMPARE(db.getIndexedDocIds("color", QStringList() << "blue"), QStringList());
+
+        Query query;
+        query.setIndex(&index);
+        query.setQuery("green");
+        QCOMPARE(query.getDocuments(), QStringList() << "a" << "b");
+    }
+
+    void testStatementCache()
+    {
+        Database db;
+        db.putDoc(QJsonDocument::fromJson("{\"color\": \"blue\"}").toVariant(), "a");
+        int misses = db.getStatistics()["statementCacheMisses"].toInt();
+        int hits = db.getStatistics()["statementCacheHits"].toInt();
+        db.putDoc(QJsonDocument::fromJson("{\"color\": \"green\"}").toVariant(), "b");
+        QCOMPARE(db.getStatistics()["statementCacheMisses"].toInt(), misses);
+        QVERIFY(db.getStatistics()["statementCacheHits"].toInt() > hits);
+        QCOMPARE(db.getDoc("b"), QJsonDocument::fromJson("{\"color\": \"green\"}").toVariant());
+
+        // Statements generated per number of fields don't pile up
+        QStringList fields;
+        for (int i = 0; i < 100; i++)
+        {
+            fields << QString("f%1").arg(i);
+            db.getDoc("b", fields);
+        }
+        QVERIFY(db.getStatistics()["statementCacheSize"].toInt() <= 64);
+    }
+
+    void testTuning()
+    {
+        Database db;
+        db.setJournalMode("WAL");
+        db.setSynchronous("normal");
+        db.setCacheSize(-4000);
+        db.setMmapSize(0);
+        QTemporaryFile file;
+        QCOMPARE(file.open(), true);
+        db.setPath(file.fileName());
+        QCOMPARE(db.getJournalMode(), QString("wal"));
+        QCOMPARE(db.getSynchronous(), QString("normal"));
+        QVERIFY(!db.putDoc(QJsonDocument::fromJson("{\"color\": \"blue\"}").toVariant(), "a").isEmpty());
+        QVERIFY(db.lastError().isEmpty());
+
+        // The pragmas are in effect on the connection of the database
+        bool found = false;
+        Q_FOREACH (QString name, QSqlDatabase::connectionNames())
+        {
+            QSqlDatabase connection(QSqlDatabase::database(name, false));
+            if (connection.databaseName() != file.fileName())
+                continue;
+            found = true;
+            QSqlQuery query(connection.exec("PRAGMA journal_mode"));
+            QVERIFY(query.next());
+            QCOMPARE(query.value(0).toString(), QString("wal"));
+            query = connection.exec("PRAGMA synchronous");
+            QVERIFY(query.next());
+            QCOMPARE(query.value(0).toInt(), 1);
+        }
+        QVERIFY(found);
+
+        // Modes SQLite refuses are reported and replaced by the mode in effect
+        Database memory;
+        memory.listDocs();
+        memory.setJournalMode("wal");
+        QCOMPARE(memory.getJournalMode(), QString("memory"));
+        QVERIFY(!memory.lastError().isEmpty());
+        db.setPageSize(1000);
+        QVERIFY(!db.lastError().isEmpty());
+        QCOMPARE(db.getPageSize(), 0);
+    }
+
+    void testPutDocs()
+    {
+        Database db;
+        Document doc;
+        doc.setDocId("b");
+        doc.setDatabase(&db);
+        QSignalSpy docsChanged(&db, SIGNAL(docsChanged(const QStringList&)));
+        QSignalSpy modelReset(&db, SIGNAL(modelReset()));
+
+        QVariantList docs;
+        docs << QJsonDocument::fromJson("{\"color\": \"blue\"}").toVariant();
+        docs << QJsonDocument::fromJson("{\"color\": \"green\"}").toVariant();
+        QStringList revisions(db.putDocs(docs, QStringList() << "a" << "b"));
+        QCOMPARE(revisions.count(), 2);
+        QCOMPARE(docsChanged.count(), 1);
+        QCOMPARE(modelReset.count(), 1);
+        QCOMPARE(QStringList(db.listDocs()), QStringList() << "a" << "b");
+        QCOMPARE(doc.getContents(), docs.at(1));
+
+        // Nothing is stored if any of the documents is invalid
+        QVERIFY(db.putDocs(docs, QStringList() << "c" << "-invalid id-").isEmpty());
+        QCOMPARE(QStringList(db.listDocs()), QStringList() << "a" << "b");
+
+        db.deleteDocs(QStringList() << "a" << "b");
+        QCOMPARE(docsChanged.count(), 2);
+        QVERIFY(!doc.getContents().toMap().contains("color"));
+    }
+
+    void testFetchMore()
+    {
+        Database db;
+        QVariantList docs;
+        QStringList docIds;
+        for (int i = 0; i < 800; i++)
+        {
+            docs << QJsonDocument::fromJson(QString("{\"color\": \"blue\", \"n\": %1}").arg(i).toUtf8()).toVariant();
+            docIds << QString("doc%1").arg(i, 3, 10, QChar('0'));
+        }
+        db.putDocs(docs, docIds);
+
+        QCOMPARE(db.rowCount(), 0);
+        QVERIFY(db.canFetchMore(QModelIndex()));
+        db.fetchMore(QModelIndex());
+        QCOMPARE(db.rowCount(), 100);
+        QCOMPARE(db.data(db.index(99), 1).toString(), QString("doc099"));
+        QCOMPARE(db.data(db.index(99), 0), docs.at(99));
+        while (db.canFetchMore(QModelIndex()))
+            db.fetchMore(QModelIndex());
+        QCOMPARE(db.rowCount(), 800);
+        QCOMPARE(db.data(db.index(799), 1).toString(), QString("doc799"));
+        QCOMPARE(db.data(db.index(799), 0), docs.at(799));
+        // Rows far from the last one fetched were unloaded and are read again
+        QCOMPARE(db.data(db.index(99), 0), docs.at(99));
+        QCOMPARE(db.data(db.index(0), 0), docs.at(0));
+        QCOMPARE(db.data(db.index(799), 0), docs.at(799));
+    }
+
+    void testIncrementalModel()
+    {
+        Database db;
+        db.putDoc(QJsonDocument::fromJson("{\"color\": \"blue\"}").toVariant(), "b");
+        while (db.canFetchMore(QModelIndex()))
+            db.fetchMore(QModelIndex());
+        QCOMPARE(db.rowCount(), 1);
+
+        QSignalSpy modelReset(&db, SIGNAL(modelReset()));
+        QSignalSpy rowsInserted(&db, SIGNAL(rowsInserted(const QModelIndex&, int, int)));
+        QSignalSpy dataChanged(&db, SIGNAL(dataChanged(const QModelIndex&, const QModelIndex&, const QVector<int>&)));
+        db.putDoc(QJsonDocument::fromJson("{\"color\": \"green\"}").toVariant(), "a");
+        QCOMPARE(rowsInserted.count(), 1);
+        QCOMPARE(db.data(db.index(0), 1).toString(), QString("a"));
+        db.putDoc(QJsonDocument::fromJson("{\"color\": \"red\"}").toVariant(), "b");
+        QCOMPARE(dataChanged.count(), 1);
+        QCOMPARE(db.data(db.index(1), 0).toMap()["color"].toString(), QString("red"));
+        QCOMPARE(modelReset.count(), 0);
+
+        Index index;
+        index.setDatabase(&db);
+        index.setName("by-color");
+        index.setExpression(QStringList() << "color");
+        Query query;
+        query.setIndex(&index);
+        query.setQuery("red");
+        QCOMPARE(query.rowCount(), 1);
+
+        QSignalSpy queryReset(&query, SIGNAL(modelReset()));
+        QSignalSpy queryInserted(&query, SIGNAL(rowsInserted(const QModelIndex&, int, int)));
+        QSignalSpy queryRemoved(&query, SIGNAL(rowsRemoved(const QModelIndex&, int, int)));
+        db.putDoc(QJsonDocument::fromJson("{\"color\": \"red\"}").toVariant(), "a");
+        QCOMPARE(queryInserted.count(), 1);
+        QCOMPARE(query.data(query.index(0), 1).toString(), QString("a"));
+        db.putDoc(QJsonDocument::fromJson("{\"color\": \"blue\"}").toVariant(), "b");
+        QCOMPARE(queryRemoved.count(), 1);
+        QCOMPARE(query.rowCount(), 1);
+        QCOMPARE(queryReset.count(), 0);
+    }
+
+    void testIncrementalQuery()
+    {
+        Database db;
+        db.putDoc(QJsonDocument::fromJson("{\"color\": \"red\"}").toVariant(), "a");
+        db.putDoc(QJsonDocument::fromJson("{\"color\": \"blue\"}").toVariant(), "c");
+        Index index;
+        index.setDatabase(&db);
+        index.setName("by-color");
+        index.setExpression(QStringList() << "color");
+        Query query;
+        query.setIndex(&index);
+        query.setQuery("r*");
+        QCOMPARE(query.getDocuments(), QStringList() << "a");
+
+        QSignalSpy queryReset(&query, SIGNAL(modelReset()));
+        QSignalSpy queryChanged(&query, SIGNAL(dataChanged(const QModelIndex&, const QModelIndex&)));
+        QSignalSpy queryInserted(&query, SIGNAL(rowsInserted(const QModelIndex&, int, int)));
+        QSignalSpy queryRemoved(&query, SIGNAL(rowsRemoved(const QModelIndex&, int, int)));
+        db.putDoc(QJsonDocument::fromJson("{\"color\": \"rose\"}").toVariant(), "b");
+        QCOMPARE(queryInserted.count(), 1);
+        QCOMPARE(queryInserted.at(0).at(1).toInt(), 1);
+        QCOMPARE(query.getDocuments(), QStringList() << "a" << "b");
+
+        db.putDoc(QJsonDocument::fromJson("{\"color\": \"ruby\"}").toVariant(), "a");
+        QCOMPARE(queryChanged.count(), 1);
+        QCOMPARE(query.data(query.index(0), 0).toMap()["color"].toString(), QString("ruby"));
+
+        // Documents that don't match before or after don't touch the model
+        db.putDoc(QJsonDocument::fromJson("{\"color\": \"green\"}").toVariant(), "c");
+        db.deleteDoc("a");
+        QCOMPARE(queryRemoved.count(), 1);
+        QCOMPARE(query.getDocuments(), QStringList() << "b");
+        QCOMPARE(queryInserted.count(), 1);
+        QCOMPARE(queryChanged.count(), 1);
+        QCOMPARE(queryReset.count(), 0);
+    }
+
+    void testRangeQuery()
+    {
+        Database db;
+        db.putDoc(QJsonDocument::fromJson("{\"price\": 5, \"date\": \"2013-06-01T12:00:00Z\"}").toVariant(), "a");
+        db.putDoc(QJsonDocument::fromJson("{\"price\": 12.5, \"date\": \"2013-07-15T08:00:00+02:00\"}").toVariant(), "b");
+        db.putDoc(QJsonDocument::fromJson("{\"price\": \"10\", \"date\": \"soon\"}").toVariant(), "c");
+        db.putDoc(QJsonDocument::fromJson("{\"price\": 30, \"date\": \"2014-01-01\"}").toVariant(), "d");
+        QCOMPARE(db.putIndex("by-price", QStringList() << "price"), QString());
+        QCOMPARE(db.putIndex("by-date", QStringList() << "date"), QString());
+        QCOMPARE(db.getIndexedDocIdsInRange("price", 5.0, 20.0), QStringList() << "a" << "b");
+        QCOMPARE(db.getIndexedDocIdsInRange("price", QVariant(), 10.0), QStringList() << "a");
+        QCOMPARE(db.getIndexedDocIds("price", QStringList() << "12.5"), QStringList() << "b");
+
+        Index index;
+        index.setDatabase(&db);
+        index.setName("by-price");
+        index.setExpression(QStringList() << "price");
+        Query query;
+        query.setIndex(&index);
+        QVariantMap range;
+        range.insert(">", 5);
+        range.insert("<=", 30);
+        QVariantMap queryMap;
+        queryMap.insert("price", range);
+        query.setQuery(QVariantList() << queryMap);
+        // Numbers don't match strings
+        QCOMPARE(query.getDocuments(), QStringList() << "b" << "d");
+
+        range.clear();
+        range.insert("between", QVariantList() << "1" << "2");
+        queryMap.insert("price", range);
+        query.setQuery(QVariantList() << queryMap);
+        QCOMPARE(query.getDocuments(), QStringList() << "c");
+
+        db.putDoc(QJsonDocument::fromJson("{\"price\": \"15\"}").toVariant(), "e");
+        QCOMPARE(query.getDocuments(), QStringList() << "c" << "e");
+
+        // Exact values match numbers and strings by their text
+        queryMap.insert("price", "12.5");
+        query.setQuery(QVariantList() << queryMap);
+        QCOMPARE(query.getDocuments(), QStringList() << "b");
+        queryMap.insert("price", "5");
+        query.setQuery(QVariantList() << queryMap);
+        QCOMPARE(query.getDocuments(), QStringList() << "a");
+        queryMap.insert("price", "15");
+        query.setQuery(QVariantList() << queryMap);
+        QCOMPARE(query.getDocuments(), QStringList() << "e");
+
+        Index dates;
+        dates.setDatabase(&db);
+        dates.setName("by-date");
+        dates.setExpression(QStringList() << "date");
+        Query dateQuery;
+        dateQuery.setIndex(&dates);
+        range.clear();
+        range.insert(">=", QDateTime(QDate(2013, 7, 15), QTime(6, 0), Qt::UTC));
+        range.insert("<", QDate(2014, 1, 1));
+        queryMap.clear();
+        queryMap.insert("date", range);
+        dateQuery.setQuery(QVariantList() << queryMap);
+        QCOMPARE(dateQuery.getDocuments(), QStringList() << "b");
+    }
+
+    void testOrderedQuery()
+    {
+        Database db;
+        db.putDoc(QJsonDocument::fromJson("{\"price\": 5}").toVariant(), "a");
+        db.putDoc(QJsonDocument::fromJson("{\"price\": 12.5}").toVariant(), "b");
+        db.putDoc(QJsonDocument::fromJson("{\"price\": \"10\"}").toVariant(), "c");
+        db.putDoc(QJsonDocument::fromJson("{\"price\": 30}").toVariant(), "d");
+        QCOMPARE(db.putIndex("by-price", QStringList() << "price"), QString());
+        QCOMPARE(db.getOrderedDocIds("price"), QStringList() << "a" << "b" << "d" << "c");
+        QVariantList keys;
+        QCOMPARE(db.getOrderedDocIds("price", false, 2, QString(), QVariant(), &keys), QStringList() << "a" << "b");
+        QCOMPARE(keys.count(), 2);
+        QCOMPARE(db.getOrderedDocIds("price", false, 2, "b", keys.last()), QStringList() << "d" << "c");
+
+        Index index;
+        index.setDatabase(&db);
+        index.setName("by-price");
+        index.setExpression(QStringList() << "price");
+        Query query;
+        query.setIndex(&index);
+        query.setOrderBy(QStringList() << "price desc");
+        QCOMPARE(query.getDocuments(), QStringList() << "c" << "d" << "b" << "a");
+        query.setOrderBy(QStringList() << "price");
+        QCOMPARE(query.getDocuments(), QStringList() << "a" << "b" << "d" << "c");
+        QCOMPARE(query.data(query.index(1), 1).toString(), QString("b"));
+
+        // A changed document moves to its new row
+        QSignalSpy queryReset(&query, SIGNAL(modelReset()));
+        db.putDoc(QJsonDocument::fromJson("{\"price\": 20}").toVariant(), "a");
+        QCOMPARE(query.getDocuments(), QStringList() << "b" << "a" << "d" << "c");
+        QCOMPARE(query.data(query.index(1), 1).toString(), QString("a"));
+        QCOMPARE(queryReset.count(), 0);
+
+        // Binary documents keep their values in document_fields, which are
+        // ordered by type like Query orders the results
+        Database binary;
+        binary.setStorageFormat(Database::Binary);
+        binary.putDoc(QJsonDocument::fromJson("{\"price\": 5}").toVariant(), "a");
+        binary.putDoc(QJsonDocument::fromJson("{\"price\": 12.5}").toVariant(), "b");
+        binary.putDoc(QJsonDocument::fromJson("{\"price\": \"10\"}").toVariant(), "c");
+        binary.putDoc(QJsonDocument::fromJson("{\"price\": 30}").toVariant(), "d");
+        binary.putDoc(QJsonDocument::fromJson("{\"price\": true}").toVariant(), "e");
+        QCOMPARE(binary.putIndex("by-price", QStringList() << "price"), QString());
+        QCOMPARE(binary.getOrderedDocIds("price"), QStringList() << "a" << "b" << "d" << "c" << "e");
+        QCOMPARE(binary.getOrderedDocIds("price", true), QStringList() << "e" << "c" << "d" << "b" << "a");
+        QCOMPARE(binary.getIndexedDocIdsInRange("price", 10, QVariant()), QStringList() << "b" << "d");
+        Index binaryIndex;
+        binaryIndex.setDatabase(&binary);
+        binaryIndex.setName("by-price");
+        binaryIndex.setExpression(QStringList() << "price");
+        Query binaryQuery;
+        binaryQuery.setIndex(&binaryIndex);
+        binaryQuery.setOrderBy(QStringList() << "price");
+        QCOMPARE(binaryQuery.getDocuments(), binary.getOrderedDocIds("price"));
+        binaryQuery.setOrderBy(QStringList() << "price desc");
+        QCOMPARE(binaryQuery.getDocuments(), binary.getOrderedDocIds("price", true));
+    }
+
+    void testLazyQuery()
+    {
+        Database db;
+        QVariantList docs;
+        QStringList docIds;
+        for (int i = 0; i < 250; i++)
+        {
+            QVariantMap doc;
+            doc.insert("n", i);
+            docs << doc;
+            docIds << QString("doc%1").arg(i, 3, 10, QChar('0'));
+        }
+        db.putDocs(docs, docIds);
+        QCOMPARE(db.putIndex("by-n", QStringList() << "n"), QString());
+        Index index;
+        index.setDatabase(&db);
+        index.setName("by-n");
+        index.setExpression(QStringList() << "n");
+
+        Query query;
+        query.setLazy(true);
+        query.setOrderBy(QStringList() << "n desc");
+        query.setIndex(&index);
+        QCOMPARE(query.rowCount(), 0);
+        QVERIFY(query.canFetchMore(QModelIndex()));
+        query.fetchMore(QModelIndex());
+        QCOMPARE(query.rowCount(), 100);
+        QCOMPARE(query.data(query.index(0), 1).toString(), QString("doc249"));
+        while (query.canFetchMore(QModelIndex()))
+            query.fetchMore(QModelIndex());
+        QCOMPARE(query.rowCount(), 250);
+
+        // Changed documents move to their new rows without a reset
+        QSignalSpy queryReset(&query, SIGNAL(modelReset()));
+        QVariantMap doc;
+        doc.insert("n", -1);
+        db.putDoc(doc, "doc249");
+        QCOMPARE(query.rowCount(), 250);
+        QCOMPARE(query.data(query.index(0), 1).toString(), QString("doc248"));
+        QCOMPARE(query.data(query.index(249), 1).toString(), QString("doc249"));
+        doc.insert("n", 1000);
+        db.putDoc(doc, "new");
+        QCOMPARE(query.rowCount(), 251);
+        QCOMPARE(query.data(query.index(0), 1).toString(), QString("new"));
+        db.deleteDoc("new");
+        QCOMPARE(query.rowCount(), 250);
+        QCOMPARE(queryReset.count(), 0);
+        doc.insert("n", 249);
+        db.putDoc(doc, "doc249");
+
+        query.setOffset(5);
+        query.setLimit(10);
+        QCOMPARE(query.rowCount(), 0);
+        query.fetchMore(QModelIndex());
+        QCOMPARE(query.rowCount(), 10);
+        QCOMPARE(query.data(query.index(0), 1).toString(), QString("doc244"));
+        QVERIFY(!query.canFetchMore(QModelIndex()));
+
+        // Without lazy fetching the window is applied to all results
+        query.setLazy(false);
+        QCOMPARE(query.rowCount(), 10);
+        QCOMPARE(query.getDocuments().first(), QString("doc244"));
+        query.setOrderBy(QStringList());
+        QCOMPARE(query.getDocuments().first(), QString("doc005"));
+    }
+
+    void testDocumentCache()
+    {
+        Database db;
+        QVariant blue(QJsonDocument::fromJson("{\"color\": \"blue\"}").toVariant());
+        QVariant green(QJsonDocument::fromJson("{\"color\": \"green\"}").toVariant());
+        db.putDoc(blue, "a");
+        QCOMPARE(db.getDoc("a"), blue);
+        int misses = db.getStatistics()["documentCacheMisses"].toInt();
+        QCOMPARE(db.getDocUnchecked("a"), blue);
+        QCOMPARE(db.getDoc("a"), blue);
+        QCOMPARE(db.getStatistics()["documentCacheMisses"].toInt(), misses);
+        QVERIFY(db.getStatistics()["documentCacheHits"].toInt() >= 2);
+
+        // Writing invalidates the cached document
+        db.putDoc(green, "a");
+        QCOMPARE(db.getDoc("a"), green);
+        QCOMPARE(db.getStatistics()["documentCacheMisses"].toInt(), misses + 1);
+
+        db.setDocumentCacheSize(0);
+        QCOMPARE(db.getDoc("a"), green);
+        QCOMPARE(db.getStatistics()["documentCacheCount"].toInt(), 0);
+    }
+
+    void testStorageFormat()
+    {
+        Database db;
+        db.setDocumentCacheSize(0);
+        QVariant blue(QJsonDocument::fromJson("{\"color\": \"blue\", \"size\": 2}").toVariant());
+        db.setStorageFormat(Database::IndentedJson);
+        db.putDoc(blue, "indented");
+        QVERIFY(db.getDocumentContents("indented").contains("\n"));
+        db.setStorageFormat(Database::Binary);
+        db.putDoc(blue, "binary");
+        QCOMPARE(db.getDoc("binary"), blue);
+        QCOMPARE(db.getDoc("indented"), blue);
+        QCOMPARE(QJsonDocument::fromJson(db.getDocumentContents("binary").toUtf8()).toVariant(), blue);
+
+        db.setStorageFormat(Database::CompactJson);
+        QCOMPARE(db.migrateStorageFormat(), 2);
+        QVERIFY(!db.getDocumentContents("indented").contains("\n"));
+        QVERIFY(!db.getDocumentContents("binary").contains("\n"));
+        QCOMPARE(db.getDoc("indented"), blue);
+        QCOMPARE(db.getDoc("binary"), blue);
+        QCOMPARE(db.migrateStorageFormat(), 0);
+    }
+
+    void testAsync()
+    {
+        Database db;
+        QTemporaryFile file;
+        QCOMPARE(file.open(), true);
+        db.setPath(file.fileName());
+        QSignalSpy docChanged(&db, SIGNAL(docChanged(const QString&, QVariant)));
+        QVariant blue(QJsonDocument::fromJson("{\"color\": \"blue\"}").toVariant());
+        QVariant green(QJsonDocument::fromJson("{\"color\": \"green\"}").toVariant());
+
+        AsyncResult* first = db.putDocAsync(blue, "a");
+        QFuture<QVariant> future(first->future());
+        QSignalSpy firstFinished(first, SIGNAL(finished(const QVariant&)));
+        AsyncResult* second = db.putDocAsync(green, "a");
+        QSignalSpy secondFinished(second, SIGNAL(finished(const QVariant&)));
+        AsyncResult* get = db.getDocAsync("a");
+        QSignalSpy getFinished(get, SIGNAL(finished(const QVariant&)));
+        QVERIFY(getFinished.wait());
+
+        // Results arrive in the order the operations were requested
+        QCOMPARE(firstFinished.count(), 1);
+        QCOMPARE(secondFinished.count(), 1);
+        QCOMPARE(docChanged.count(), 2);
+        QVERIFY(future.isFinished());
+        QVERIFY(!future.result().toString().isEmpty());
+        QCOMPARE(getFinished.at(0).at(0), green);
+        QCOMPARE(db.getDoc("a"), green);
+
+        AsyncResult* list = db.listDocsAsync();
+        QSignalSpy listFinished(list, SIGNAL(finished(const QVariant&)));
+        QVERIFY(listFinished.wait());
+        QCOMPARE(listFinished.at(0).at(0).toStringList(), QStringList() << "a");
+
+        // In-memory databases answer on the owner's connection
+        Database memory;
+        AsyncResult* put = memory.putDocAsync(blue);
+        QSignalSpy putFinished(put, SIGNAL(finished(const QVariant&)));
+        QVERIFY(putFinished.wait());
+        QCOMPARE(memory.listDocs().count(), 1);
+    }
+
+    void testReaderThreads()
+    {
+        Database db;
+        db.setJournalMode("WAL");
+        QTemporaryFile file;
+        QCOMPARE(file.open(), true);
+        db.setPath(file.fileName());
+        QVariant blue(QJsonDocument::fromJson("{\"color\": \"blue\"}").toVariant());
+        db.putIndex("by-color", QStringList() << "color");
+        db.putDoc(blue, "a");
+        db.putDoc(blue, "b");
+
+        QSignalSpy docLoaded(&db, SIGNAL(docLoaded(const QString&, QVariant)));
+        QList<ReaderThread*> readers;
+        for (int i = 0; i < 4; i++)
+        {
+            readers.append(new ReaderThread(&db));
+            readers.last()->start();
+        }
+        Q_FOREACH (ReaderThread* reader, readers)
+        {
+            QVERIFY(reader->wait(5000));
+            QCOMPARE(reader->contents, blue);
+            QCOMPARE(reader->docIds, QStringList() << "a" << "b");
+            QCOMPARE(reader->indexed, QStringList() << "a" << "b");
+        }
+        qDeleteAll(readers);
+        QVERIFY(db.lastError().isEmpty());
+        // Signals aren't emitted from the reader threads
+        QCOMPARE(docLoaded.count(), 0);
+
+        // The writer isn't blocked by readers
+        QVERIFY(!db.putDoc(blue, "c").isEmpty());
+        QCOMPARE(QStringList(db.listDocs()), QStringList() << "a" << "b" << "c");
+    }
+
+    void testMemoryReaderThread()
+    {
+        Database db;
+        QVariant blue(QJsonDocument::fromJson("{\"color\": \"blue\"}").toVariant());
+        db.putDoc(blue, "a");
+
+        // Other threads can't share the connection of an in-memory database
+        ReaderThread reader(&db);
+        reader.start();
+        QVERIFY(reader.wait(5000));
+        QCOMPARE(reader.contents, QVariant());
+        QCOMPARE(reader.docIds, QStringList());
+        QCOMPARE(db.lastError(), QString("Reads from other threads need a file database"));
+        QCOMPARE(db.getDoc("a"), blue);
+    }
+
+    void testConflicted()
+    {
+        QTemporaryFile file;
+        QCOMPARE(file.open(), true);
+        {
+            // A database as created before conflicts were tracked per document
+            QSqlDatabase raw(QSqlDatabase::addDatabase("QSQLITE", "testConflicted"));
+            raw.setDatabaseName(file.fileName());
+            QVERIFY(raw.open());
+            raw.exec("CREATE TABLE transaction_log (generation INTEGER PRIMARY KEY AUTOINCREMENT, doc_id TEXT NOT NULL, transaction_id TEXT NOT NULL)");
+            raw.exec("CREATE TABLE document (doc_id TEXT PRIMARY KEY, doc_rev TEXT NOT NULL, content TEXT)");
+            raw.exec("CREATE TABLE conflicts (doc_id TEXT, doc_rev TEXT, content TEXT, CONSTRAINT conflicts_pkey PRIMARY KEY (doc_id, doc_rev))");
+            raw.exec("CREATE TABLE document_fields (doc_id TEXT NOT NULL, field_name TEXT NOT NULL, value TEXT)");
+            raw.exec("CREATE TABLE index_definitions (name TEXT, offset INT, field TEXT, CONSTRAINT index_definitions_pkey PRIMARY KEY (name, offset))");
+            raw.exec("CREATE TABLE u1db_config (name TEXT PRIMARY KEY, value TEXT)");
+            raw.exec("INSERT INTO u1db_config VALUES ('sql_schema', '0')");
+            raw.exec("INSERT INTO document VALUES ('a', 'r:1', '{}'), ('b', 'r:1', '{}')");
+            raw.exec("INSERT INTO conflicts VALUES ('b', 'q:1', '{}')");
+            raw.close();
+        }
+        QSqlDatabase::removeDatabase("testConflicted");
+
+        Database db;
+        db.setPath(file.fileName());
+        QVERIFY(db.lastError().isEmpty());
+        QCOMPARE(QStringList(db.listDocs()), QStringList() << "a" << "b");
+        db.getDoc("a");
+        QVERIFY(db.lastError().isEmpty());
+        db.getDoc("b");
+        QCOMPARE(db.lastError(), QString("Conflicts in b"));
+
+        {
+            QSqlDatabase raw(QSqlDatabase::addDatabase("QSQLITE", "testConflicted"));
+            raw.setDatabaseName(file.fileName());
+            QVERIFY(raw.open());
+            raw.exec("INSERT INTO conflicts VALUES ('a', 'q:1', '{}')");
+            raw.exec("DELETE FROM conflicts WHERE doc_id = 'b'");
+            QSqlQuery query(raw.exec("SELECT doc_id FROM document WHERE conflicted ORDER BY doc_id"));
+            QVERIFY(query.next());
+            QCOMPARE(query.value(0).toString(), QString("a"));
+            QVERIFY(!query.next());
+            query.finish();
+            query.clear();
+            raw.close();
+        }
+        QSqlDatabase::removeDatabase("testConflicted");
+    }
+
+    void testUpgradeIndexes()
+    {
+        QTemporaryFile file;
+        QCOMPARE(file.open(), true);
+        {
+            // A database with an index as created before document_fields was filled
+            QSqlDatabase raw(QSqlDatabase::addDatabase("QSQLITE", "testUpgradeIndexes"));
+            raw.setDatabaseName(file.fileName());
+            QVERIFY(raw.open());
+            raw.exec("CREATE TABLE transaction_log (generation INTEGER PRIMARY KEY AUTOINCREMENT, doc_id TEXT NOT NULL, transaction_id TEXT NOT NULL)");
+            raw.exec("CREATE TABLE document (doc_id TEXT PRIMARY KEY, doc_rev TEXT NOT NULL, content TEXT)");
+            raw.exec("CREATE TABLE document_fields (doc_id TEXT NOT NULL, field_name TEXT NOT NULL, value TEXT)");
+            raw.exec("CREATE INDEX document_fields_field_value_doc_idx ON document_fields(field_name, value, doc_id)");
+            raw.exec("CREATE TABLE sync_log (replica_uid TEXT PRIMARY KEY, known_generation INTEGER, known_transaction_id TEXT)");
+            raw.exec("CREATE TABLE conflicts (doc_id TEXT, doc_rev TEXT, content TEXT, CONSTRAINT conflicts_pkey PRIMARY KEY (doc_id, doc_rev))");
+            raw.exec("CREATE TABLE index_definitions (name TEXT, offset INT, field TEXT, CONSTRAINT index_definitions_pkey PRIMARY KEY (name, offset))");
+            raw.exec("CREATE TABLE u1db_config (name TEXT PRIMARY KEY, value TEXT)");
+            raw.exec("INSERT INTO u1db_config VALUES ('sql_schema', '0')");
+            raw.exec("INSERT INTO u1db_config VALUES ('replica_uid', '{6e4e2d3c-0e8a-4b0e-9d7c-3a1f1e0b9a21}')");
+            raw.exec("INSERT INTO index_definitions VALUES ('by-done', 0, 'done'), ('by-color', 0, 'color')");
+            raw.exec("INSERT INTO document VALUES ('a', 'r:1', '{\"done\": true, \"color\": \"blue\"}'), "
+                "('b', 'r:1', '{\"done\": false, \"color\": \"red\"}')");
+            raw.close();
+        }
+        QSqlDatabase::removeDatabase("testUpgradeIndexes");
+
+        Database db;
+        db.setPath(file.fileName());
+        QCOMPARE(db.getIndexedDocIds("done", QStringList() << "true"), QStringList() << "a");
+        QCOMPARE(db.getIndexedDocIds("color", QStringList() << "red"), QStringList() << "b");
+        QVERIFY(db.lastError().isEmpty());
+
+        Index index;
+        index.setDatabase(&db);
+        index.setName("by-done");
+        index.setExpression(QStringList() << "done");
+        Query query;
+        query.setIndex(&index);
+        query.setQuery("false");
+        QCOMPARE(query.getDocuments(), QStringList() << "b");
+    }
+
+    void testForEachDoc()
+    {
+        Database db;
+        QVariantList docs;
+        QStringList docIds;
+        for (int i = 0; i < 250; i++)
+        {
+            docs << QJsonDocument::fromJson("{\"color\": \"blue\"}").toVariant();
+            docIds << QString("doc%1").arg(i, 3, 10, QChar('0'));
+        }
+        db.putDocs(docs, docIds);
+
+        QStringList visited;
+        QVERIFY(db.forEachDoc([&visited](const QString& docId, const QString& revision, const QByteArray& content) {
+            visited << docId;
+            return !revision.isEmpty() && Database::parseContents(content)["color"] == "blue";
+        }, 100));
+        QCOMPARE(visited, docIds);
+
+        visited.clear();
+        QVERIFY(db.forEachDoc([&visited](const QString& docId, const QString&, const QByteArray&) {
+            visited << docId;
+            return visited.count() < 5;
+        }));
+        QCOMPARE(visited, docIds.mid(0, 5));
+
+        QCOMPARE(QStringList(db.listDocs(240, 100)), docIds.mid(240));
+        QCOMPARE(QStringList(db.listDocs(10, 2)), docIds.mid(10, 2));
+    }
+
+    void testCompactTransactionLog()
+    {
+        QTemporaryFile file;
+        QCOMPARE(file.open(), true);
+        Database db;
+        db.setPath(file.fileName());
+        QVariant blue(QJsonDocument::fromJson("{\"color\": \"blue\"}").toVariant());
+        db.putDoc(blue, "a");
+        db.putDoc(blue, "a");
+        db.putDoc(blue, "b");
+        db.putDoc(blue, "a");
+        QCOMPARE(db.listTransactionsSince(0).count(), 4);
+
+        {
+            // A replica that knows the log up to the second transaction
+            QSqlDatabase raw(QSqlDatabase::addDatabase("QSQLITE", "testCompactTransactionLog"));
+            raw.setDatabaseName(file.fileName());
+            QVERIFY(raw.open());
+            raw.exec("INSERT INTO sync_log VALUES ('other', 2, 'T-x')");
+            raw.close();
+        }
+        QSqlDatabase::removeDatabase("testCompactTransactionLog");
+
+        QCOMPARE(db.compactTransactionLog(), 1);
+        QCOMPARE(db.listTransactionsSince(0).count(), 3);
+        QCOMPARE(db.getStatistics()["transactionsReclaimed"].toInt(), 1);
+
+        // Compaction happens by itself once enough documents were written
+        Database memory;
+        memory.setCompactionThreshold(3);
+        memory.putDoc(blue, "a");
+        memory.putDoc(blue, "a");
+        QCOMPARE(memory.listTransactionsSince(0).count(), 2);
+        memory.putDoc(blue, "a");
+        QStringList transactions(memory.listTransactionsSince(0));
+        QCOMPARE(transactions.count(), 1);
+        QVERIFY(transactions.first().startsWith("3|a|"));
+    }
+
+    void testTombstones()
+    {
+        Database db;
+        QVariant blue(QJsonDocument::fromJson("{\"color\": \"blue\"}").toVariant());
+        db.putDoc(blue, "a");
+        db.putDoc(blue, "b");
+        db.fetchMore(QModelIndex());
+        QCOMPARE(db.rowCount(), 2);
+
+        db.deleteDoc("a");
+        QCOMPARE(db.rowCount(), 1);
+        QCOMPARE(QStringList(db.listDocs()), QStringList() << "b");
+        QCOMPARE(QStringList(db.listDocs(0, 10)), QStringList() << "b");
+        QCOMPARE(db.listTransactionsSince(0).count(), 3);
+
+        // The deletion happened in generation 3
+        QCOMPARE(db.purgeTombstones(3), 0);
+        QCOMPARE(db.purgeTombstones(4), 1);
+        QCOMPARE(db.listTransactionsSince(0).count(), 1);
+        QVERIFY(db.lastError().isEmpty());
+
+        // Tombstones read like missing documents
+        Database source;
+        source.putDoc(blue, "a");
+        source.putDoc(blue, "b");
+        source.deleteDoc("a");
+        QVERIFY(source.lastError().isEmpty());
+        QVERIFY(!source.getDocUnchecked("a").isValid());
+        QVERIFY(!source.getDoc("a").isValid());
+        QCOMPARE(source.lastError(), QString("Failed to get document a: No document"));
+
+        // Nothing is written for documents that don't exist
+        source.deleteDoc("missing");
+        QCOMPARE(source.lastError(), QString("Failed to delete document missing: No document"));
+        source.deleteDoc("a");
+        QCOMPARE(source.lastError(), QString("Failed to delete document a: No document"));
+        source.deleteDocs(QStringList() << "b" << "missing");
+        QCOMPARE(QStringList(source.listDocs()), QStringList() << "b");
+        QCOMPARE(source.listTransactionsSince(0).count(), 3);
+
+        // The tombstone is synced as such
+        Database target;
+        target.putDoc(blue, "a");
+        target.updateDocRevisionNumber("a", "x:1");
+        source.updateDocRevisionNumber("a", "x:2");
+        Synchronizer synchronizer;
+        synchronizer.syncDocument(&source, &target, "a");
+        QCOMPARE(target.getCurrentDocRevisionNumber("a"), QString("x:2"));
+        QVERIFY(!target.getDocUnchecked("a").isValid());
+        QCOMPARE(QStringList(target.listDocs()), QStringList());
+        QVERIFY(target.lastError().isEmpty());
+    }
+
+    void testBackup()
+    {
+        QTemporaryDir dir;
+        QVERIFY(dir.isValid());
+        QVariant blue(QJsonDocument::fromJson("{\"color\": \"blue\"}").toVariant());
+        Database db;
+        db.setPath(dir.path() + "/source.u1db");
+        db.putDoc(blue, "a");
+        db.putDoc(blue, "b");
+
+        AsyncResult* backup = db.backupTo(dir.path() + "/backup.u1db", 1);
+        QSignalSpy finished(backup, SIGNAL(finished(const QVariant&)));
+        QVERIFY(finished.wait());
+        QCOMPARE(finished.at(0).at(0).toBool(), true);
+        Database copy;
+        copy.setPath(dir.path() + "/backup.u1db");
+        QCOMPARE(QStringList(copy.listDocs()), QStringList() << "a" << "b");
+        QCOMPARE(copy.getDoc("a"), blue);
+
+        // In-memory contents survive in the snapshot
+        QString snapshot(dir.path() + "/snapshot.u1db");
+        {
+            Database memory;
+            memory.setSnapshotPath(snapshot);
+            memory.putDoc(blue, "c");
+        }
+        Database memory;
+        memory.setSnapshotPath(snapshot);
+        QCOMPARE(QStringList(memory.listDocs()), QStringList() << "c");
+        QCOMPARE(memory.getDoc("c"), blue);
+        QVERIFY(memory.lastError().isEmpty());
+    }
+
+    void testLazyOpen()
+    {
+        Database db;
+        QCOMPARE(db.getStatistics()["initializeTime"].toLongLong(), Q_INT64_C(0));
+        QTemporaryFile file;
+        QCOMPARE(file.open(), true);
+        db.setPath(file.fileName());
+        QVERIFY(db.getStatistics()["initializeTime"].toLongLong() > 0);
+        QVERIFY(db.lastError().isEmpty());
+        QVERIFY(!db.putDoc(QJsonDocument::fromJson("{\"color\": \"blue\"}").toVariant(), "a").isEmpty());
+
+        // A database that's used right away is in memory
+        Database memory;
+        QCOMPARE(QStringList(memory.listDocs()), QStringList());
+        QVERIFY(memory.getStatistics()["initializeTime"].toLongLong() > 0);
+    }
+
+    void testSharedConnection()
+    {
+        QTemporaryFile file;
+        QCOMPARE(file.open(), true);
+        Database first;
+        first.setPath(file.fileName());
+        Database second;
+        second.setPath(file.fileName());
+        QSignalSpy docChanged(&second, SIGNAL(docChanged(const QString&, QVariant)));
+        QSignalSpy docsChanged(&second, SIGNAL(docsChanged(const QStringList&)));
+
+        first.putDoc(QJsonDocument::fromJson("{\"color\": \"blue\"}").toVariant(), "a");
+        QCOMPARE(docChanged.count(), 1);
+        QCOMPARE(second.getDoc("a").toMap()["color"].toString(), QString("blue"));
+
+        // The cached contents of the second database are replaced
+        first.putDoc(QJsonDocument::fromJson("{\"color\": \"red\"}").toVariant(), "a");
+        QCOMPARE(docChanged.count(), 2);
+        QCOMPARE(second.getDoc("a").toMap()["color"].toString(), QString("red"));
+
+        first.deleteDocs(QStringList() << "a");
+        QCOMPARE(docsChanged.count(), 1);
+        QCOMPARE(QStringList(second.listDocs()), QStringList());
+
+        // The connection outlives the first database
+        first.setPath("");
+        second.putDoc(QJsonDocument::fromJson("{\"color\": \"green\"}").toVariant(), "b");
+        QCOMPARE(QStringList(second.listDocs()), QStringList() << "b");
+        QVERIFY(second.lastError().isEmpty());
+
+        // Later users can't change the settings of the shared connection
+        Database third;
+        third.setJournalMode("wal");
+        third.setPath(file.fileName());
+        QVERIFY(!third.lastError().isEmpty());
+        QCOMPARE(QStringList(third.listDocs()), QStringList() << "b");
+        QVERIFY(second.lastError().isEmpty());
+    }
+
+    void testRevisions()
+    {
+        Database db;
+        QVariant contents(QJsonDocument::fromJson("{\"color\": \"blue\"}").toVariant());
+        QString first(db.putDoc(contents, "a"));
+        QVERIFY(first.endsWith(":1"));
+        QString replica(first.left(first.indexOf(':')));
+        QVERIFY(!replica.contains('{'));
+        QCOMPARE(db.putDoc(contents, "a"), replica + ":2");
+
+        // Changes that were synced from other replicas are kept
+        db.updateDocRevisionNumber("a", replica + ":2|zzz:3");
+        QCOMPARE(db.putDoc(contents, "a"), replica + ":3|zzz:3");
+        QCOMPARE(db.putDoc(contents, "b"), replica + ":1");
+    }
+
+    void testRevisionOrder()
+    {
+        Revision a(Revision::fromString("a:1"));
+        Revision ab(Revision::fromString("a:1|b:1"));
+        Revision b(Revision::fromString("b:2"));
+        QCOMPARE(a.compare(Revision::fromString("a:1")), Revision::Equal);
+        QCOMPARE(Revision().compare(a), Revision::Before);
+        QCOMPARE(a.compare(ab), Revision::Before);
+        QCOMPARE(ab.compare(a), Revision::After);
+        QCOMPARE(ab.compare(b), Revision::Concurrent);
+        QCOMPARE(Revision::fromString("a:2").compare(ab), Revision::Concurrent);
+        // Replicas are compared in order whatever order they were given in
+        QCOMPARE(Revision::fromString("b:1|a:1").compare(ab), Revision::Equal);
+
+        QCOMPARE(ab.merged(b).toString(), QString("a:1|b:2"));
+        QCOMPARE(ab.merged(b).compare(ab), Revision::After);
+        QCOMPARE(ab.merged(b).compare(b), Revision::After);
+        QCOMPARE(a.merged(Revision()).toString(), QString("a:1"));
+    }
+
+    void testSyncTargetAhead()
+    {
+        Database source;
+        Database target;
+        QVariant blue(QJsonDocument::fromJson("{\"color\": \"blue\"}").toVariant());
+        QVariant red(QJsonDocument::fromJson("{\"color\": \"red\"}").toVariant());
+        source.putDoc(blue, "a");
+        source.updateDocRevisionNumber("a", "x:1");
+        target.putDoc(red, "a");
+        target.updateDocRevisionNumber("a", "x:1|y:1");
+
+        // The target already has a later change, it's kept as it is
+        Synchronizer synchronizer;
+        synchronizer.syncDocument(&source, &target, "a");
+        QCOMPARE(target.getDoc("a"), red);
+        QCOMPARE(target.getCurrentDocRevisionNumber("a"), QString("x:1|y:1"));
+
+        // A concurrent change is replaced and both histories are kept
+        source.updateDocRevisionNumber("a", "x:2");
+        synchronizer.syncDocument(&source, &target, "a");
+        QCOMPARE(target.getDoc("a"), blue);
+        QCOMPARE(target.getCurrentDocRevisionNumber("a"), QString("x:2|y:1"));
+    }
+
+    void testLazyDocument()
+    {
+        Database db;
+        QVariant contents(QJsonDocument::fromJson("{\"color\": \"blue\", \"size\": {\"width\": 2}, \"tags\": [\"a\"]}").toVariant());
+        db.putDoc(contents, "text");
+        db.setStorageFormat(Database::Binary);
+        db.putDoc(contents, "binary");
+
+        Q_FOREACH (QString docId, QStringList() << "text" << "binary")
+        {
+            QScopedPointer<LazyDocument> doc(db.getLazyDoc(docId));
+            QVERIFY(!doc.isNull());
+            QCOMPARE(doc->getDocId(), docId);
+            QCOMPARE(doc->value("color").toString(), QString("blue"));
+            QCOMPARE(doc->value("size.width").toInt(), 2);
+            QCOMPARE(doc->value("tags").toList(), QVariantList() << "a");
+            QVERIFY(doc->contains("size.width"));
+            QVERIFY(!doc->contains("size.height"));
+            QVERIFY(!doc->value("color.name").isValid());
+            QCOMPARE(doc->keys(), QStringList() << "color" << "size" << "tags");
+            QCOMPARE(QVariant(doc->toMap()), contents);
+        }
+
+        db.deleteDoc("text");
+        QVERIFY(!db.getLazyDoc("text"));
+        QVERIFY(!db.getLazyDoc("missing"));
+    }
+
+    void testProjection()
+    {
+        Database db;
+        QVariant contents(QJsonDocument::fromJson("{\"color\": \"blue\", \"size\": {\"width\": 2, \"height\": 3}, \"tags\": [\"a\", \"b\"], \"round\": true}").toVariant());
+        db.putDoc(contents, "text");
+        db.setStorageFormat(Database::Binary);
+        db.putDoc(contents, "binary");
+
+        QStringList fields(QStringList() << "color" << "size.width" << "tags" << "round" << "missing");
+        QVariantMap expected(QJsonDocument::fromJson("{\"color\": \"blue\", \"size\": {\"width\": 2}, \"tags\": [\"a\", \"b\"], \"round\": true}").toVariant().toMap());
+        QCOMPARE(db.getDoc("text", fields).toMap(), expected);
+        QCOMPARE(db.getDoc("binary", fields).toMap(), expected);
+        QVERIFY(db.lastError().isEmpty());
+
+        db.deleteDoc("text");
+        QVERIFY(!db.getDoc("text", fields).isValid());
+    }
+
+    void testFieldIndexes()
+    {
+        QTemporaryFile file;
+        QCOMPARE(file.open(), true);
+        Database db;
+        db.setPath(file.fileName());
+        db.putDoc(QJsonDocument::fromJson("{\"color\": \"blue\", \"tags\": [\"x\", \"y\"]}").toVariant(), "a");
+        db.putDoc(QJsonDocument::fromJson("{\"color\": \"red\", \"tags\": [\"y\"]}").toVariant(), "b");
+        db.putDoc(QJsonDocument::fromJson("{\"color\": 7}").toVariant(), "c");
+        QCOMPARE(db.putIndex("by-color", QStringList() << "color"), QString());
+
+        QSqlDatabase raw(QSqlDatabase::addDatabase("QSQLITE", "testFieldIndexes"));
+        raw.setDatabaseName(file.fileName());
+        QVERIFY(raw.open());
+        QSqlQuery query(raw.exec("SELECT name FROM sqlite_master WHERE type = 'index' AND name LIKE 'document_field:%'"));
+        QVERIFY(query.next());
+        QCOMPARE(query.value(0).toString(), QString("document_field:color"));
+        query.finish();
+
+        QCOMPARE(db.getIndexedDocIds("color", QStringList() << "blue"), QStringList() << "a");
+        QCOMPARE(db.getIndexedDocIds("color", QStringList() << "r*"), QStringList() << "b");
+        QCOMPARE(db.getIndexedDocIds("color", QStringList() << "7"), QStringList() << "c");
+        QCOMPARE(db.getIndexedDocIds("color", QStringList() << "*"), QStringList() << "a" << "b" << "c");
+        QCOMPARE(db.getIndexKeys("by-color"), QStringList() << "7" << "blue" << "red");
+
+        // New documents are found through the index as well
+        db.putDoc(QJsonDocument::fromJson("{\"color\": \"blue\"}").toVariant(), "d");
+        QCOMPARE(db.getIndexedDocIds("color", QStringList() << "blue"), QStringList() << "a" << "d");
+
+        // Changing the index replaces its fields
+        QCOMPARE(db.putIndex("by-color", QStringList() << "tags"), QString());
+        QCOMPARE(db.getIndexedDocIds("tags", QStringList() << "y"), QStringList() << "a" << "b");
+        QCOMPARE(db.getIndexedDocIds("color", QStringList() << "blue"), QStringList());
+
+        QCOMPARE(db.deleteIndex("by-color"), QString());
+        QCOMPARE(db.getIndexedDocIds("tags", QStringList() << "y"), QStringList());
+        QVERIFY(!raw.exec("SELECT name FROM sqlite_master WHERE name LIKE 'document_field:%'").next());
+        QVERIFY(db.lastError().isEmpty());
+        query = QSqlQuery();
+        raw.close();
+        raw = QSqlDatabase();
+        QSqlDatabase::removeDatabase("testFieldIndexes");
+    }
+
     void cleanupTestCase()
     {
     }